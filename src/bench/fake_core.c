@@ -0,0 +1,211 @@
+/*
+    Ucollect - small utility for real-time analysis of network data
+    Copyright (C) 2015 CZ.NIC, z.s.p.o. (http://www.nic.cz/)
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "fake_core.h"
+
+#include "../core/loop.h"
+#include "../core/uplink.h"
+#include "../core/context.h"
+#include "../core/mem_pool.h"
+#include "../core/util.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+struct timeout {
+	uint64_t when;
+	size_t id;
+	struct context *context;
+	void *data;
+	void (*callback)(struct context *context, void *data, size_t id);
+};
+
+struct loop {
+	const char *plugin_name;
+	uint64_t now;
+	struct timeout *timeouts;
+	size_t timeout_count, timeout_capacity, timeout_id;
+	struct mem_pool **pools;
+	size_t pool_count;
+	struct slab **slabs;
+	size_t slab_count;
+	size_t messages, message_bytes;
+};
+
+struct loop *fake_loop_create(const char *plugin_name, uint64_t now) {
+	struct loop *loop = malloc(sizeof *loop);
+	if (!loop)
+		die("Couldn't allocate the fake loop\n");
+	*loop = (struct loop) {
+		.plugin_name = plugin_name,
+		.now = now
+	};
+	return loop;
+}
+
+void fake_loop_destroy(struct loop *loop) {
+	for (size_t i = 0; i < loop->pool_count; i ++)
+		mem_pool_destroy(loop->pools[i]);
+	free(loop->pools);
+	for (size_t i = 0; i < loop->slab_count; i ++)
+		slab_destroy(loop->slabs[i]);
+	free(loop->slabs);
+	free(loop->timeouts);
+	free(loop);
+}
+
+struct mem_pool *fake_pool_create(struct loop *loop, const char *name) {
+	struct mem_pool *pool = mem_pool_create(name);
+	loop->pools = realloc(loop->pools, (loop->pool_count + 1) * sizeof *loop->pools);
+	if (!loop->pools)
+		die("Couldn't track the pool %s\n", name);
+	return loop->pools[loop->pool_count ++] = pool;
+}
+
+void fake_loop_advance(struct loop *loop, uint64_t now) {
+	if (now > loop->now)
+		loop->now = now;
+	for (;;) {
+		// There are only few timeouts, so simply look for the earliest one
+		size_t earliest = loop->timeout_count;
+		for (size_t i = 0; i < loop->timeout_count; i ++)
+			if (loop->timeouts[i].when <= loop->now && (earliest == loop->timeout_count || loop->timeouts[i].when < loop->timeouts[earliest].when))
+				earliest = i;
+		if (earliest == loop->timeout_count)
+			return;
+		// Take it out before calling, the callback may add more
+		struct timeout timeout = loop->timeouts[earliest];
+		loop->timeouts[earliest] = loop->timeouts[-- loop->timeout_count];
+		timeout.callback(timeout.context, timeout.data, timeout.id);
+		if (timeout.context)
+			mem_pool_reset(timeout.context->temp_pool);
+	}
+}
+
+size_t fake_loop_memory(const struct loop *loop) {
+	size_t result = 0;
+	for (size_t i = 0; i < loop->pool_count; i ++)
+		result += mem_pool_allocated(loop->pools[i]);
+	for (size_t i = 0; i < loop->slab_count; i ++)
+		result += slab_allocated(loop->slabs[i]);
+	return result;
+}
+
+size_t fake_loop_messages(const struct loop *loop, size_t *bytes) {
+	*bytes = loop->message_bytes;
+	return loop->messages;
+}
+
+/*
+ * The rest are the functions of the core the plugins call.
+ */
+
+uint64_t loop_now(struct loop *loop) {
+	return loop->now;
+}
+
+uint64_t loop_packet_time(struct loop *loop) {
+	return loop->now * 1000; // The time follows the packets here
+}
+
+size_t loop_timeout_add(struct loop *loop, uint32_t after, struct context *context, void *data, void (*callback)(struct context *context, void *data, size_t id)) {
+	if (loop->timeout_count == loop->timeout_capacity) {
+		loop->timeout_capacity = loop->timeout_capacity ? 2 * loop->timeout_capacity : 8;
+		loop->timeouts = realloc(loop->timeouts, loop->timeout_capacity * sizeof *loop->timeouts);
+		if (!loop->timeouts)
+			die("Couldn't allocate timeouts\n");
+	}
+	loop->timeouts[loop->timeout_count ++] = (struct timeout) {
+		.when = loop->now + after,
+		.id = loop->timeout_id,
+		.context = context,
+		.data = data,
+		.callback = callback
+	};
+	return loop->timeout_id ++;
+}
+
+void loop_timeout_cancel(struct loop *loop, size_t id) {
+	for (size_t i = 0; i < loop->timeout_count; i ++)
+		if (loop->timeouts[i].id == id) {
+			loop->timeouts[i] = loop->timeouts[-- loop->timeout_count];
+			return;
+		}
+	insane("Canceling non-existent timeout %zu\n", id);
+}
+
+struct mem_pool *loop_pool_create(struct loop *loop, struct context *current_context, const char *name) {
+	(void) current_context;
+	return fake_pool_create(loop, name);
+}
+
+struct mem_pool *loop_pool_create_huge(struct loop *loop, struct context *current_context, const char *name) {
+	(void) current_context;
+	struct mem_pool *pool = mem_pool_create_huge(name);
+	loop->pools = realloc(loop->pools, (loop->pool_count + 1) * sizeof *loop->pools);
+	if (!loop->pools)
+		die("Couldn't track the pool %s\n", name);
+	return loop->pools[loop->pool_count ++] = pool;
+}
+
+struct slab *loop_slab_create(struct loop *loop, struct context *current_context, const char *name) {
+	(void) current_context;
+	struct slab *slab = slab_create(name);
+	loop->slabs = realloc(loop->slabs, (loop->slab_count + 1) * sizeof *loop->slabs);
+	if (!loop->slabs)
+		die("Couldn't track the slab %s\n", name);
+	return loop->slabs[loop->slab_count ++] = slab;
+}
+
+const struct config_node *loop_plugin_option_get(struct context *context, const char *name) {
+	(void) context;
+	(void) name;
+	return NULL; // No config options, the plugins get their defaults
+}
+
+void loop_plugin_reinit(struct context *context) {
+	die("Plugin %s asked for reinit, it can't be benchmarked\n", context->loop->plugin_name);
+}
+
+const char *loop_plugin_get_name(const struct context *context) {
+	return context->loop->plugin_name;
+}
+
+bool loop_plugin_active(const struct context *context) {
+	(void) context;
+	return true;
+}
+
+size_t *loop_pcap_stats(struct context *context) {
+	size_t *result = mem_pool_alloc(context->temp_pool, sizeof *result);
+	*result = 0; // No interfaces
+	return result;
+}
+
+bool uplink_connected(const struct uplink *uplink) {
+	(void) uplink;
+	return true; // Pretend the messages get through, so the plugins don't keep their data
+}
+
+bool uplink_plugin_send_message(struct context *context, const void *data, size_t size) {
+	(void) data;
+	context->loop->messages ++;
+	context->loop->message_bytes += size;
+	return true;
+}
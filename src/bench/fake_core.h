@@ -0,0 +1,48 @@
+/*
+    Ucollect - small utility for real-time analysis of network data
+    Copyright (C) 2015 CZ.NIC, z.s.p.o. (http://www.nic.cz/)
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef UCOLLECT_BENCH_FAKE_CORE_H
+#define UCOLLECT_BENCH_FAKE_CORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A stand-in for the main loop, for running one plugin without the real loop,
+ * uplink or interfaces. It provides the loop_* and uplink_* functions the plugins
+ * call (they take precedence over the ones in the core library). Time moves only
+ * when told to and the messages for the server are just counted.
+ */
+
+struct loop;
+struct mem_pool;
+
+struct loop *fake_loop_create(const char *plugin_name, uint64_t now) __attribute__((nonnull)) __attribute__((malloc)) __attribute__((returns_nonnull));
+// Destroy the loop and all the pools (and slabs) created through it.
+void fake_loop_destroy(struct loop *loop) __attribute__((nonnull));
+// Create a pool accounted to the plugin.
+struct mem_pool *fake_pool_create(struct loop *loop, const char *name) __attribute__((nonnull)) __attribute__((malloc)) __attribute__((returns_nonnull));
+// Move the time (never back) and fire the timeouts that are due.
+void fake_loop_advance(struct loop *loop, uint64_t now) __attribute__((nonnull));
+// How much memory the pools and slabs of the plugin hold now.
+size_t fake_loop_memory(const struct loop *loop) __attribute__((nonnull));
+// How many messages (and bytes) the plugin sent to the server.
+size_t fake_loop_messages(const struct loop *loop, size_t *bytes) __attribute__((nonnull));
+
+#endif
@@ -0,0 +1,265 @@
+/*
+    Ucollect - small utility for real-time analysis of network data
+    Copyright (C) 2015 CZ.NIC, z.s.p.o. (http://www.nic.cz/)
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "fake_core.h"
+#include "traffic.h"
+
+#include "../core/plugin.h"
+#include "../core/packet.h"
+#include "../core/context.h"
+#include "../core/loader.h"
+#include "../core/mem_pool.h"
+#include "../core/util.h"
+#include "../core/tunable.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <endian.h>
+#include <arpa/inet.h>
+
+// Measure the time in chunks of this many packets and look at the memory between them
+#define CHUNK 1024
+
+/*
+ * Some plugins do nothing until the server configures them. These are the
+ * configurations, as the server would send them (see the plugin documentation
+ * for the formats).
+ */
+struct flow_config {
+	char opcode;
+	uint32_t conf_id;
+	uint32_t max_flows;
+	uint32_t timeout;
+	uint32_t min_packets;
+	// No filter follows, which means all the packets
+} __attribute__((packed));
+
+struct refused_config {
+	char opcode;
+	uint32_t version;
+	uint32_t finished_limit;
+	uint32_t send_limit;
+	uint32_t undecided_limit;
+	uint64_t timeout;
+	uint64_t max_age;
+} __attribute__((packed));
+
+struct buckets_config {
+	char opcode;
+	uint64_t seed;
+	uint64_t timestamp;
+	uint32_t bucket_count;
+	uint32_t hash_count;
+	uint32_t criteria_count;
+	uint32_t history_size;
+	uint32_t config_version;
+	uint32_t max_key_count;
+	uint32_t max_timeslots;
+	uint32_t time_granularity;
+	char criteria[4];
+} __attribute__((packed));
+
+static void configure(const struct plugin *plugin, struct context *context) {
+	if (!plugin->uplink_data_callback)
+		return;
+	if (strcmp(plugin->name, "Flow") == 0) {
+		const struct flow_config config = {
+			.opcode = 'C',
+			.conf_id = htonl(1),
+			.max_flows = htonl(20000),
+			.timeout = htonl(60000),
+			.min_packets = htonl(1)
+		};
+		plugin->uplink_data_callback(context, (const uint8_t *) &config, sizeof config);
+	} else if (strcmp(plugin->name, "Refused") == 0) {
+		const struct refused_config config = {
+			.opcode = 'C',
+			.version = htonl(1),
+			.finished_limit = htonl(10000),
+			.send_limit = htonl(1000),
+			.undecided_limit = htonl(10000),
+			.timeout = htobe64(30000),
+			.max_age = htobe64(60000)
+		};
+		plugin->uplink_data_callback(context, (const uint8_t *) &config, sizeof config);
+	} else if (strcmp(plugin->name, "Buckets") == 0) {
+		const struct buckets_config config = {
+			.opcode = 'C',
+			.seed = htobe64(0x0123456789ABCDEFLLU), // No half of the bits may be all zero
+			.bucket_count = htonl(256),
+			.hash_count = htonl(4),
+			.criteria_count = htonl(4),
+			.history_size = htonl(2),
+			.config_version = htonl(1),
+			.max_key_count = htonl(1000),
+			.max_timeslots = htonl(600),
+			.time_granularity = htonl(1000),
+			.criteria = { 'I', 'P', 'B', 'L' }
+		};
+		plugin->uplink_data_callback(context, (const uint8_t *) &config, sizeof config);
+	}
+	mem_pool_reset(context->temp_pool);
+}
+
+static uint64_t ns_now(void) {
+	struct timespec ts;
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		die("Couldn't get time (%s)\n", strerror(errno));
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static void bench(const char *libname, const struct packet_info **packets, size_t count) {
+	struct plugin plugin;
+	uint8_t hash[CHALLENGE_LEN / 2];
+	unsigned api_version;
+	void *library = plugin_load(libname, &plugin, hash, &api_version);
+	if (!library)
+		die("Couldn't load %s\n", libname);
+	struct loop *loop = fake_loop_create(plugin.name, count ? packets[0]->timestamp / 1000 : 0);
+	struct context context = {
+		.permanent_pool = fake_pool_create(loop, "Permanent pool"),
+		.temp_pool = fake_pool_create(loop, "Temporary pool"),
+		.loop = loop
+	};
+	// Bring it up the same way the core does
+	if (plugin.init_callback)
+		plugin.init_callback(&context);
+	if (plugin.config_check_callback && !plugin.config_check_callback(&context))
+		die("Plugin %s refused the (empty) configuration\n", plugin.name);
+	if (plugin.config_finish_callback)
+		plugin.config_finish_callback(&context, true);
+	if (plugin.uplink_connected_callback)
+		plugin.uplink_connected_callback(&context);
+	configure(&plugin, &context);
+	mem_pool_reset(context.temp_pool);
+	bool batched = api_version >= 3 && plugin.packet_batch_callback;
+	bool innermost = api_version >= 3 && plugin.packet_innermost;
+	uint64_t elapsed = 0;
+	size_t peak = fake_loop_memory(loop);
+	for (size_t start = 0; start < count; start += CHUNK) {
+		size_t end = start + CHUNK < count ? start + CHUNK : count;
+		uint64_t begin = ns_now();
+		if (batched) {
+			fake_loop_advance(loop, packets[start]->timestamp / 1000);
+			plugin.packet_batch_callback(&context, packets + start, end - start);
+			mem_pool_reset(context.temp_pool);
+		} else if (plugin.packet_callback) {
+			for (size_t i = start; i < end; i ++) {
+				fake_loop_advance(loop, packets[i]->timestamp / 1000);
+				const struct packet_info *info = packets[i];
+				if (innermost)
+					while (info->next)
+						info = info->next;
+				plugin.packet_callback(&context, info);
+				mem_pool_reset(context.temp_pool);
+			}
+		}
+		elapsed += ns_now() - begin;
+		size_t memory = fake_loop_memory(loop);
+		if (memory > peak)
+			peak = memory;
+	}
+	if (plugin.finish_callback)
+		plugin.finish_callback(&context);
+	size_t bytes;
+	size_t messages = fake_loop_messages(loop, &bytes);
+	printf("%-12s %10zu packets %12.0f packets/s %10.1f ns/packet %12zu bytes peak memory %6zu messages %10zu bytes sent\n", plugin.name, count, elapsed ? count * 1e9 / elapsed : 0, count ? (double) elapsed / count : 0, peak, messages, bytes);
+	fflush(stdout);
+	fake_loop_destroy(loop);
+	plugin_unload(library);
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "Usage: %s [-n packets] [-f flows] [-6 ipv6_percent] [-t tunnel_depth] [-g gap_us] [-s mixed|synflood|portscan] [-r seed] plugin.so...\n", name);
+	exit(1);
+}
+
+static unsigned long number(const char *text, const char *name) {
+	char *end;
+	unsigned long result = strtoul(text, &end, 10);
+	if (!*text || *end) {
+		fprintf(stderr, "The %s must be a number, not '%s'\n", name, text);
+		exit(1);
+	}
+	return result;
+}
+
+/*
+ * Run each plugin given on the command line over the same synthetic stream of
+ * packets and print how fast it was and how much memory it took.
+ */
+int main(int argc, char *argv[]) {
+	struct traffic_params params = {
+		.packets = 1000000,
+		.flows = 1000,
+		.ipv6_percent = 20,
+		.gap = 10,
+		.shape = SHAPE_MIXED,
+		.seed = 42
+	};
+	int opt;
+	while ((opt = getopt(argc, argv, "n:f:6:t:g:s:r:")) != -1)
+		switch (opt) {
+			case 'n':
+				params.packets = number(optarg, "packet count");
+				break;
+			case 'f':
+				params.flows = number(optarg, "flow count");
+				break;
+			case '6':
+				params.ipv6_percent = number(optarg, "IPv6 percentage");
+				if (params.ipv6_percent > 100)
+					usage(argv[0]);
+				break;
+			case 't':
+				params.tunnel_depth = number(optarg, "tunnel depth");
+				break;
+			case 'g':
+				params.gap = number(optarg, "gap");
+				break;
+			case 's':
+				if (strcmp(optarg, "mixed") == 0)
+					params.shape = SHAPE_MIXED;
+				else if (strcmp(optarg, "synflood") == 0)
+					params.shape = SHAPE_SYN_FLOOD;
+				else if (strcmp(optarg, "portscan") == 0)
+					params.shape = SHAPE_PORT_SCAN;
+				else
+					usage(argv[0]);
+				break;
+			case 'r':
+				params.seed = number(optarg, "seed");
+				break;
+			default:
+				usage(argv[0]);
+		}
+	if (optind == argc)
+		usage(argv[0]);
+	struct mem_pool *pool = mem_pool_create("Packets");
+	ulog(LLOG_INFO, "Generating %zu packets\n", params.packets);
+	const struct packet_info **packets = traffic_generate(pool, &params);
+	for (int i = optind; i < argc; i ++)
+		bench(argv[i], packets, params.packets);
+	mem_pool_destroy(pool);
+	return 0;
+}
@@ -0,0 +1,237 @@
+/*
+    Ucollect - small utility for real-time analysis of network data
+    Copyright (C) 2015 CZ.NIC, z.s.p.o. (http://www.nic.cz/)
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "traffic.h"
+
+#include "../core/packet.h"
+#include "../core/mem_pool.h"
+#include "../core/util.h"
+
+#include <pcap/pcap.h>
+#include <arpa/inet.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define ETH_SIZE 14
+#define IP4_SIZE 20
+#define IP6_SIZE 40
+#define TCP_SIZE 20
+#define UDP_SIZE 8
+#define PAYLOAD_SIZE 64
+// Arbitrary, but fixed. Some time in 2015.
+#define START_TIME 1420070400LLU
+
+struct host {
+	uint8_t address[16]; // Only the first 4 used with IPv4
+	uint16_t port;
+};
+
+struct flow {
+	struct host local, remote;
+	bool ipv6, tcp;
+	size_t packets;
+};
+
+// A simple xorshift generator, we need speed and repeatability, not quality
+static uint64_t rng_next(uint64_t *state) {
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return *state;
+}
+
+static void host_gen(struct host *host, bool ipv6, bool local, uint16_t port, uint64_t *rng) {
+	memset(host, 0, sizeof *host);
+	uint32_t r = rng_next(rng);
+	if (ipv6) {
+		if (local) {
+			host->address[0] = 0xfd; // fd00::/64
+		} else {
+			host->address[0] = 0x20; // 2001:db8::/32
+			host->address[1] = 0x01;
+			host->address[2] = 0x0d;
+			host->address[3] = 0xb8;
+		}
+		memcpy(host->address + 12, &r, sizeof r);
+	} else {
+		if (local) {
+			host->address[0] = 192;
+			host->address[1] = 168;
+			host->address[2] = 1;
+			host->address[3] = 2 + r % 250;
+		} else {
+			memcpy(host->address, &r, sizeof r);
+			host->address[0] = 1 + host->address[0] % 223; // Something unicast-looking
+		}
+	}
+	host->port = port ? port : 1024 + r % 60000;
+}
+
+// Write an IP header with given payload length, return the position after it
+static uint8_t *ip_render(uint8_t *pos, bool ipv6, uint8_t protocol, size_t payload, const uint8_t *src, const uint8_t *dst) {
+	if (ipv6) {
+		uint32_t first = htonl(6 << 28);
+		uint16_t len = htons(payload);
+		memcpy(pos, &first, sizeof first);
+		memcpy(pos + 4, &len, sizeof len);
+		pos[6] = protocol;
+		pos[7] = 64; // Hop limit
+		memcpy(pos + 8, src, 16);
+		memcpy(pos + 24, dst, 16);
+		return pos + IP6_SIZE;
+	} else {
+		uint16_t len = htons(IP4_SIZE + payload);
+		memset(pos, 0, IP4_SIZE);
+		pos[0] = 0x45;
+		memcpy(pos + 2, &len, sizeof len);
+		pos[8] = 64; // TTL
+		pos[9] = protocol;
+		memcpy(pos + 12, src, 4);
+		memcpy(pos + 16, dst, 4);
+		return pos + IP4_SIZE;
+	}
+}
+
+static void l4_render(uint8_t *pos, bool tcp, uint16_t sport, uint16_t dport, uint8_t flags, size_t payload) {
+	sport = htons(sport);
+	dport = htons(dport);
+	memcpy(pos, &sport, sizeof sport);
+	memcpy(pos + 2, &dport, sizeof dport);
+	if (tcp) {
+		memset(pos + 4, 0, TCP_SIZE - 4);
+		pos[12] = (TCP_SIZE / 4) << 4;
+		pos[13] = flags;
+		memset(pos + TCP_SIZE, 0, payload);
+	} else {
+		uint16_t len = htons(UDP_SIZE + payload);
+		memcpy(pos + 4, &len, sizeof len);
+		memset(pos + 6, 0, 2 + payload);
+	}
+}
+
+/*
+ * Render a whole ethernet frame, wrapped in the tunnels. The tunnels alternate
+ * between IPv4 and IPv6, starting with the family of the inner packet.
+ */
+static uint8_t *frame_render(struct mem_pool *pool, size_t *length, const struct traffic_params *params, const struct flow *flow, bool out, uint8_t flags) {
+	size_t payload = flow->tcp && (flags & (TCP_SYN | TCP_RESET)) ? 0 : PAYLOAD_SIZE;
+	size_t l4 = (flow->tcp ? TCP_SIZE : UDP_SIZE) + payload;
+	bool families[params->tunnel_depth + 1]; // Outermost first
+	size_t total = ETH_SIZE + l4;
+	for (size_t i = 0; i <= params->tunnel_depth; i ++) {
+		families[i] = flow->ipv6 ^ ((params->tunnel_depth - i) % 2);
+		total += families[i] ? IP6_SIZE : IP4_SIZE;
+	}
+	uint8_t *frame = mem_pool_alloc(pool, total);
+	static const uint8_t local_mac[6] = { 0x02, 0, 0, 0, 0, 1 }, remote_mac[6] = { 0x02, 0, 0, 0, 0, 2 };
+	memcpy(frame, out ? remote_mac : local_mac, 6);
+	memcpy(frame + 6, out ? local_mac : remote_mac, 6);
+	uint16_t type = htons(families[0] ? 0x86DD : 0x0800);
+	memcpy(frame + 12, &type, sizeof type);
+	uint8_t *pos = frame + ETH_SIZE;
+	// The tunnel endpoints, fixed
+	static const uint8_t local_gw[16] = { 0xfd, 0, 0, 1, [15] = 1 }, remote_gw[16] = { 0xfd, 0, 0, 2, [15] = 2 };
+	for (size_t i = 0; i <= params->tunnel_depth; i ++) {
+		bool inner = i == params->tunnel_depth;
+		uint8_t protocol = inner ? (flow->tcp ? 6 : 17) : (families[i + 1] ? 41 : 4);
+		const uint8_t *local = inner ? flow->local.address : local_gw, *remote = inner ? flow->remote.address : remote_gw;
+		pos = ip_render(pos, families[i], protocol, total - (pos - frame) - (families[i] ? IP6_SIZE : IP4_SIZE), out ? local : remote, out ? remote : local);
+	}
+	if (out)
+		l4_render(pos, flow->tcp, flow->local.port, flow->remote.port, flags, payload);
+	else
+		l4_render(pos, flow->tcp, flow->remote.port, flow->local.port, flags, payload);
+	*length = total;
+	return frame;
+}
+
+const struct packet_info **traffic_generate(struct mem_pool *pool, const struct traffic_params *params) {
+	uint64_t rng = params->seed ? params->seed : 1;
+	size_t flow_count = params->flows ? params->flows : 1;
+	struct flow *flows = mem_pool_alloc(pool, flow_count * sizeof *flows);
+	for (size_t i = 0; i < flow_count; i ++) {
+		bool ipv6 = rng_next(&rng) % 100 < params->ipv6_percent;
+		flows[i] = (struct flow) {
+			.ipv6 = ipv6,
+			.tcp = rng_next(&rng) % 5 != 0 // Mostly TCP
+		};
+		host_gen(&flows[i].local, ipv6, true, 0, &rng);
+		host_gen(&flows[i].remote, ipv6, false, rng_next(&rng) % 2 ? 443 : 0, &rng);
+	}
+	const struct packet_info **result = mem_pool_alloc(pool, params->packets * sizeof *result);
+	for (size_t i = 0; i < params->packets; i ++) {
+		struct flow *flow, tmp;
+		bool out;
+		uint8_t flags;
+		switch (params->shape) {
+			case SHAPE_MIXED:
+				flow = &flows[rng_next(&rng) % flow_count];
+				switch (flow->packets) {
+					case 0:
+						out = true;
+						flags = TCP_SYN;
+						break;
+					case 1:
+						out = false;
+						flags = TCP_SYN | TCP_ACK;
+						break;
+					default:
+						out = rng_next(&rng) % 2;
+						flags = TCP_ACK | (rng_next(&rng) % 4 ? 0 : TCP_PUSH);
+						break;
+				}
+				flow->packets ++;
+				break;
+			case SHAPE_SYN_FLOOD:
+				tmp = flows[0];
+				tmp.tcp = true;
+				tmp.ipv6 = rng_next(&rng) % 100 < params->ipv6_percent;
+				host_gen(&tmp.remote, tmp.ipv6, false, 0, &rng);
+				host_gen(&tmp.local, tmp.ipv6, true, 80, &rng);
+				flow = &tmp;
+				out = false;
+				flags = TCP_SYN;
+				break;
+			case SHAPE_PORT_SCAN:
+				tmp = flows[0];
+				tmp.tcp = true;
+				tmp.remote.port = 1 + (i / 2) % 65535;
+				flow = &tmp;
+				out = i % 2 == 0;
+				flags = out ? TCP_SYN : TCP_RESET | TCP_ACK;
+				break;
+			default:
+				insane("Unknown traffic shape %d\n", (int)params->shape);
+		}
+		struct packet_info *info = mem_pool_alloc(pool, sizeof *info);
+		size_t length;
+		const uint8_t *frame = frame_render(pool, &length, params, flow, out, flags);
+		*info = (struct packet_info) {
+			.length = length,
+			.captured = length,
+			.data = frame,
+			.interface = "bench",
+			.direction = out ? DIR_OUT : DIR_IN,
+			.timestamp = START_TIME * 1000000 + i * (uint64_t)params->gap
+		};
+		uc_parse_packet(info, pool, DLT_EN10MB);
+		result[i] = info;
+	}
+	return result;
+}
@@ -0,0 +1,51 @@
+/*
+    Ucollect - small utility for real-time analysis of network data
+    Copyright (C) 2015 CZ.NIC, z.s.p.o. (http://www.nic.cz/)
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef UCOLLECT_BENCH_TRAFFIC_H
+#define UCOLLECT_BENCH_TRAFFIC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct mem_pool;
+struct packet_info;
+
+enum traffic_shape {
+	SHAPE_MIXED, // TCP and UDP flows in both directions
+	SHAPE_SYN_FLOOD, // Inbound SYNs from random addresses to a single port
+	SHAPE_PORT_SCAN // We scan a remote host, outbound SYNs to consecutive ports answered by RSTs
+};
+
+struct traffic_params {
+	size_t packets;
+	size_t flows; // Number of distinct flows (with SHAPE_MIXED)
+	unsigned ipv6_percent;
+	size_t tunnel_depth; // How many IP-in-IP encapsulations to wrap each packet in
+	uint32_t gap; // Microseconds between packets
+	enum traffic_shape shape;
+	uint64_t seed;
+};
+
+/*
+ * Generate the ethernet frames and parse them, as if they were captured. The result
+ * is an array of packets.count parsed packets, allocated from the pool.
+ */
+const struct packet_info **traffic_generate(struct mem_pool *pool, const struct traffic_params *params) __attribute__((nonnull)) __attribute__((returns_nonnull));
+
+#endif
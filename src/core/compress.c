@@ -0,0 +1,359 @@
+/*
+    Ucollect - small utility for real-time analysis of network data
+    Copyright (C) 2015 CZ.NIC, z.s.p.o. (http://www.nic.cz/)
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+#include "compress.h"
+#include "tunable.h"
+#include "util.h"
+
+#include <string.h>
+#include <zlib.h>
+#include <zstd.h>
+#include <lz4frame.h>
+
+const char compress_codecs[] = { COMPRESS_ZSTD, COMPRESS_LZ4, COMPRESS_ZLIB, '\0' };
+
+// Levels of zlib out of this range are refused by the library
+#define ZLIB_LEVEL_MIN 0
+#define ZLIB_LEVEL_MAX 9
+
+struct compressor {
+	enum compress_codec codec;
+	union {
+		z_stream zlib;
+		ZSTD_CCtx *zstd;
+		LZ4F_cctx *lz4;
+	};
+	LZ4F_preferences_t lz4_prefs;
+	bool lz4_started; // The frame header was output
+	// Output buffer. Fixed for zlib and zstd, lz4 needs it large enough for the whole output of each call.
+	uint8_t *buffer;
+	size_t buffer_size;
+};
+
+struct decompressor {
+	enum compress_codec codec;
+	union {
+		z_stream zlib;
+		ZSTD_DCtx *zstd;
+		LZ4F_dctx *lz4;
+	};
+	// Zlib asks for it in the middle of the stream
+	const uint8_t *dict;
+	size_t dict_size;
+};
+
+static void *alloc(size_t size) {
+	void *result = malloc(size);
+	if (!result)
+		die("Out of memory for compression\n");
+	return result;
+}
+
+uint32_t compress_dict_id(const uint8_t *dict, size_t dict_size) {
+	return ZSTD_getDictID_fromDict(dict, dict_size);
+}
+
+struct compressor *compressor_create(enum compress_codec codec, int level, const uint8_t *dict, size_t dict_size) {
+	struct compressor *result = alloc(sizeof *result);
+	*result = (struct compressor) {
+		.codec = codec,
+		.buffer_size = COMPRESSION_BUFFSIZE
+	};
+	switch (codec) {
+		case COMPRESS_ZLIB:
+			if (level < ZLIB_LEVEL_MIN)
+				level = ZLIB_LEVEL_MIN;
+			if (level > ZLIB_LEVEL_MAX)
+				level = ZLIB_LEVEL_MAX;
+			result->zlib = (z_stream) {
+				.zalloc = Z_NULL,
+				.zfree = Z_NULL,
+				.opaque = Z_NULL
+			};
+			if (deflateInit(&result->zlib, level) != Z_OK)
+				die("Could not initialize zlib (compression stream)\n");
+			// Only the last 32k of the dictionary is used
+			if (dict && deflateSetDictionary(&result->zlib, dict, dict_size) != Z_OK)
+				die("Could not set zlib dictionary\n");
+			break;
+		case COMPRESS_ZSTD:
+			result->zstd = ZSTD_createCCtx();
+			if (!result->zstd)
+				die("Could not initialize zstd (compression stream)\n");
+			// The library clamps the level itself
+			if (ZSTD_isError(ZSTD_CCtx_setParameter(result->zstd, ZSTD_c_compressionLevel, level)) || ZSTD_isError(ZSTD_CCtx_setParameter(result->zstd, ZSTD_c_windowLog, COMPRESSION_ZSTD_WINDOW_LOG)))
+				die("Could not set up zstd compression\n");
+			if (dict && ZSTD_isError(ZSTD_CCtx_loadDictionary(result->zstd, dict, dict_size)))
+				die("Could not load zstd dictionary\n");
+			break;
+		case COMPRESS_LZ4: {
+			size_t error = LZ4F_createCompressionContext(&result->lz4, LZ4F_VERSION);
+			if (LZ4F_isError(error))
+				die("Could not initialize lz4 (compression stream): %s\n", LZ4F_getErrorName(error));
+			result->lz4_prefs = (LZ4F_preferences_t) {
+				.frameInfo = {
+					.blockSizeID = LZ4F_max64KB,
+					.blockMode = LZ4F_blockLinked // Refer to the previous messages, they are similar
+				},
+				.compressionLevel = level
+			};
+			// No dictionary, the lz4 can use it only from its static-only API
+			result->buffer_size = 0; // Allocated according to the data
+			break;
+		}
+		default:
+			free(result);
+			return NULL;
+	}
+	if (result->buffer_size)
+		result->buffer = alloc(result->buffer_size);
+	return result;
+}
+
+void compressor_destroy(struct compressor *compressor) {
+	switch (compressor->codec) {
+		case COMPRESS_ZLIB:
+			deflateEnd(&compressor->zlib);
+			break;
+		case COMPRESS_ZSTD:
+			ZSTD_freeCCtx(compressor->zstd);
+			break;
+		case COMPRESS_LZ4:
+			LZ4F_freeCompressionContext(compressor->lz4);
+			break;
+	}
+	free(compressor->buffer);
+	free(compressor);
+}
+
+static bool zlib_feed(struct compressor *compressor, const uint8_t *data, size_t size, enum compress_flush flush, compress_output output, void *userdata) {
+	static const int modes[] = {
+		[COMPRESS_NO_FLUSH] = Z_NO_FLUSH,
+		[COMPRESS_FLUSH] = Z_SYNC_FLUSH,
+		[COMPRESS_FINISH] = Z_FINISH
+	};
+	z_stream *stream = &compressor->zlib;
+	stream->next_in = (unsigned char *)data;
+	stream->avail_in = size;
+	bool done;
+	do {
+		stream->next_out = compressor->buffer;
+		stream->avail_out = compressor->buffer_size;
+		int result = deflate(stream, modes[flush]);
+		sanity(result != Z_STREAM_ERROR, "Broken zlib compression stream\n");
+		// Without flush, we are done once all the input is in. Otherwise, once there's no more output.
+		if (flush == COMPRESS_NO_FLUSH)
+			done = !stream->avail_in;
+		else if (flush == COMPRESS_FINISH)
+			done = result == Z_STREAM_END;
+		else
+			done = !stream->avail_in && stream->avail_out;
+		size_t produced = compressor->buffer_size - stream->avail_out;
+		if (produced && !output(compressor->buffer, produced, flush == COMPRESS_NO_FLUSH || !done, userdata))
+			return false;
+	} while (!done);
+	return true;
+}
+
+static bool zstd_feed(struct compressor *compressor, const uint8_t *data, size_t size, enum compress_flush flush, compress_output output, void *userdata) {
+	static const ZSTD_EndDirective modes[] = {
+		[COMPRESS_NO_FLUSH] = ZSTD_e_continue,
+		[COMPRESS_FLUSH] = ZSTD_e_flush,
+		[COMPRESS_FINISH] = ZSTD_e_end
+	};
+	ZSTD_inBuffer in = {
+		.src = data,
+		.size = size
+	};
+	bool done;
+	do {
+		ZSTD_outBuffer out = {
+			.dst = compressor->buffer,
+			.size = compressor->buffer_size
+		};
+		size_t remaining = ZSTD_compressStream2(compressor->zstd, &out, &in, modes[flush]);
+		sanity(!ZSTD_isError(remaining), "Broken zstd compression stream: %s\n", ZSTD_getErrorName(remaining));
+		if (flush == COMPRESS_NO_FLUSH)
+			done = in.pos == in.size;
+		else
+			done = !remaining;
+		if (out.pos && !output(compressor->buffer, out.pos, flush == COMPRESS_NO_FLUSH || !done, userdata))
+			return false;
+	} while (!done);
+	return true;
+}
+
+static bool lz4_feed(struct compressor *compressor, const uint8_t *data, size_t size, enum compress_flush flush, compress_output output, void *userdata) {
+	// The lz4 wants space for the worst case of everything up-front
+	size_t needed = LZ4F_HEADER_SIZE_MAX + LZ4F_compressBound(size, &compressor->lz4_prefs);
+	if (needed > compressor->buffer_size) {
+		free(compressor->buffer);
+		compressor->buffer = alloc(needed);
+		compressor->buffer_size = needed;
+	}
+	uint8_t *pos = compressor->buffer;
+	size_t rest = compressor->buffer_size;
+	size_t result;
+#define LZ4_CHECK(CALL) do { \
+		result = (CALL); \
+		sanity(!LZ4F_isError(result), "Broken lz4 compression stream: %s\n", LZ4F_getErrorName(result)); \
+		pos += result; \
+		rest -= result; \
+	} while (0)
+	if (!compressor->lz4_started) {
+		LZ4_CHECK(LZ4F_compressBegin(compressor->lz4, pos, rest, &compressor->lz4_prefs));
+		compressor->lz4_started = true;
+	}
+	if (size)
+		LZ4_CHECK(LZ4F_compressUpdate(compressor->lz4, pos, rest, data, size, NULL));
+	if (flush == COMPRESS_FLUSH)
+		LZ4_CHECK(LZ4F_flush(compressor->lz4, pos, rest, NULL));
+	else if (flush == COMPRESS_FINISH)
+		LZ4_CHECK(LZ4F_compressEnd(compressor->lz4, pos, rest, NULL));
+#undef LZ4_CHECK
+	size_t produced = pos - compressor->buffer;
+	return !produced || output(compressor->buffer, produced, flush == COMPRESS_NO_FLUSH, userdata);
+}
+
+bool compressor_feed(struct compressor *compressor, const uint8_t *data, size_t size, enum compress_flush flush, compress_output output, void *userdata) {
+	switch (compressor->codec) {
+		case COMPRESS_ZLIB:
+			return zlib_feed(compressor, data, size, flush, output, userdata);
+		case COMPRESS_ZSTD:
+			return zstd_feed(compressor, data, size, flush, output, userdata);
+		case COMPRESS_LZ4:
+			return lz4_feed(compressor, data, size, flush, output, userdata);
+	}
+	insane("Unknown compression codec %c\n", compressor->codec);
+}
+
+struct decompressor *decompressor_create(enum compress_codec codec, const uint8_t *dict, size_t dict_size) {
+	struct decompressor *result = alloc(sizeof *result);
+	*result = (struct decompressor) {
+		.codec = codec,
+		.dict = dict,
+		.dict_size = dict_size
+	};
+	switch (codec) {
+		case COMPRESS_ZLIB:
+			result->zlib = (z_stream) {
+				.zalloc = Z_NULL,
+				.zfree = Z_NULL,
+				.opaque = Z_NULL,
+				.avail_in = 0
+			};
+			if (inflateInit(&result->zlib) != Z_OK)
+				die("Could not initialize zlib (decompression stream)\n");
+			break;
+		case COMPRESS_ZSTD:
+			result->zstd = ZSTD_createDCtx();
+			if (!result->zstd)
+				die("Could not initialize zstd (decompression stream)\n");
+			// Don't let the other side make us allocate large windows
+			if (ZSTD_isError(ZSTD_DCtx_setParameter(result->zstd, ZSTD_d_windowLogMax, COMPRESSION_ZSTD_WINDOW_LOG)))
+				die("Could not set up zstd decompression\n");
+			if (dict && ZSTD_isError(ZSTD_DCtx_loadDictionary(result->zstd, dict, dict_size)))
+				die("Could not load zstd dictionary\n");
+			break;
+		case COMPRESS_LZ4: {
+			size_t error = LZ4F_createDecompressionContext(&result->lz4, LZ4F_VERSION);
+			if (LZ4F_isError(error))
+				die("Could not initialize lz4 (decompression stream): %s\n", LZ4F_getErrorName(error));
+			break;
+		}
+		default:
+			free(result);
+			return NULL;
+	}
+	return result;
+}
+
+void decompressor_destroy(struct decompressor *decompressor) {
+	switch (decompressor->codec) {
+		case COMPRESS_ZLIB:
+			inflateEnd(&decompressor->zlib);
+			break;
+		case COMPRESS_ZSTD:
+			ZSTD_freeDCtx(decompressor->zstd);
+			break;
+		case COMPRESS_LZ4:
+			LZ4F_freeDecompressionContext(decompressor->lz4);
+			break;
+	}
+	free(decompressor);
+}
+
+enum decompress_status decompressor_feed(struct decompressor *decompressor, const uint8_t **in, size_t *in_size, uint8_t *out, size_t *out_size) {
+	switch (decompressor->codec) {
+		case COMPRESS_ZLIB: {
+			z_stream *stream = &decompressor->zlib;
+			stream->next_in = (unsigned char *)*in;
+			stream->avail_in = *in_size;
+			stream->next_out = out;
+			stream->avail_out = *out_size;
+			int result = inflate(stream, Z_SYNC_FLUSH);
+			if (result == Z_NEED_DICT && decompressor->dict) {
+				// Right after the header, continue with the dictionary
+				if (inflateSetDictionary(stream, decompressor->dict, decompressor->dict_size) != Z_OK)
+					result = Z_DATA_ERROR; // Not the dictionary of the stream
+				else
+					result = inflate(stream, Z_SYNC_FLUSH);
+			}
+			*in = stream->next_in;
+			*in_size = stream->avail_in;
+			*out_size -= stream->avail_out;
+			switch (result) {
+				case Z_OK:
+				case Z_BUF_ERROR: // No progress possible, need more input or output space
+					return DECOMPRESS_OK;
+				case Z_STREAM_END:
+					return DECOMPRESS_END;
+				default:
+					return DECOMPRESS_ERROR;
+			}
+		}
+		case COMPRESS_ZSTD: {
+			ZSTD_inBuffer input = {
+				.src = *in,
+				.size = *in_size
+			};
+			ZSTD_outBuffer output = {
+				.dst = out,
+				.size = *out_size
+			};
+			size_t result = ZSTD_decompressStream(decompressor->zstd, &output, &input);
+			*in += input.pos;
+			*in_size -= input.pos;
+			*out_size = output.pos;
+			if (ZSTD_isError(result))
+				return DECOMPRESS_ERROR;
+			// We never end the zstd frames, so the 0 (frame done) means an end
+			return result ? DECOMPRESS_OK : DECOMPRESS_END;
+		}
+		case COMPRESS_LZ4: {
+			size_t consumed = *in_size;
+			size_t result = LZ4F_decompress(decompressor->lz4, out, out_size, *in, &consumed, NULL);
+			*in += consumed;
+			*in_size -= consumed;
+			if (LZ4F_isError(result))
+				return DECOMPRESS_ERROR;
+			return result ? DECOMPRESS_OK : DECOMPRESS_END;
+		}
+	}
+	insane("Unknown compression codec %c\n", decompressor->codec);
+}
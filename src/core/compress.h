@@ -0,0 +1,98 @@
+/*
+    Ucollect - small utility for real-time analysis of network data
+    Copyright (C) 2015 CZ.NIC, z.s.p.o. (http://www.nic.cz/)
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+#ifndef UCOLLECT_CORE_COMPRESS_H
+#define UCOLLECT_CORE_COMPRESS_H
+
+/*
+ * Streaming compression of the uplink, with several codecs to choose from.
+ * The zlib is what each connection starts with, the others can be switched to
+ * after negotiation with the server (see uplink.txt). The zstd and lz4 take
+ * much less CPU than zlib for similar or slightly worse ratio.
+ *
+ * The codecs are identified by a single letter on the wire.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+enum compress_codec {
+	COMPRESS_ZLIB = 'Z',
+	COMPRESS_ZSTD = 'S',
+	COMPRESS_LZ4 = 'L'
+};
+
+// All the codecs supported, as a string of their letters
+extern const char compress_codecs[];
+
+enum compress_flush {
+	COMPRESS_NO_FLUSH, // The compressor may keep the data for later
+	COMPRESS_FLUSH, // Output everything, so the other side can decompress all the data so far
+	COMPRESS_FINISH // Output everything and end the stream
+};
+
+enum decompress_status {
+	DECOMPRESS_OK,
+	DECOMPRESS_END, // The stream ended, the rest of the input (if any) is not part of it
+	DECOMPRESS_ERROR // Corrupted data
+};
+
+struct compressor;
+struct decompressor;
+
+/*
+ * A dictionary is a block of data typical for the stream (trained from a
+ * capture of real traffic). Both sides need to use the same one. It helps
+ * mostly at the start of the stream, where the compressor didn't see much
+ * data yet. The dictionary is identified by an ID (the one zstd puts into
+ * trained dictionaries), returns 0 for a block of data that isn't a trained
+ * dictionary. The lz4 doesn't use any dictionary, the one passed to it is
+ * ignored.
+ */
+uint32_t compress_dict_id(const uint8_t *dict, size_t dict_size) __attribute__((nonnull));
+
+/*
+ * Create a compressor with the given level (the meaning depends on the codec,
+ * out of range levels are clamped). The dictionary may be NULL. Returns NULL
+ * for unknown codec.
+ */
+struct compressor *compressor_create(enum compress_codec codec, int level, const uint8_t *dict, size_t dict_size) __attribute__((malloc));
+void compressor_destroy(struct compressor *compressor) __attribute__((nonnull));
+/*
+ * Called with pieces of the compressed data. The more tells the piece is not
+ * the last one of a flush. Returning false aborts the compression.
+ */
+typedef bool (*compress_output)(const uint8_t *data, size_t size, bool more, void *userdata);
+// Compress the data (which may be empty). Returns false if the output callback failed.
+bool compressor_feed(struct compressor *compressor, const uint8_t *data, size_t size, enum compress_flush flush, compress_output output, void *userdata) __attribute__((nonnull(1, 5)));
+
+/*
+ * Create a decompressor, NULL for unknown codec. The dictionary may be NULL,
+ * otherwise it must live as long as the decompressor.
+ */
+struct decompressor *decompressor_create(enum compress_codec codec, const uint8_t *dict, size_t dict_size) __attribute__((malloc));
+void decompressor_destroy(struct decompressor *decompressor) __attribute__((nonnull));
+/*
+ * Decompress as much of the input as fits into the output. The input is
+ * moved past what was consumed. The out_size is the size of the output buffer
+ * on entry and the amount of the decompressed data on return.
+ */
+enum decompress_status decompressor_feed(struct decompressor *decompressor, const uint8_t **in, size_t *in_size, uint8_t *out, size_t *out_size) __attribute__((nonnull));
+
+#endif
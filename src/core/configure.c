@@ -37,8 +37,40 @@ static struct config_params config_params = {
 	.use_uplink = true
 };
 
+// An interface replaying a file instead of capturing
+static bool load_replay(struct loop_configurator *configurator, struct uci_section *section, struct uci_context *ctx, const char *file) {
+	const char *pacing = uci_lookup_option_string(ctx, section, "pacing");
+	enum replay_pacing pacing_conv = REPLAY_ORIGINAL;
+	if (pacing) {
+		if (strcmp(pacing, "original") == 0)
+			pacing_conv = REPLAY_ORIGINAL;
+		else if (strcmp(pacing, "scaled") == 0)
+			pacing_conv = REPLAY_SCALED;
+		else if (strcmp(pacing, "fast") == 0)
+			pacing_conv = REPLAY_FAST;
+		else {
+			ulog(LLOG_ERROR, "Value of pacing for file %s must be original, scaled or fast, not '%s'\n", file, pacing);
+			return false;
+		}
+	}
+	const char *speed = uci_lookup_option_string(ctx, section, "speed");
+	double speed_conv = 1;
+	if (speed) {
+		char *end;
+		speed_conv = strtod(speed, &end);
+		if (!*speed || *end || !(speed_conv > 0)) {
+			ulog(LLOG_ERROR, "Value of speed for file %s must be a positive number, not '%s'\n", file, speed);
+			return false;
+		}
+	}
+	return loop_add_pcap_file(configurator, file, pacing_conv, speed_conv);
+}
+
 static bool load_interface(struct loop_configurator *configurator, struct uci_section *section, struct uci_context *ctx) {
 	ulog(LLOG_DEBUG, "Processing interface %s\n", section->e.name);
+	const char *file = uci_lookup_option_string(ctx, section, "file");
+	if (file)
+		return load_replay(configurator, section, ctx, file);
 	const char *name = uci_lookup_option_string(ctx, section, "ifname");
 	if (!name) {
 		ulog(LLOG_ERROR, "Failed to load ifname of interface %s\n", section->e.name);
@@ -56,7 +88,19 @@ static bool load_interface(struct loop_configurator *configurator, struct uci_se
 			return false;
 		}
 	}
-	if (!loop_add_pcap(configurator, name, promisc_conv))
+	const char *capture = uci_lookup_option_string(ctx, section, "capture");
+	enum capture_mode capture_conv = CAPTURE_PCAP;
+	if (capture) {
+		if (strcmp(capture, "pcap") == 0)
+			capture_conv = CAPTURE_PCAP;
+		else if (strcmp(capture, "ring") == 0)
+			capture_conv = CAPTURE_RING;
+		else {
+			ulog(LLOG_ERROR, "Value of capture for interface %s must be pcap or ring, not '%s'\n", name, capture);
+			return false;
+		}
+	}
+	if (!loop_add_pcap(configurator, name, promisc_conv, capture_conv))
 		return false;
 	return true;
 }
@@ -128,8 +172,7 @@ static bool load_package(struct loop_configurator *configurator, struct uci_cont
 	uci_foreach_element(&p->sections, section) {
 		struct uci_section *s = uci_to_section(section);
 		if (strcmp(s->type, "interface") == 0) {
-			if (!load_interface(configurator, s, ctx))
-				return false;
+			continue; // Below, once all the plugins are known
 		} else if (strcmp(s->type, "plugin") == 0) {
 			if (!load_plugin(configurator, s, ctx))
 				return false;
@@ -144,6 +187,12 @@ static bool load_package(struct loop_configurator *configurator, struct uci_cont
 		} else
 			ulog(LLOG_WARN, "Ignoring config section '%s' of unknown type '%s'\n", s->e.name, s->type);
 	}
+	// The interfaces are opened with the snaplen the plugins need
+	uci_foreach_element(&p->sections, section) {
+		struct uci_section *s = uci_to_section(section);
+		if (strcmp(s->type, "interface") == 0 && !load_interface(configurator, s, ctx))
+			return false;
+	}
 	if (config_params.use_uplink) {
 		if (!seen_uplink) {
 			ulog(LLOG_ERROR, "No uplink configuration found\n");
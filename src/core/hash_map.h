@@ -0,0 +1,369 @@
+/*
+    Ucollect - small utility for real-time analysis of network data
+    Copyright (C) 2015 CZ.NIC, z.s.p.o. (http://www.nic.cz/)
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/*
+ * This header is little bit special in that it generates new code.
+ * You define bunch of defines and macros and include the header.
+ * The header introduces bunch of types and functions and undefines the macros.
+ *
+ * The header doesn't have the usual #ifndef guard, since it is expected
+ * to include multiple times, with different defines.
+ *
+ * This one contains a hash map with keys of fixed size. It is an open
+ * addressing table with Robin Hood hashing ‒ the entries live directly in
+ * the array (no pointers to follow) and the ones far from their home slot
+ * take the place of the ones closer to theirs, so the probe sequences stay
+ * short. The array comes from a slab, so the old one is returned when the
+ * table grows. The growing is incremental, each modification moves few
+ * entries from the old array to the new one, so there's no long pause.
+ *
+ * The definitions are:
+ * - HASH_MAP_KEY: The type of the key. It is compared and hashed as bytes
+ *   by default, so make sure any padding is zeroed.
+ * - HASH_MAP_VALUE: The type of the value, stored together with the key.
+ * - HASH_MAP_NAME(X): Macro returning name of the types and functions
+ *   provided. Could be something like prefix_##X.
+ * - HASH_MAP_HASH(KEY, SEED): Optional. Hash a key (a pointer to const
+ *   HASH_MAP_KEY) into uint32_t, with the given 64bit seed.
+ * - HASH_MAP_EQUAL(A, B): Optional. Compare two keys (pointers).
+ *
+ * The types are HASH_MAP_NAME(map) (the whole map, initialize it by
+ * HASH_MAP_NAME(init)) and HASH_MAP_NAME(entry), which has the key and
+ * value elements. The pointers to the values and entries are valid only
+ * until the next modification of the map.
+ *
+ * Use HFOR(prefix, variable, map) to iterate through the entries. The map
+ * must not be modified during that.
+ */
+
+#ifndef UCOLLECT_HASH_MAP_COMMON
+#define UCOLLECT_HASH_MAP_COMMON
+
+#include "mem_pool.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+// How many slots of the old array are processed during each modification, when growing
+#define HASH_MAP_MIGRATE 4
+// Grow when more than this many eighths of the slots are full
+#define HASH_MAP_LOAD 7
+// The size of the first array
+#define HASH_MAP_MIN_SIZE 16
+
+static inline uint64_t hash_map_mix(uint64_t h) {
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdLLU;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53LLU;
+	h ^= h >> 33;
+	return h;
+}
+
+// The default hash function. It takes the key by 8 bytes at once.
+static inline uint32_t hash_map_bytes(const void *data, size_t size, uint64_t seed) {
+	const uint8_t *bytes = data;
+	uint64_t h = seed ^ (size * 0x9E3779B97F4A7C15LLU);
+	while (size >= sizeof(uint64_t)) {
+		uint64_t word;
+		memcpy(&word, bytes, sizeof word);
+		h = (h ^ word) * 0x9E3779B97F4A7C15LLU;
+		h ^= h >> 29;
+		bytes += sizeof word;
+		size -= sizeof word;
+	}
+	if (size) {
+		uint64_t word = 0;
+		memcpy(&word, bytes, size);
+		h = (h ^ word) * 0x9E3779B97F4A7C15LLU;
+	}
+	return hash_map_mix(h);
+}
+
+/*
+ * Each map gets a different seed, so a table full of colliding keys can't
+ * be prepared in advance (eg. by someone sending us crafted packets).
+ */
+static inline uint64_t hash_map_seed(const void *map) {
+	static uint64_t counter;
+	return hash_map_mix((uintptr_t) map ^ (++ counter << 32));
+}
+
+#define HFOR(TYPE, VARIABLE, MAP) for (struct TYPE##_entry *VARIABLE = TYPE##_first((MAP)); VARIABLE; VARIABLE = TYPE##_next((MAP), VARIABLE))
+
+#endif
+
+// Check all needed defines are there
+#ifndef HASH_MAP_KEY
+#error "HASH_MAP_KEY not defined"
+#endif
+#ifndef HASH_MAP_VALUE
+#error "HASH_MAP_VALUE not defined"
+#endif
+#ifndef HASH_MAP_NAME
+#error "HASH_MAP_NAME not defined"
+#endif
+
+// Define defaults, if not provided
+#ifndef HASH_MAP_HASH
+#define HASH_MAP_HASH(KEY, SEED) hash_map_bytes((KEY), sizeof *(KEY), (SEED))
+#endif
+#ifndef HASH_MAP_EQUAL
+#define HASH_MAP_EQUAL(A, B) (memcmp((A), (B), sizeof *(A)) == 0)
+#endif
+
+struct HASH_MAP_NAME(entry) {
+	uint32_t hash; // 0 for empty slot
+	HASH_MAP_KEY key;
+	HASH_MAP_VALUE value;
+};
+
+struct HASH_MAP_NAME(table) {
+	struct HASH_MAP_NAME(entry) *entries; // NULL if there's no array
+	size_t mask; // The size - 1, the size is a power of 2
+};
+
+struct HASH_MAP_NAME(map) {
+	struct slab *slab;
+	/*
+	 * When growing, the entries are still partly in the old table. They are
+	 * moved to the current one from the migrate position on.
+	 */
+	struct HASH_MAP_NAME(table) current, old;
+	size_t count, old_count, migrate_pos;
+	uint64_t seed;
+};
+
+// Initialize an empty map. The arrays are allocated from the slab.
+static inline void HASH_MAP_NAME(init)(struct HASH_MAP_NAME(map) *map, struct slab *slab) {
+	*map = (struct HASH_MAP_NAME(map)) {
+		.slab = slab,
+		.seed = hash_map_seed(map)
+	};
+}
+
+static inline size_t HASH_MAP_NAME(count)(const struct HASH_MAP_NAME(map) *map) {
+	return map->count;
+}
+
+static inline uint32_t HASH_MAP_NAME(hash)(const struct HASH_MAP_NAME(map) *map, const HASH_MAP_KEY *key) {
+	uint32_t result = HASH_MAP_HASH(key, map->seed);
+	return result ? result : 1; // 0 marks empty slots
+}
+
+// How far is the entry at pos from its home slot
+static inline size_t HASH_MAP_NAME(distance)(const struct HASH_MAP_NAME(table) *table, size_t pos, uint32_t hash) {
+	return (pos - (hash & table->mask)) & table->mask;
+}
+
+static inline struct HASH_MAP_NAME(entry) *HASH_MAP_NAME(table_find)(const struct HASH_MAP_NAME(table) *table, uint32_t hash, const HASH_MAP_KEY *key) {
+	if (!table->entries)
+		return NULL;
+	size_t pos = hash & table->mask;
+	for (size_t distance = 0;; distance ++, pos = (pos + 1) & table->mask) {
+		struct HASH_MAP_NAME(entry) *entry = &table->entries[pos];
+		// Robin Hood: the key would have been placed before any entry closer to its home
+		if (!entry->hash || HASH_MAP_NAME(distance)(table, pos, entry->hash) < distance)
+			return NULL;
+		if (entry->hash == hash && HASH_MAP_EQUAL(&entry->key, key))
+			return entry;
+	}
+}
+
+/*
+ * Put an entry into a table, which must have space for it. Returns where it
+ * ended up (the entries after it may move).
+ */
+static inline struct HASH_MAP_NAME(entry) *HASH_MAP_NAME(table_place)(struct HASH_MAP_NAME(table) *table, const struct HASH_MAP_NAME(entry) *entry) {
+	struct HASH_MAP_NAME(entry) carried = *entry, *result = NULL;
+	size_t pos = carried.hash & table->mask;
+	for (size_t distance = 0;; distance ++, pos = (pos + 1) & table->mask) {
+		struct HASH_MAP_NAME(entry) *slot = &table->entries[pos];
+		if (!slot->hash) {
+			*slot = carried;
+			return result ? result : slot;
+		}
+		size_t slot_distance = HASH_MAP_NAME(distance)(table, pos, slot->hash);
+		if (slot_distance < distance) {
+			// Take the place of the richer one and carry it further
+			struct HASH_MAP_NAME(entry) tmp = *slot;
+			*slot = carried;
+			carried = tmp;
+			distance = slot_distance;
+			if (!result)
+				result = slot;
+		}
+	}
+}
+
+// Remove the entry at pos, shifting the following ones back to keep them close to home
+static inline void HASH_MAP_NAME(table_erase)(struct HASH_MAP_NAME(table) *table, size_t pos) {
+	for (;;) {
+		size_t next = (pos + 1) & table->mask;
+		struct HASH_MAP_NAME(entry) *following = &table->entries[next];
+		if (!following->hash || HASH_MAP_NAME(distance)(table, next, following->hash) == 0) {
+			table->entries[pos].hash = 0;
+			return;
+		}
+		table->entries[pos] = *following;
+		pos = next;
+	}
+}
+
+static inline struct HASH_MAP_NAME(entry) *HASH_MAP_NAME(table_alloc)(struct slab *slab, size_t size) {
+	struct HASH_MAP_NAME(entry) *entries = slab_alloc(slab, size * sizeof *entries);
+	for (size_t i = 0; i < size; i ++)
+		entries[i].hash = 0;
+	return entries;
+}
+
+// Move some entries from the old table to the current one
+static inline void HASH_MAP_NAME(migrate)(struct HASH_MAP_NAME(map) *map, size_t steps) {
+	while (map->old.entries && steps --) {
+		if (!map->old_count) {
+			slab_free(map->slab, map->old.entries);
+			map->old.entries = NULL;
+			return;
+		}
+		struct HASH_MAP_NAME(entry) *entry = &map->old.entries[map->migrate_pos];
+		if (entry->hash) {
+			HASH_MAP_NAME(table_place)(&map->current, entry);
+			// The erase may shift another entry to this position, so stay here
+			HASH_MAP_NAME(table_erase)(&map->old, map->migrate_pos);
+			map->old_count --;
+		} else {
+			map->migrate_pos = (map->migrate_pos + 1) & map->old.mask;
+		}
+	}
+}
+
+static inline void HASH_MAP_NAME(grow)(struct HASH_MAP_NAME(map) *map) {
+	// Finish the previous growing first (happens only if the table grows really fast)
+	HASH_MAP_NAME(migrate)(map, SIZE_MAX);
+	assert(!map->old.entries);
+	size_t size = map->current.entries ? 2 * (map->current.mask + 1) : HASH_MAP_MIN_SIZE;
+	map->old = map->current;
+	map->old_count = map->count;
+	map->migrate_pos = 0;
+	map->current = (struct HASH_MAP_NAME(table)) {
+		.entries = HASH_MAP_NAME(table_alloc)(map->slab, size),
+		.mask = size - 1
+	};
+}
+
+// Find the value of the key. NULL if it is not there.
+static inline HASH_MAP_VALUE *HASH_MAP_NAME(find)(const struct HASH_MAP_NAME(map) *map, const HASH_MAP_KEY *key) {
+	uint32_t hash = HASH_MAP_NAME(hash)(map, key);
+	struct HASH_MAP_NAME(entry) *entry = HASH_MAP_NAME(table_find)(&map->current, hash, key);
+	if (!entry)
+		entry = HASH_MAP_NAME(table_find)(&map->old, hash, key);
+	return entry ? &entry->value : NULL;
+}
+
+/*
+ * Find the value of the key, or create it if it's not there. The new value is
+ * zeroed. If created is not NULL, it is set to whether it was created.
+ */
+static inline HASH_MAP_VALUE *HASH_MAP_NAME(insert)(struct HASH_MAP_NAME(map) *map, const HASH_MAP_KEY *key, bool *created) {
+	HASH_MAP_NAME(migrate)(map, HASH_MAP_MIGRATE);
+	uint32_t hash = HASH_MAP_NAME(hash)(map, key);
+	struct HASH_MAP_NAME(entry) *entry = HASH_MAP_NAME(table_find)(&map->current, hash, key);
+	if (!entry && map->old.entries && (entry = HASH_MAP_NAME(table_find)(&map->old, hash, key))) {
+		// Not migrated yet. Move it now, as the current table is the one that stays.
+		struct HASH_MAP_NAME(entry) moved = *entry;
+		HASH_MAP_NAME(table_erase)(&map->old, entry - map->old.entries);
+		map->old_count --;
+		entry = HASH_MAP_NAME(table_place)(&map->current, &moved);
+	}
+	if (created)
+		*created = !entry;
+	if (entry)
+		return &entry->value;
+	if (!map->current.entries || (map->count + 1) * 8 > (map->current.mask + 1) * HASH_MAP_LOAD)
+		HASH_MAP_NAME(grow)(map);
+	struct HASH_MAP_NAME(entry) new = {
+		.hash = hash,
+		.key = *key
+	};
+	map->count ++;
+	return &HASH_MAP_NAME(table_place)(&map->current, &new)->value;
+}
+
+// Remove the key from the map. Returns if it was there.
+static inline bool HASH_MAP_NAME(remove)(struct HASH_MAP_NAME(map) *map, const HASH_MAP_KEY *key) {
+	HASH_MAP_NAME(migrate)(map, HASH_MAP_MIGRATE);
+	uint32_t hash = HASH_MAP_NAME(hash)(map, key);
+	struct HASH_MAP_NAME(table) *table = &map->current;
+	struct HASH_MAP_NAME(entry) *entry = HASH_MAP_NAME(table_find)(table, hash, key);
+	if (!entry) {
+		table = &map->old;
+		entry = HASH_MAP_NAME(table_find)(table, hash, key);
+		if (!entry)
+			return false;
+		map->old_count --;
+	}
+	HASH_MAP_NAME(table_erase)(table, entry - table->entries);
+	map->count --;
+	return true;
+}
+
+// Remove all the entries and release the arrays.
+static inline void HASH_MAP_NAME(clear)(struct HASH_MAP_NAME(map) *map) {
+	if (map->current.entries)
+		slab_free(map->slab, map->current.entries);
+	if (map->old.entries)
+		slab_free(map->slab, map->old.entries);
+	HASH_MAP_NAME(init)(map, map->slab);
+}
+
+// Iteration. The entries of the current table go first, then the not yet migrated ones.
+static inline struct HASH_MAP_NAME(entry) *HASH_MAP_NAME(next)(const struct HASH_MAP_NAME(map) *map, const struct HASH_MAP_NAME(entry) *previous) {
+	const struct HASH_MAP_NAME(table) *table = &map->current;
+	size_t pos = 0;
+	if (previous) {
+		if (map->current.entries && previous >= map->current.entries && previous <= map->current.entries + map->current.mask) {
+			pos = previous - map->current.entries + 1;
+		} else {
+			table = &map->old;
+			pos = previous - map->old.entries + 1;
+		}
+	}
+	for (;;) {
+		if (table->entries)
+			for (; pos <= table->mask; pos ++)
+				if (table->entries[pos].hash)
+					return &table->entries[pos];
+		if (table == &map->old)
+			return NULL;
+		table = &map->old;
+		pos = 0;
+	}
+}
+
+static inline struct HASH_MAP_NAME(entry) *HASH_MAP_NAME(first)(const struct HASH_MAP_NAME(map) *map) {
+	return HASH_MAP_NAME(next)(map, NULL);
+}
+
+#undef HASH_MAP_KEY
+#undef HASH_MAP_VALUE
+#undef HASH_MAP_NAME
+#undef HASH_MAP_HASH
+#undef HASH_MAP_EQUAL
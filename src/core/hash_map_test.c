@@ -0,0 +1,126 @@
+/*
+    Ucollect - small utility for real-time analysis of network data
+    Copyright (C) 2015 CZ.NIC, z.s.p.o. (http://www.nic.cz/)
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "mem_pool.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Checks of the hash map against a plain array of what should be in there.
+ * Random inserts and removes make the map grow through several incremental
+ * migrations, which are the tricky part. It exits with an error at the first
+ * failure.
+ */
+
+struct key {
+	uint32_t a, b;
+};
+
+#define HASH_MAP_KEY struct key
+#define HASH_MAP_VALUE uint64_t
+#define HASH_MAP_NAME(X) test_##X
+#include "hash_map.h"
+
+// The key space is small, so the same keys get inserted and removed many times
+#define KEY_COUNT 5000
+#define STEPS 200000
+
+#define CHECK(COND) do { if (!(COND)) die("Check failed at line %d: %s\n", __LINE__, #COND); } while (0)
+
+static uint64_t state = 88172645463325252LLU;
+
+static uint64_t rnd(void) {
+	state ^= state << 13;
+	state ^= state >> 7;
+	state ^= state << 17;
+	return state;
+}
+
+static struct key key_of(size_t i) {
+	// Half of the keys differ only in the upper part, to see it is hashed too
+	return (struct key) { .a = i / 2, .b = i % 2 };
+}
+
+// Check the map holds exactly what the reference says, by lookups and by iteration
+static void check_all(const struct test_map *map, const bool *present, const uint64_t *values) {
+	size_t count = 0;
+	for (size_t i = 0; i < KEY_COUNT; i ++) {
+		struct key key = key_of(i);
+		const uint64_t *value = test_find(map, &key);
+		CHECK(!value == !present[i]);
+		if (value) {
+			CHECK(*value == values[i]);
+			count ++;
+		}
+	}
+	CHECK(test_count(map) == count);
+	size_t iterated = 0;
+	HFOR(test, entry, map) {
+		size_t i = 2 * entry->key.a + entry->key.b;
+		CHECK(i < KEY_COUNT && present[i] && entry->value == values[i]);
+		iterated ++;
+	}
+	CHECK(iterated == count);
+}
+
+int main(int argc, const char *argv[]) {
+	(void) argc;
+	(void) argv;
+	struct slab *slab = slab_create("Hash map test");
+	struct test_map map;
+	test_init(&map, slab);
+	static bool present[KEY_COUNT];
+	static uint64_t values[KEY_COUNT];
+	for (size_t step = 0; step < STEPS; step ++) {
+		size_t i = rnd() % KEY_COUNT;
+		struct key key = key_of(i);
+		// Insert more often than remove, so the map keeps growing for a while
+		if (rnd() % 3) {
+			bool created;
+			uint64_t *value = test_insert(&map, &key, &created);
+			CHECK(created == !present[i]);
+			CHECK(!created || *value == 0);
+			*value = values[i] = rnd();
+			present[i] = true;
+		} else {
+			CHECK(test_remove(&map, &key) == present[i]);
+			present[i] = false;
+		}
+		// The full check is expensive, do it only sometimes (but often during the first migrations)
+		if (step < 2000 || step % 10000 == 0)
+			check_all(&map, present, values);
+	}
+	check_all(&map, present, values);
+	test_clear(&map);
+	memset(present, 0, sizeof present);
+	check_all(&map, present, values);
+	// All the arrays went back to the slab, it keeps only few spare pages of the small sizes
+	CHECK(slab_allocated(slab) <= 4 * PAGE_SIZE);
+	// Usable after the clear
+	struct key key = key_of(42);
+	*test_insert(&map, &key, NULL) = 42;
+	CHECK(*test_find(&map, &key) == 42);
+	slab_destroy(slab);
+	printf("OK\n");
+	return 0;
+}
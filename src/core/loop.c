@@ -38,15 +38,25 @@
 #include <sys/wait.h>
 #include <unistd.h>
 #include <inttypes.h>
+#include <endian.h>
 
 #include <pcap/pcap.h>
 #include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include <sys/time.h>
 #include <time.h>
 #include <limits.h>
 #include <setjmp.h>
 #include <stdlib.h>
 #include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#include <linux/filter.h>
 
 /*
  * Low-level error handling.
@@ -115,7 +125,9 @@ static void signal_initialize(void) {
 
 struct pool_node {
 	struct pool_node *next;
+	// One of these is set
 	struct mem_pool *pool;
+	struct slab *slab;
 };
 
 struct pool_list {
@@ -130,7 +142,10 @@ struct pool_list {
 
 static void pool_list_destroy(const struct pool_list *list) {
 	for (struct pool_node *pool = list->head; pool; pool = pool->next)
-		mem_pool_destroy(pool->pool);
+		if (pool->slab)
+			slab_destroy(pool->slab);
+		else
+			mem_pool_destroy(pool->pool);
 }
 
 #define PCAP_DIR_IN 0
@@ -148,9 +163,28 @@ struct pcap_sub_interface {
 	 * the epoll_handler, which contains a function pointer as the first element.
 	 */
 	void (*handler)(struct pcap_sub_interface *sub, uint32_t events);
-	pcap_t *pcap;
+	pcap_t *pcap; // NULL with the ring capture
 	int fd;
 	struct pcap_interface *interface;
+	// The mmapped TPACKET_V3 ring (with the ring capture only)
+	uint8_t *ring;
+	size_t block; // Next block of the ring to look at
+	// The kernel resets the ring statistics on each read, so we sum them here.
+	size_t ring_received, ring_dropped;
+};
+
+// State of a file replay
+struct replay {
+	enum replay_pacing pacing;
+	double speed;
+	// The next packet, already read (NULL if not yet). Valid until the next read.
+	const struct pcap_pkthdr *header;
+	const unsigned char *data;
+	bool started, done;
+	uint64_t first_ts; // Timestamp of the first packet, in microseconds
+	uint64_t base_now; // The loop_now when the first packet came
+	uint64_t real_start; // The real time when the first packet came
+	size_t packets;
 };
 
 struct pcap_interface {
@@ -158,7 +192,15 @@ struct pcap_interface {
 	struct loop *loop;
 	const char *name;
 	bool promiscuous;
-	struct pcap_sub_interface directions[2];
+	enum capture_mode capture;
+	/*
+	 * The pcap capture needs a handle for each direction (indexed by PCAP_DIR_*).
+	 * The ring capture has one socket for both directions, the kernel tells us
+	 * the direction of each packet.
+	 */
+	struct pcap_sub_interface *subs;
+	size_t sub_count;
+	size_t snaplen; // The snaplen the pcap handles were opened with (0 for whole packets)
 	size_t offset;
 	int datalink;
 	size_t watchdog_timer;
@@ -170,6 +212,7 @@ struct pcap_interface {
 	bool registered; // Registered inside the main loop
 	// Statistics from the last time, so we can return just the diffs
 	size_t captured, dropped, if_dropped;
+	struct replay replay; // With CAPTURE_FILE only
 };
 
 struct pcap_list {
@@ -200,6 +243,31 @@ struct trie_data {
 	size_t allocated;
 };
 
+// Kinds of plugin callbacks we measure the time of separately
+enum callback_kind {
+	CALLBACK_PACKET, // Both single packets and batches
+	CALLBACK_TIMEOUT,
+	CALLBACK_FD,
+	CALLBACK_UPLINK_DATA,
+	CALLBACK_OTHER, // Init, configuration, connect/disconnect, children
+	CALLBACK_KIND_COUNT
+};
+
+static const char *callback_kind_names[CALLBACK_KIND_COUNT] = {
+	[CALLBACK_PACKET] = "packet",
+	[CALLBACK_TIMEOUT] = "timeout",
+	[CALLBACK_FD] = "fd",
+	[CALLBACK_UPLINK_DATA] = "uplink-data",
+	[CALLBACK_OTHER] = "other"
+};
+
+struct callback_stats {
+	uint64_t calls;
+	uint64_t total, max; // Nanoseconds
+	// The i-th bucket counts calls taking [2^i, 2^(i+1)) ns, the last one anything longer
+	uint32_t histogram[CPU_HISTOGRAM_BUCKETS];
+};
+
 struct plugin_holder {
 	/*
 	 * This one is first, so we can cast the current_context back in case
@@ -224,6 +292,11 @@ struct plugin_holder {
 	size_t failed;
 	uint8_t hash[CHALLENGE_LEN / 2];
 	unsigned api_version;
+	struct callback_stats cpu[CALLBACK_KIND_COUNT]; // Since the last loop_cpu_stats_send
+	unsigned packet_unmeasured; // Calls of the packet callback since the last measured one
+	size_t memory_budget; // In bytes, 0 for unlimited
+	size_t memory_used, memory_peak; // As of the last memory check
+	bool memory_pressed; // Was it asked to free memory since it got over the soft limit?
 };
 
 struct plugin_list {
@@ -255,19 +328,56 @@ struct plugin_list {
 #define RECYCLER_NAME(X) plugin_fd_recycler_##X
 #include "recycler.h"
 
+/*
+ * A clock for measuring how long the plugins run. Use the one not influenced
+ * by NTP if available (uclibc doesn't seem to have it).
+ */
+#ifdef CLOCK_MONOTONIC_RAW
+#define CPU_CLOCK CLOCK_MONOTONIC_RAW
+#else
+#define CPU_CLOCK CLOCK_MONOTONIC
+#endif
+static uint64_t cpu_clock(void) {
+	struct timespec ts;
+	if (clock_gettime(CPU_CLOCK, &ts) == -1)
+		return 0; // Can't really happen and it would only spoil the stats
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * Account a measured call. The weight is the number of calls it stands for in
+ * the total and the histogram (the packet callbacks are measured only
+ * sometimes, but counted each time).
+ */
+static void cpu_account(struct plugin_holder *plugin, enum callback_kind kind, uint64_t start, unsigned weight) {
+	uint64_t end = cpu_clock();
+	uint64_t duration = end > start ? end - start : 0;
+	struct callback_stats *stats = &plugin->cpu[kind];
+	stats->calls ++;
+	stats->total += duration * weight;
+	if (duration > stats->max)
+		stats->max = duration;
+	size_t bucket = duration ? 63 - __builtin_clzll(duration) : 0;
+	if (bucket >= CPU_HISTOGRAM_BUCKETS)
+		bucket = CPU_HISTOGRAM_BUCKETS - 1;
+	stats->histogram[bucket] += weight;
+}
+
 /*
  * Generate a wrapper around a plugin callback that:
  *  * Checks it the callback is not NULL (if it is, nothing is called)
  *  * Sets the current context to the one of the plugin (for error handling)
- *  * Calls the callback
+ *  * Calls the callback, measuring how long it takes
  *  * Restores no context and resets the temporary pool
  */
-#define GEN_CALL_WRAPPER(NAME) \
+#define GEN_CALL_WRAPPER(NAME, KIND) \
 static inline void plugin_##NAME(struct plugin_holder *plugin) { \
 	if (!plugin->plugin.NAME##_callback) \
 		return; \
 	current_context = &plugin->context; \
+	uint64_t start = cpu_clock(); \
 	plugin->plugin.NAME##_callback(&plugin->context); \
+	cpu_account(plugin, KIND, start, 1); \
 	mem_pool_reset(plugin->context.temp_pool); \
 	current_context = NULL; \
 }\
@@ -275,41 +385,75 @@ static inline void plugin_##NAME##_noreset(struct plugin_holder *plugin) { \
 	if (!plugin->plugin.NAME##_callback) \
 		return; \
 	current_context = &plugin->context; \
+	uint64_t start = cpu_clock(); \
 	plugin->plugin.NAME##_callback(&plugin->context); \
+	cpu_account(plugin, KIND, start, 1); \
 	current_context = NULL; \
 }
 
 // The same, with parameter
-#define GEN_CALL_WRAPPER_PARAM(NAME, TYPE) \
+#define GEN_CALL_WRAPPER_PARAM(NAME, KIND, TYPE) \
 static inline void plugin_##NAME(struct plugin_holder *plugin, TYPE PARAM) { \
 	if (!plugin->plugin.NAME##_callback) \
 		return; \
 	current_context = &plugin->context; \
+	uint64_t start = cpu_clock(); \
 	plugin->plugin.NAME##_callback(&plugin->context, PARAM); \
+	cpu_account(plugin, KIND, start, 1); \
 	mem_pool_reset(plugin->context.temp_pool); \
 	current_context = NULL; \
 }
 
 // And with 2
-#define GEN_CALL_WRAPPER_PARAM_2(NAME, TYPE1, TYPE2) \
+#define GEN_CALL_WRAPPER_PARAM_2(NAME, KIND, TYPE1, TYPE2) \
 static inline void plugin_##NAME(struct plugin_holder *plugin, TYPE1 PARAM1, TYPE2 PARAM2) { \
 	if (!plugin->plugin.NAME##_callback) \
 		return; \
 	current_context = &plugin->context; \
+	uint64_t start = cpu_clock(); \
 	plugin->plugin.NAME##_callback(&plugin->context, PARAM1, PARAM2); \
+	cpu_account(plugin, KIND, start, 1); \
 	mem_pool_reset(plugin->context.temp_pool); \
 	current_context = NULL; \
 }
 
-GEN_CALL_WRAPPER(init)
-GEN_CALL_WRAPPER(finish)
-GEN_CALL_WRAPPER(uplink_connected)
-GEN_CALL_WRAPPER(uplink_disconnected)
-GEN_CALL_WRAPPER_PARAM(packet, const struct packet_info *)
-GEN_CALL_WRAPPER_PARAM_2(uplink_data, const uint8_t *, size_t)
-GEN_CALL_WRAPPER_PARAM_2(fd, int, void *)
-GEN_CALL_WRAPPER_PARAM(config_finish, bool)
-GEN_CALL_WRAPPER_PARAM_2(child_died, int, pid_t)
+GEN_CALL_WRAPPER(init, CALLBACK_OTHER)
+GEN_CALL_WRAPPER(finish, CALLBACK_OTHER)
+GEN_CALL_WRAPPER(uplink_connected, CALLBACK_OTHER)
+GEN_CALL_WRAPPER(uplink_disconnected, CALLBACK_OTHER)
+GEN_CALL_WRAPPER_PARAM_2(uplink_data, CALLBACK_UPLINK_DATA, const uint8_t *, size_t)
+GEN_CALL_WRAPPER_PARAM_2(fd, CALLBACK_FD, int, void *)
+GEN_CALL_WRAPPER_PARAM(config_finish, CALLBACK_OTHER, bool)
+GEN_CALL_WRAPPER_PARAM_2(child_died, CALLBACK_OTHER, int, pid_t)
+GEN_CALL_WRAPPER_PARAM_2(packet_batch, CALLBACK_PACKET, const struct packet_info *const *, size_t)
+GEN_CALL_WRAPPER_PARAM(memory_pressure, CALLBACK_OTHER, bool)
+
+/*
+ * The packet callback is called too often to read the clock around each call
+ * (it may be a syscall on some routers). So only every CPU_PACKET_SAMPLE-th call
+ * is measured, the others are just counted.
+ */
+static inline void plugin_packet(struct plugin_holder *plugin, const struct packet_info *info) {
+	if (!plugin->plugin.packet_callback)
+		return;
+	current_context = &plugin->context;
+	if (++ plugin->packet_unmeasured < CPU_PACKET_SAMPLE) {
+		plugin->plugin.packet_callback(&plugin->context, info);
+		plugin->cpu[CALLBACK_PACKET].calls ++;
+	} else {
+		plugin->packet_unmeasured = 0;
+		uint64_t start = cpu_clock();
+		plugin->plugin.packet_callback(&plugin->context, info);
+		cpu_account(plugin, CALLBACK_PACKET, start, CPU_PACKET_SAMPLE);
+	}
+	mem_pool_reset(plugin->context.temp_pool);
+	current_context = NULL;
+}
+
+// Does the plugin want the packets in batches instead of one by one?
+static inline bool plugin_batched(const struct plugin_holder *plugin) {
+	return plugin->api_version >= 3 && plugin->plugin.packet_batch_callback;
+}
 
 static char *gdb_command;
 static volatile sig_atomic_t in_signal = 0;
@@ -355,11 +499,39 @@ static void sig_handler(int signal, siginfo_t *info, void *unused) {
 	abort_safe();
 }
 
+/*
+ * Read the memory_budget option (in kilobytes) of the plugin's current config
+ * (or the candidate one, if there's any).
+ */
+static bool memory_budget_parse(struct plugin_holder *plugin, size_t *budget) {
+	*budget = 0;
+	const struct config_node *option = loop_plugin_option_get(&plugin->context, "memory_budget");
+	if (!option)
+		return true;
+	if (option->value_count != 1) {
+		ulog(LLOG_ERROR, "The memory_budget of %s must have a single value\n", plugin->plugin.name);
+		return false;
+	}
+	char *end;
+	unsigned long long kb = strtoull(option->values[0], &end, 10);
+	if (!*option->values[0] || *end || kb > SIZE_MAX / 1024) {
+		ulog(LLOG_ERROR, "Invalid memory_budget '%s' of %s\n", option->values[0], plugin->plugin.name);
+		return false;
+	}
+	*budget = kb * 1024;
+	return true;
+}
+
 static bool plugin_config_check(struct plugin_holder *plugin) {
+	size_t budget;
+	if (!memory_budget_parse(plugin, &budget))
+		return false;
 	if (!plugin->plugin.config_check_callback)
 		return true;
 	current_context = &plugin->context;
+	uint64_t start = cpu_clock();
 	bool result = plugin->plugin.config_check_callback(&plugin->context);
+	cpu_account(plugin, CALLBACK_OTHER, start, 1);
 	mem_pool_reset(plugin->context.temp_pool);
 	current_context = NULL;
 	return result;
@@ -370,7 +542,25 @@ struct timeout {
 	void (*callback)(struct context *context, void *data, size_t id);
 	struct context *context;
 	void *data;
-	size_t id;
+	size_t id; // 0 when the slot is free
+	size_t heap_pos; // Position in the heap, or next free slot when free
+};
+
+// The low bits of timeout id are the slot, the rest a serial number to catch stale ids
+#define TIMEOUT_SLOT_BITS (sizeof(size_t) > 4 ? 32 : 20)
+#define TIMEOUT_SLOT_MASK (((size_t) 1 << TIMEOUT_SLOT_BITS) - 1)
+#define TIMEOUT_NO_SLOT ((size_t) -1)
+
+/*
+ * Which plugins to call for packets of given innermost layer and app_protocol.
+ * Layer of '\0' matches any layer, any_app matches any app_protocol. The first
+ * matching slot is used, so the specific ones go first.
+ */
+struct dispatch_slot {
+	char layer, app_protocol;
+	bool any_app;
+	struct plugin_holder **plugins; // In the order of the plugin list
+	size_t plugin_count;
 };
 
 struct loop {
@@ -392,24 +582,60 @@ struct loop {
 	// The plugins that handle the packets
 	struct plugin_list plugins;
 	struct uplink *uplink;
-	// Timeouts. Sorted by the 'when' element.
+	/*
+	 * Timeouts. They live in slots (indexed by the id), which are reused
+	 * through a free list. The heap holds the slots of the active ones, ordered
+	 * by the 'when' element, so the next one is at its top.
+	 */
 	struct timeout *timeouts;
-	size_t timeout_count, timeout_capacity;
+	size_t *timeout_heap;
+	size_t timeout_count, timeout_slots, timeout_capacity, timeout_free;
+	size_t timeout_serial;
 	// Last time the epoll returned, in milliseconds since some unspecified point in history
 	uint64_t now;
+	// The clock now is read from (the coarse one, if precise enough)
+	clockid_t now_clock;
+	// Timestamp of the newest packet seen, in microseconds since epoch
+	uint64_t packet_time;
 	// The epoll
 	int epoll_fd;
+	/*
+	 * The timerfd that wakes the epoll for the next timeout. It is set to the
+	 * absolute time timer_armed (in the time of now), 0 when not armed.
+	 */
+	struct epoll_handler timer_handler;
+	int timer_fd;
+	uint64_t timer_armed;
 	// Turns to 1 when we are stopped.
 	volatile sig_atomic_t stopped; // We may be stopped from a signal, so not bool
 	volatile sig_atomic_t reconfigure; // Set to 1 when there's SIGHUP and we should reconfigure
 	volatile sig_atomic_t reconfigure_full; // De-initialize first.
 	struct context *reinitialize_plugin; // Please reinitialize this plugin on return from jump
+	struct context *over_budget; // This plugin didn't fit into its memory, reinitialize it as failed
 	bool retry_reconfigure_on_failure;
 	bool fd_invalidated; // Did we invalidate any FD during this loop iteration? If so, skip the rest.
 	struct pluglib_list pluglibs; // All loaded plugin libraries
 	// The unused libraries
 	struct pluglib_node *pluglib_list_recycler;
 	struct pluglib *pluglib_recycler;
+	/*
+	 * The packets gathered for the plugins with batch callback. Allocated from
+	 * the batch pool, flushed before the packet data go away.
+	 */
+	const struct packet_info **batch;
+	size_t batch_count, batch_capacity;
+	bool batch_plugins; // Is there any plugin wanting batches?
+	// The currently installed filter expression (NULL if none), from the config pool
+	const char *filter;
+	// How much of each packet to capture (0 for whole packets)
+	size_t snaplen;
+	// The interface replaying a file, if any. It drives the time.
+	struct pcap_interface *replay;
+	// Which plugins want which packets (built from the interests, in the config pool)
+	struct dispatch_slot *dispatch;
+	size_t dispatch_count;
+	// When the plugins' CPU stats were last reset
+	uint64_t cpu_stats_since;
 };
 
 #define RECYCLER_NODE struct pluglib_node
@@ -436,6 +662,76 @@ struct loop {
 #define LIST_WANT_LFOR
 #include "pluglib_list.h"
 
+// The timeout that fires next, if any
+static inline struct timeout *timeout_next(const struct loop *loop) {
+	return loop->timeout_count ? &loop->timeouts[loop->timeout_heap[0]] : NULL;
+}
+
+// Is there a timeout that should have fired already?
+static inline bool timeout_due(const struct loop *loop) {
+	const struct timeout *next = timeout_next(loop);
+	return next && next->when <= loop->now;
+}
+
+static bool timeout_before(const struct loop *loop, size_t slot1, size_t slot2) {
+	const struct timeout *t1 = &loop->timeouts[slot1], *t2 = &loop->timeouts[slot2];
+	if (t1->when != t2->when)
+		return t1->when < t2->when;
+	// Keep the order in which they were added for the ones at the same time
+	return (t1->id >> TIMEOUT_SLOT_BITS) < (t2->id >> TIMEOUT_SLOT_BITS);
+}
+
+static void timeout_heap_set(struct loop *loop, size_t pos, size_t slot) {
+	loop->timeout_heap[pos] = slot;
+	loop->timeouts[slot].heap_pos = pos;
+}
+
+static void timeout_sift_up(struct loop *loop, size_t pos) {
+	size_t slot = loop->timeout_heap[pos];
+	while (pos) {
+		size_t parent = (pos - 1) / 2;
+		if (!timeout_before(loop, slot, loop->timeout_heap[parent]))
+			break;
+		timeout_heap_set(loop, pos, loop->timeout_heap[parent]);
+		pos = parent;
+	}
+	timeout_heap_set(loop, pos, slot);
+}
+
+static void timeout_sift_down(struct loop *loop, size_t pos) {
+	size_t slot = loop->timeout_heap[pos];
+	for (;;) {
+		size_t child = 2 * pos + 1;
+		if (child >= loop->timeout_count)
+			break;
+		if (child + 1 < loop->timeout_count && timeout_before(loop, loop->timeout_heap[child + 1], loop->timeout_heap[child]))
+			child ++;
+		if (!timeout_before(loop, loop->timeout_heap[child], slot))
+			break;
+		timeout_heap_set(loop, pos, loop->timeout_heap[child]);
+		pos = child;
+	}
+	timeout_heap_set(loop, pos, slot);
+}
+
+// Take the timeout out of the heap and free its slot
+static void timeout_remove(struct loop *loop, size_t slot) {
+	size_t pos = loop->timeouts[slot].heap_pos;
+	assert(pos < loop->timeout_count && loop->timeout_heap[pos] == slot);
+	size_t last = loop->timeout_heap[-- loop->timeout_count];
+	if (last != slot) {
+		// Put the last one to the hole and move it to where it belongs
+		timeout_heap_set(loop, pos, last);
+		if (pos && timeout_before(loop, last, loop->timeout_heap[(pos - 1) / 2]))
+			timeout_sift_up(loop, pos);
+		else
+			timeout_sift_down(loop, pos);
+	}
+	loop->timeouts[slot].id = 0;
+	loop->timeouts[slot].heap_pos = loop->timeout_free;
+	loop->timeout_free = slot;
+}
+
 struct string_list_node {
 	struct string_list_node *next;
 	const char *value;
@@ -464,19 +760,78 @@ struct loop_configurator {
 	bool need_new_versions;
 };
 
+// Does the plugin want the innermost packet_info instead of the whole chain?
+static inline bool plugin_innermost(const struct plugin_holder *plugin) {
+	return plugin->api_version >= 3 && plugin->plugin.packet_innermost;
+}
+
+static const struct dispatch_slot *dispatch_find(const struct loop *loop, const struct packet_info *innermost) {
+	for (size_t i = 0; i < loop->dispatch_count; i ++) {
+		const struct dispatch_slot *slot = &loop->dispatch[i];
+		if ((slot->layer == '\0' || slot->layer == innermost->layer) && (slot->any_app || slot->app_protocol == innermost->app_protocol))
+			return slot;
+	}
+	insane("No dispatch slot for packet on layer %c\n", innermost->layer); // The last slot matches anything
+}
+
+// Hand the gathered packets to the plugins that want them in batches.
+static void batch_flush(struct loop *loop) {
+	if (loop->batch_count)
+		LFOR(plugin, plugin, &loop->plugins)
+			if (plugin_batched(plugin))
+				plugin_packet_batch(plugin, loop->batch, loop->batch_count);
+	// The array lives in the batch pool, which is going to be reset soon
+	loop->batch = NULL;
+	loop->batch_count = loop->batch_capacity = 0;
+}
+
+static void batch_append(struct loop *loop, const struct packet_info *info) {
+	if (loop->batch_count == loop->batch_capacity) {
+		const struct packet_info **old = loop->batch;
+		loop->batch_capacity = loop->batch_capacity ? 2 * loop->batch_capacity : MAX_PACKETS;
+		loop->batch = mem_pool_alloc(loop->batch_pool, loop->batch_capacity * sizeof *loop->batch);
+		if (loop->batch_count)
+			memcpy(loop->batch, old, loop->batch_count * sizeof *loop->batch);
+	}
+	loop->batch[loop->batch_count ++] = info;
+}
+
 // Handle one packet.
 static void packet_handler(struct pcap_interface *interface, const struct pcap_pkthdr *header, const unsigned char *data) {
-	struct packet_info info = {
-		.length = header->caplen,
+	struct loop *loop = interface->loop;
+	struct packet_info local_info, *info = &local_info;
+	if (loop->batch_plugins) {
+		// It needs to survive until the batch is flushed
+		info = mem_pool_alloc(loop->batch_pool, sizeof *info);
+		if (interface->capture != CAPTURE_RING) {
+			// Libpcap may reuse its buffer once we return, the ring keeps the whole block for us
+			unsigned char *copy = mem_pool_alloc(loop->batch_pool, header->caplen);
+			memcpy(copy, data, header->caplen);
+			data = copy;
+		}
+	}
+	*info = (struct packet_info) {
+		.length = header->len,
+		.captured = header->caplen,
 		.timestamp = 1000000*(uint64_t)header->ts.tv_sec + (uint64_t)header->ts.tv_usec,
 		.data = data,
 		.interface = interface->name,
 		.direction = interface->in ? DIR_IN : DIR_OUT
 	};
-	ulog(LLOG_DEBUG_VERBOSE, "Packet of size %zu on interface %s (starting %016llX%016llX, on layer %d) at %" PRIu64 "\n", info.length, interface->name, *(long long unsigned *) info.data, *(1 + (long long unsigned *) info.data), interface->datalink, info.timestamp);
-	uc_parse_packet(&info, interface->loop->batch_pool, interface->datalink);
-	LFOR(plugin, plugin, &interface->loop->plugins)
-		plugin_packet(plugin, &info);
+	if (info->timestamp > loop->packet_time)
+		loop->packet_time = info->timestamp;
+	ulog(LLOG_DEBUG_VERBOSE, "Packet of size %zu on interface %s (starting %016llX%016llX, on layer %d) at %" PRIu64 "\n", info->length, interface->name, *(long long unsigned *) info->data, *(1 + (long long unsigned *) info->data), interface->datalink, info->timestamp);
+	uc_parse_packet(info, loop->batch_pool, interface->datalink);
+	const struct packet_info *innermost = info;
+	while (innermost->next)
+		innermost = innermost->next;
+	const struct dispatch_slot *slot = dispatch_find(loop, innermost);
+	for (size_t i = 0; i < slot->plugin_count; i ++) {
+		struct plugin_holder *plugin = slot->plugins[i];
+		plugin_packet(plugin, plugin_innermost(plugin) ? innermost : info);
+	}
+	if (loop->batch_plugins)
+		batch_append(loop, info);
 }
 
 static void self_reconfigure(struct context *context, void *data, size_t id) {
@@ -494,8 +849,9 @@ static void self_reconfigure(struct context *context, void *data, size_t id) {
 
 static void pcap_read(struct pcap_sub_interface *sub, uint32_t unused) {
 	(void) unused;
-	sub->interface->in = sub == &sub->interface->directions[0];
+	sub->interface->in = sub == &sub->interface->subs[PCAP_DIR_IN];
 	int result = pcap_dispatch(sub->pcap, MAX_PACKETS, (pcap_handler) packet_handler, (unsigned char *) sub->interface);
+	batch_flush(sub->interface->loop);
 	if (result == -1) {
 		ulog(LLOG_ERROR, "Error reading packets from PCAP on %s (%s)\n", sub->interface->name, pcap_geterr(sub->pcap));
 		sub->interface->loop->retry_reconfigure_on_failure = true;
@@ -506,29 +862,212 @@ static void pcap_read(struct pcap_sub_interface *sub, uint32_t unused) {
 		ulog(LLOG_DEBUG_VERBOSE, "Handled %d packets on %s/%p\n", result, sub->interface->name, (void *) sub);
 }
 
+/*
+ * Read whatever blocks the kernel has handed over to us in the ring. Each block
+ * contains a batch of packets, so no syscall or copy is needed per packet. The
+ * socket captures both directions, the packet type says which one it is.
+ *
+ * We limit the number of blocks per wakeup, so other events get their chance. The
+ * epoll is level-triggered, so we get called again for the rest.
+ */
+static void ring_read(struct pcap_sub_interface *sub, uint32_t unused) {
+	(void) unused;
+	struct pcap_interface *interface = sub->interface;
+	size_t count = 0;
+	for (size_t i = 0; i < RING_MAX_BLOCKS; i ++) {
+		struct tpacket_block_desc *block = (struct tpacket_block_desc *) (sub->ring + sub->block * RING_BLOCK_SIZE);
+		if (!(block->hdr.bh1.block_status & TP_STATUS_USER))
+			break; // Still owned by the kernel
+		__sync_synchronize(); // Don't read the content before the status
+		const uint8_t *pos = (const uint8_t *) block + block->hdr.bh1.offset_to_first_pkt;
+		for (uint32_t j = 0; j < block->hdr.bh1.num_pkts; j ++) {
+			const struct tpacket3_hdr *frame = (const struct tpacket3_hdr *) pos;
+			const struct sockaddr_ll *sll = (const struct sockaddr_ll *) (pos + TPACKET_ALIGN(sizeof *frame));
+			interface->in = sll->sll_pkttype != PACKET_OUTGOING;
+			const struct pcap_pkthdr header = {
+				.ts = {
+					.tv_sec = frame->tp_sec,
+					.tv_usec = frame->tp_nsec / 1000
+				},
+				.caplen = frame->tp_snaplen,
+				.len = frame->tp_len
+			};
+			packet_handler(interface, &header, pos + frame->tp_mac);
+			pos += frame->tp_next_offset;
+		}
+		count += block->hdr.bh1.num_pkts;
+		// The whole block is one batch, the packets are valid until we return it
+		batch_flush(interface->loop);
+		// The parsed packets live in the batch pool, don't let it grow over the whole ring
+		mem_pool_reset(interface->loop->batch_pool);
+		__sync_synchronize(); // Make sure we are done with the block before returning it
+		block->hdr.bh1.block_status = TP_STATUS_KERNEL;
+		sub->block = (sub->block + 1) % RING_BLOCK_COUNT;
+	}
+	interface->watchdog_received = true;
+	if (count)
+		ulog(LLOG_DEBUG_VERBOSE, "Handled %zu packets from ring on %s/%p\n", count, interface->name, (void *) sub);
+}
+
 static void epoll_register_pcap(struct loop *loop, struct pcap_interface *interface, int op) {
-	for (size_t i = 0; i < 2; i ++) {
+	for (size_t i = 0; i < interface->sub_count; i ++) {
 		struct epoll_event event = {
 			.events = EPOLLIN,
 			.data = {
-				.ptr = &interface->directions[i]
+				.ptr = &interface->subs[i]
 			}
 		};
-		if (epoll_ctl(loop->epoll_fd, op, interface->directions[i].fd, &event) == -1)
-			die("Can't register PCAP fd %d of %s to epoll fd %d (%s)\n", interface->directions[i].fd, interface->name, loop->epoll_fd, strerror(errno));
+		if (epoll_ctl(loop->epoll_fd, op, interface->subs[i].fd, &event) == -1)
+			die("Can't register PCAP fd %d of %s to epoll fd %d (%s)\n", interface->subs[i].fd, interface->name, loop->epoll_fd, strerror(errno));
 	}
 }
 
-static void loop_get_now(struct loop *loop) {
+static uint64_t clock_ms(clockid_t clock) {
 	struct timespec ts;
+	if (clock_gettime(clock, &ts) == -1)
+		die("Couldn't get time (%s)\n", strerror(errno));
+	return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static uint64_t monotonic_now(void) {
 	/*
 	 * CLOC_MONOTONIC can go backward or jump if admin adjusts date.
 	 * But the CLOCK_MONOTONIC_RAW doesn't seem to be available in uclibc.
 	 * Any better alternative?
 	 */
-	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
-		die("Couldn't get time (%s)\n", strerror(errno));
-	loop->now = (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+	return clock_ms(CLOCK_MONOTONIC);
+}
+
+/*
+ * Pick the clock for the loop time. The coarse one is much cheaper to read on
+ * some routers and it is the same clock as CLOCK_MONOTONIC, only with the
+ * resolution of the kernel tick. The timeouts are precise anyway, thanks to
+ * the timerfd.
+ */
+static clockid_t now_clock_choose(void) {
+#ifdef CLOCK_MONOTONIC_COARSE
+	struct timespec res;
+	if (clock_getres(CLOCK_MONOTONIC_COARSE, &res) == 0 && res.tv_sec == 0 && res.tv_nsec <= COARSE_CLOCK_MAX_RES) {
+		ulog(LLOG_DEBUG, "Using coarse clock with resolution of %ld ns\n", (long)res.tv_nsec);
+		return CLOCK_MONOTONIC_COARSE;
+	}
+#endif
+	return CLOCK_MONOTONIC;
+}
+
+static void loop_get_now(struct loop *loop) {
+	if (loop->replay)
+		return; // The replay moves the time with the packets
+	uint64_t now = clock_ms(loop->now_clock);
+	// The coarse clock may lag behind the timer that woke us, don't go back
+	if (now > loop->now)
+		loop->now = now;
+}
+
+// Set the timerfd to the next timeout (or disarm it), if it changed
+static void timer_update(struct loop *loop) {
+	uint64_t when = 0;
+	// During replay, the timeouts run on the time of the packets, not on the real clock
+	if (!loop->replay && loop->timeout_count)
+		when = timeout_next(loop)->when;
+	if (when == loop->timer_armed)
+		return;
+	struct itimerspec spec = {
+		.it_value = {
+			.tv_sec = when / 1000,
+			.tv_nsec = (when % 1000) * 1000000
+		}
+	};
+	if (timerfd_settime(loop->timer_fd, TFD_TIMER_ABSTIME, &spec, NULL) == -1)
+		die("Couldn't set timer %d (%s)\n", loop->timer_fd, strerror(errno));
+	loop->timer_armed = when;
+}
+
+/*
+ * The timer expired. It may be called more than once for the same expiration,
+ * the later calls do nothing.
+ */
+static void timer_expired(void *data, uint32_t unused) {
+	(void) unused;
+	struct loop *loop = (struct loop *)((char *) data - offsetof(struct loop, timer_handler));
+	uint64_t expirations;
+	if (read(loop->timer_fd, &expirations, sizeof expirations) == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+		die("Couldn't read timer %d (%s)\n", loop->timer_fd, strerror(errno));
+	// The kernel says the time came, even if the coarse clock doesn't know yet
+	if (loop->timer_armed > loop->now)
+		loop->now = loop->timer_armed;
+	loop->timer_armed = 0;
+}
+
+static uint64_t replay_timestamp(const struct pcap_pkthdr *header) {
+	return 1000000 * (uint64_t)header->ts.tv_sec + (uint64_t)header->ts.tv_usec;
+}
+
+// Read the next packet of the replay, if not already read. Returns false at the end of the file.
+static bool replay_peek(struct pcap_interface *interface) {
+	struct replay *replay = &interface->replay;
+	if (replay->done)
+		return false;
+	if (replay->header)
+		return true;
+	struct pcap_pkthdr *header;
+	const unsigned char *data;
+	int result = pcap_next_ex(interface->subs[0].pcap, &header, &data);
+	if (result == 1) {
+		if (!replay->started) {
+			replay->started = true;
+			replay->first_ts = replay_timestamp(header);
+			replay->base_now = interface->loop->now;
+			replay->real_start = monotonic_now();
+		}
+		replay->header = header;
+		replay->data = data;
+		return true;
+	}
+	if (result == -2)
+		ulog(LLOG_INFO, "Replay of %s finished, %zu packets in %" PRIu64 " ms\n", interface->name, replay->packets, replay->started ? monotonic_now() - replay->real_start : 0);
+	else
+		ulog(LLOG_ERROR, "Error reading %s (%s)\n", interface->name, pcap_geterr(interface->subs[0].pcap));
+	replay->done = true;
+	loop_break(interface->loop); // Nothing more to do
+	return false;
+}
+
+// How many milliseconds of real time until the next packet of the replay is due.
+static uint64_t replay_wait(struct pcap_interface *interface) {
+	const struct replay *replay = &interface->replay;
+	if (!replay_peek(interface) || replay->pacing == REPLAY_FAST)
+		return 0;
+	uint64_t timestamp = replay_timestamp(replay->header);
+	uint64_t offset = timestamp > replay->first_ts ? timestamp - replay->first_ts : 0;
+	uint64_t due = replay->real_start + (uint64_t)(offset / 1000 / replay->speed);
+	uint64_t now = monotonic_now();
+	return due > now ? due - now : 0;
+}
+
+/*
+ * Feed the due packets of the replay to the plugins. The time moves with them.
+ * If a packet is past the next timeout, it is left for later, so the timeout fires
+ * first ‒ like it would during a live capture.
+ */
+static void replay_step(struct pcap_interface *interface) {
+	struct loop *loop = interface->loop;
+	struct replay *replay = &interface->replay;
+	for (size_t i = 0; i < MAX_PACKETS && replay_peek(interface) && !replay_wait(interface); i ++) {
+		uint64_t timestamp = replay_timestamp(replay->header);
+		// Out of order packets don't move the time back
+		if (timestamp > replay->first_ts && replay->base_now + (timestamp - replay->first_ts) / 1000 > loop->now)
+			loop->now = replay->base_now + (timestamp - replay->first_ts) / 1000;
+		if (timeout_due(loop))
+			break;
+		const struct pcap_pkthdr *header = replay->header;
+		// Only the cooked capture knows the direction, consider everything else incoming
+		interface->in = interface->datalink != DLT_LINUX_SLL || header->caplen < 2 || ntohs(*(const uint16_t *)replay->data) != PACKET_OUTGOING;
+		replay->header = NULL; // The data stay valid until the next read
+		replay->packets ++;
+		packet_handler(interface, header, replay->data);
+	}
+	batch_flush(loop);
 }
 
 struct loop *loop_create(void) {
@@ -546,6 +1085,9 @@ struct loop *loop_create(void) {
 	int epoll_fd = epoll_create(42);
 	if (epoll_fd == -1)
 		die("Couldn't create epoll instance (%s)\n", strerror(errno));
+	int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timer_fd == -1)
+		die("Couldn't create timer (%s)\n", strerror(errno));
 	struct mem_pool *pool = mem_pool_create("Global permanent pool");
 #ifdef GDB_BACKTRACE
 	if (!gdb_command)
@@ -555,11 +1097,19 @@ struct loop *loop_create(void) {
 	struct loop *result = mem_pool_alloc(pool, sizeof *result);
 	*result = (struct loop) {
 		.permanent_pool = pool,
-		.epoll_fd = epoll_fd
+		.epoll_fd = epoll_fd,
+		.timer_handler = {
+			.handler = timer_expired
+		},
+		.timer_fd = timer_fd,
+		.now_clock = now_clock_choose(),
+		.timeout_free = TIMEOUT_NO_SLOT
 	};
+	loop_register_fd(result, timer_fd, &result->timer_handler);
 	result->batch_pool = loop_pool_create(result, NULL, "Global batch pool");
 	result->temp_pool = loop_pool_create(result, NULL, "Global temporary pool");
 	loop_get_now(result);
+	result->cpu_stats_since = result->now;
 	return result;
 }
 
@@ -586,17 +1136,11 @@ static void plugin_destroy(struct plugin_holder *plugin, bool emergency) {
 	if (!emergency)
 		plugin_finish(plugin);
 	jump_ready = false;
-	size_t pos = 0;
 	struct loop *loop = plugin->context.loop;
-	// Kill timeouts belonging to the plugin
-	while (pos < loop->timeout_count) {
-		if (loop->timeouts[pos].context == &plugin->context) {
-			// Drop this timeout, as we kill the corresponding plugin
-			memmove(loop->timeouts + pos, loop->timeouts + pos + 1, (loop->timeout_count - pos - 1) * sizeof *loop->timeouts);
-			loop->timeout_count --;
-		} else
-			pos ++;
-	}
+	// Kill timeouts belonging to the plugin (walk the slots, they don't move when removing)
+	for (size_t slot = 0; slot < loop->timeout_slots; slot ++)
+		if (loop->timeouts[slot].id && loop->timeouts[slot].context == &plugin->context)
+			timeout_remove(loop, slot);
 	// Kill FDs belonging to the plugin
 	LFOR(plugin_fds, fd, plugin) {
 		loop->fd_invalidated = true;
@@ -671,8 +1215,57 @@ static void fail_count_reset(struct context *context, void *data, size_t id) {
 	loop_timeout_add(loop, FAIL_COUNT_RESET, NULL, loop, fail_count_reset);
 }
 
+// All the memory the plugin holds (except for the temporary pool, which is shared)
+static size_t plugin_memory(const struct plugin_holder *plugin) {
+	size_t result = mem_pool_allocated(plugin->context.permanent_pool);
+	for (const struct pool_node *node = plugin->pool_list.head; node; node = node->next)
+		result += node->slab ? slab_allocated(node->slab) : mem_pool_allocated(node->pool);
+	return result;
+}
+
+static void memory_check(struct context *context, void *data, size_t id) {
+	(void)context;
+	(void)id;
+	struct loop *loop = data;
+	// Schedule the next round first, we may jump out of here
+	loop_timeout_add(loop, MEMORY_CHECK_TIME, NULL, loop, memory_check);
+	LFOR(plugin, plugin, &loop->plugins) {
+		plugin->memory_used = plugin_memory(plugin);
+		if (plugin->memory_used > plugin->memory_peak)
+			plugin->memory_peak = plugin->memory_used;
+		if (!plugin->memory_budget)
+			continue;
+		bool pressure_callback = plugin->api_version >= 3;
+		if (plugin->memory_used > plugin->memory_budget) {
+			ulog(LLOG_WARN, "Plugin %s uses %zu bytes of memory, over its budget of %zu\n", plugin->plugin.name, plugin->memory_used, plugin->memory_budget);
+			if (pressure_callback) {
+				plugin_memory_pressure(plugin, true);
+				plugin->memory_used = plugin_memory(plugin);
+			}
+			if (plugin->memory_used > plugin->memory_budget) {
+				// Handle it the same way as a crash of the plugin
+				loop->over_budget = &plugin->context;
+				assert(jump_ready);
+				longjmp(jump_env, 1);
+			}
+		} else if (plugin->memory_used > plugin->memory_budget / 100 * MEMORY_SOFT_PERCENT) {
+			if (!plugin->memory_pressed) {
+				ulog(LLOG_INFO, "Plugin %s uses %zu bytes of memory, asking it to free some\n", plugin->plugin.name, plugin->memory_used);
+				plugin->memory_pressed = true;
+				if (pressure_callback) {
+					plugin_memory_pressure(plugin, false);
+					plugin->memory_used = plugin_memory(plugin);
+				}
+			}
+		} else {
+			plugin->memory_pressed = false; // Ask again next time it gets over
+		}
+	}
+}
+
 void loop_run(struct loop *loop) {
 	loop_timeout_add(loop, FAIL_COUNT_RESET, NULL, loop, fail_count_reset);
+	loop_timeout_add(loop, MEMORY_CHECK_TIME, NULL, loop, memory_check);
 	if (setjmp(abort_env)) {
 		abort_ready = 0;
 		// Avoid signal loop
@@ -707,10 +1300,17 @@ void loop_run(struct loop *loop) {
 	REINIT:
 	if (setjmp(jump_env)) {
 		volatile struct context *context;
-		bool failure = false;
+		bool failure = false, over_budget = false;
+		// We may have jumped out of the middle of a batch. Drop it, the packets are no longer valid.
+		loop->batch = NULL;
+		loop->batch_count = loop->batch_capacity = 0;
 		if (loop->reinitialize_plugin) {
 			context = loop->reinitialize_plugin;
 			loop->reinitialize_plugin = NULL;
+		} else if (loop->over_budget) {
+			failure = over_budget = true;
+			context = loop->over_budget;
+			loop->over_budget = NULL;
 		} else {
 			failure = true;
 			context = current_context;
@@ -725,7 +1325,10 @@ void loop_run(struct loop *loop) {
 			if (failure) {
 				reinit = holder->failed < FAIL_COUNT;
 				failed = holder->failed;
-				ulog(LLOG_ERROR, "Signal %d in plugin %s (failed %zu times before)\n", jump_signum, holder->plugin.name, failed);
+				if (over_budget)
+					ulog(LLOG_ERROR, "Plugin %s exceeded its memory budget (failed %zu times before)\n", holder->plugin.name, failed);
+				else
+					ulog(LLOG_ERROR, "Signal %d in plugin %s (failed %zu times before)\n", jump_signum, holder->plugin.name, failed);
 			}
 			plugin_destroy(holder, true);
 			struct loop_configurator *configurator = loop_config_start(loop);
@@ -745,7 +1348,12 @@ void loop_run(struct loop *loop) {
 				}
 			}
 			LFOR(pcap, interface, &loop->pcap_interfaces) {
-				if (!loop_add_pcap(configurator, interface->name, interface->promiscuous))
+				bool copied;
+				if (interface->capture == CAPTURE_FILE)
+					copied = loop_add_pcap_file(configurator, interface->name, interface->replay.pacing, interface->replay.speed);
+				else
+					copied = loop_add_pcap(configurator, interface->name, interface->promiscuous, interface->capture);
+				if (!copied)
 					die("Copy of %s failed\n", interface->name);
 			}
 			loop_config_commit(configurator);
@@ -760,18 +1368,20 @@ void loop_run(struct loop *loop) {
 	while (!loop->stopped) {
 		struct epoll_event events[MAX_EVENTS];
 		int wait_time;
-		if (loop->timeout_count) {
-			// Set the wait time until the next timeout
-			// Use larger type so we can check the bounds.
-			int64_t wait = loop->timeouts[0].when - loop->now;
-			if (wait < 0)
+		if (loop->replay) {
+			// The timeouts run on the time of the packets, so wait only for the next packet
+			uint64_t wait = replay_wait(loop->replay);
+			if (timeout_due(loop))
 				wait = 0;
 			if (wait > INT_MAX)
 				wait = INT_MAX;
 			wait_time = wait;
+		} else if (timeout_due(loop)) {
+			wait_time = 0; // Just look what else is there and handle the timeout
 		} else {
-			wait_time = -1; // Forever, if no timeouts
+			wait_time = -1; // Forever, the timer wakes us for the next timeout
 		}
+		timer_update(loop);
 		alarm(0); // The epoll_wait can run forever
 		int ready = epoll_pwait(loop->epoll_fd, events, MAX_EVENTS, wait_time, &original_mask);
 		alarm(60); // But catch any infinite loops in the processing (60 seconds should be enough)
@@ -785,6 +1395,10 @@ void loop_run(struct loop *loop) {
 				die("epoll_wait on %d failed: %s\n", loop->epoll_fd, strerror(errno));
 		}
 		loop_get_now(loop);
+		// The timer moves the time, handle it before looking at the timeouts
+		for (int i = 0; i < ready; i ++)
+			if (events[i].data.ptr == &loop->timer_handler)
+				timer_expired(&loop->timer_handler, events[i].events);
 		loop->fd_invalidated = false;
 		if (loop->reconfigure) { // We are asked to reconfigure
 			jump_ready = 0;
@@ -834,20 +1448,22 @@ void loop_run(struct loop *loop) {
 			continue; // Do the retry of epoll
 		// Handle timeouts.
 		bool timeouts_called = false;
-		while (loop->timeout_count && loop->timeouts[0].when <= loop->now) {
+		while (timeout_due(loop)) {
 			// Take it out before calling. The callback might manipulate timeouts.
-			struct timeout timeout = loop->timeouts[0];
-			// Suboptimal, but there should be only few timeouts and not often
-			memmove(loop->timeouts, loop->timeouts + 1, (-- loop->timeout_count) * sizeof *loop->timeouts);
+			struct timeout timeout = *timeout_next(loop);
+			timeout_remove(loop, loop->timeout_heap[0]);
 			current_context = timeout.context;
 			ulog(LLOG_DEBUG, "Firing timeout %zu at %llu when %zu more timeouts active\n", timeout.id, (long long unsigned) timeout.when, loop->timeout_count);
+			uint64_t start = cpu_clock();
 			timeout.callback(timeout.context, timeout.data, timeout.id);
+			if (timeout.context) // The context is the first thing in the plugin holder
+				cpu_account((struct plugin_holder *) timeout.context, CALLBACK_TIMEOUT, start, 1);
 			mem_pool_reset(loop->temp_pool);
 			current_context = NULL;
 			timeouts_called = true;
 		}
 		// Handle events from epoll
-		if (!ready && !timeouts_called) {
+		if (!ready && !timeouts_called && !loop->replay) {
 			// This is strange. We wait for 1 event idefinitelly and get 0
 			ulog(LLOG_WARN, "epoll_wait on %d returned 0 events and 0 timeouts\n", loop->epoll_fd);
 		} else if (!timeouts_called) { // In case some timeouts happened, get new events. The timeouts could have manipulated existing file descriptors and what we have might be invalid.
@@ -862,6 +1478,8 @@ void loop_run(struct loop *loop) {
 				handler->handler(events[i].data.ptr, events[i].events);
 			}
 		}
+		if (loop->replay && !timeouts_called)
+			replay_step(loop->replay);
 		mem_pool_reset(loop->batch_pool);
 	}
 	jump_ready = 0;
@@ -875,15 +1493,28 @@ void loop_run(struct loop *loop) {
 	abort_ready = 0;
 }
 
+static void ring_close(uint8_t *ring, int fd) {
+	if (munmap(ring, RING_BLOCK_SIZE * RING_BLOCK_COUNT) == -1)
+		ulog(LLOG_ERROR, "Couldn't unmap capture ring (%s)\n", strerror(errno));
+	if (close(fd) == -1)
+		ulog(LLOG_ERROR, "Couldn't close capture socket %d (%s)\n", fd, strerror(errno));
+}
+
+static void sub_close(struct pcap_sub_interface *sub) {
+	if (sub->pcap)
+		pcap_close(sub->pcap);
+	else
+		ring_close(sub->ring, sub->fd);
+}
+
 static void pcap_destroy(struct pcap_interface *interface) {
-	ulog(LLOG_INFO, "Closing both PCAPs on %s\n", interface->name);
+	ulog(LLOG_INFO, "Closing captures on %s\n", interface->name);
 	if (interface->watchdog_initialized)
 		loop_timeout_cancel(interface->loop, interface->watchdog_timer);
-	for (size_t i = 0; i < 2; i ++) {
-		int fd = pcap_get_selectable_fd(interface->directions[i].pcap);
+	for (size_t i = 0; i < interface->sub_count; i ++) {
 		if (interface->registered)
-			loop_unregister_fd(interface->loop, fd);
-		pcap_close(interface->directions[i].pcap);
+			loop_unregister_fd(interface->loop, interface->subs[i].fd);
+		sub_close(&interface->subs[i]);
 	}
 }
 
@@ -898,13 +1529,17 @@ void loop_destroy(struct loop *loop) {
 	// Close the epoll
 	int result = close(loop->epoll_fd);
 	assert(result == 0);
+	result = close(loop->timer_fd);
+	assert(result == 0);
+	free(loop->timeouts);
+	free(loop->timeout_heap);
 	pool_list_destroy(&loop->pool_list);
 	// This mempool must be destroyed last, as the loop is allocated from it
 	mem_pool_destroy(loop->permanent_pool);
 }
 
-// Open one direction of the capture.
-static int pcap_create_dir(pcap_t **pcap, pcap_direction_t direction, const char *interface, const char *dir_txt, bool promiscuous) {
+// Open one direction of the capture. Snaplen of 0 means whole packets.
+static int pcap_create_dir(pcap_t **pcap, pcap_direction_t direction, const char *interface, const char *dir_txt, bool promiscuous, size_t snaplen) {
 	ulog(LLOG_INFO, "Initializing PCAP (%s) on %s\n", dir_txt, interface);
 	// Open the pcap
 	char errbuf[PCAP_ERRBUF_SIZE];
@@ -920,6 +1555,10 @@ static int pcap_create_dir(pcap_t **pcap, pcap_direction_t direction, const char
 	assert(result == 0);
 	result = pcap_set_buffer_size(*pcap, PCAP_BUFFER);
 	assert(result == 0);
+	if (snaplen) {
+		result = pcap_set_snaplen(*pcap, snaplen);
+		assert(result == 0);
+	}
 
 	// TODO: Some filters?
 
@@ -964,54 +1603,243 @@ static int pcap_create_dir(pcap_t **pcap, pcap_direction_t direction, const char
 	return fd;
 }
 
-bool loop_add_pcap(struct loop_configurator *configurator, const char *interface, bool promiscuous) {
+#define RING_FAIL(FUNCTION) do { ulog(LLOG_ERROR, "Ring on %s failed at " FUNCTION ": %s\n", interface, strerror(errno)); close(fd); return -1; } while (0)
+
+/*
+ * Open the capture through a TPACKET_V3 ring. Unlike pcap, a single socket is
+ * enough for both directions, as we can see the packet type in the ring.
+ */
+static int ring_create(uint8_t **ring, int *datalink, const char *interface, bool promiscuous) {
+	ulog(LLOG_INFO, "Initializing ring on %s\n", interface);
+	// Protocol 0 ‒ don't receive anything until bound to the interface.
+	int fd = socket(AF_PACKET, SOCK_RAW, 0);
+	if (fd == -1) {
+		ulog(LLOG_ERROR, "Can't create packet socket for %s (%s)\n", interface, strerror(errno));
+		return -1;
+	}
+	struct ifreq req;
+	memset(&req, 0, sizeof req);
+	strncpy(req.ifr_name, interface, IFNAMSIZ - 1);
+	if (ioctl(fd, SIOCGIFINDEX, &req) == -1)
+		RING_FAIL("get if index");
+	int ifindex = req.ifr_ifindex;
+	if (ioctl(fd, SIOCGIFHWADDR, &req) == -1)
+		RING_FAIL("get link type");
+	switch (req.ifr_hwaddr.sa_family) {
+		case ARPHRD_ETHER:
+		case ARPHRD_LOOPBACK:
+			*datalink = DLT_EN10MB;
+			break;
+		case ARPHRD_NONE: // Tun devices
+		case ARPHRD_PPP:
+			*datalink = DLT_RAW;
+			break;
+		default:
+			ulog(LLOG_ERROR, "Unsupported link type %d of %s for ring capture, use pcap\n", (int) req.ifr_hwaddr.sa_family, interface);
+			close(fd);
+			return -1;
+	}
+	int version = TPACKET_V3;
+	if (setsockopt(fd, SOL_PACKET, PACKET_VERSION, &version, sizeof version) == -1)
+		RING_FAIL("set TPACKET_V3");
+	struct tpacket_req3 ring_req = {
+		.tp_block_size = RING_BLOCK_SIZE,
+		.tp_block_nr = RING_BLOCK_COUNT,
+		.tp_frame_size = RING_FRAME_SIZE,
+		.tp_frame_nr = RING_BLOCK_SIZE / RING_FRAME_SIZE * RING_BLOCK_COUNT,
+		.tp_retire_blk_tov = RING_BLOCK_TIMEOUT
+	};
+	if (setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &ring_req, sizeof ring_req) == -1)
+		RING_FAIL("set up ring");
+	*ring = mmap(NULL, RING_BLOCK_SIZE * RING_BLOCK_COUNT, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (*ring == MAP_FAILED)
+		RING_FAIL("mmap");
+	if (promiscuous) {
+		struct packet_mreq mreq = {
+			.mr_ifindex = ifindex,
+			.mr_type = PACKET_MR_PROMISC
+		};
+		// Just warn, the same as pcap does
+		if (setsockopt(fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mreq, sizeof mreq) == -1)
+			ulog(LLOG_WARN, "Ring on %s: can't set promiscuous mode (%s)\n", interface, strerror(errno));
+	}
+	struct sockaddr_ll addr = {
+		.sll_family = AF_PACKET,
+		.sll_protocol = htons(ETH_P_ALL),
+		.sll_ifindex = ifindex
+	};
+	if (bind(fd, (struct sockaddr *) &addr, sizeof addr) == -1) {
+		ulog(LLOG_ERROR, "Ring on %s failed at bind: %s\n", interface, strerror(errno));
+		ring_close(*ring, fd);
+		return -1;
+	}
+	return fd;
+}
+
+#undef RING_FAIL
+
+// Open one direction of the interface through pcap.
+static bool pcap_create_sub(struct pcap_sub_interface *sub, int *datalink, pcap_direction_t direction, const char *interface, const char *dir_txt, bool promiscuous, size_t snaplen) {
+	sub->handler = pcap_read;
+	sub->fd = pcap_create_dir(&sub->pcap, direction, interface, dir_txt, promiscuous, snaplen);
+	if (sub->fd == -1)
+		return false;
+	*datalink = pcap_datalink(sub->pcap);
+	return true;
+}
+
+// How much of each packet the plugins need, 0 for whole packets.
+static size_t snaplen_compute(struct loop_configurator *configurator) {
+	if (!configurator->plugins.head)
+		return 0;
+	size_t payload = 0;
+	LFOR(plugin, plugin, &configurator->plugins) {
+		if (plugin->api_version < 3 || !plugin->plugin.payload_limit)
+			return 0;
+		if (plugin->plugin.payload_len > payload)
+			payload = plugin->plugin.payload_len;
+	}
+	return SNAPLEN_HEADERS + payload;
+}
+
+// Take an interface from the old configuration into the new one.
+static void pcap_copy(struct loop_configurator *configurator, struct pcap_interface *old) {
+	old->mark = false; // We copy it, don't close it at commit
+	struct pcap_interface *new = pcap_append_pool(&configurator->pcap_interfaces, configurator->config_pool);
+	*new = *old;
+	new->next = NULL;
+	new->name = mem_pool_strdup(configurator->config_pool, old->name);
+	// The old subs live in the old config pool
+	new->subs = mem_pool_alloc(configurator->config_pool, new->sub_count * sizeof *new->subs);
+	memcpy(new->subs, old->subs, new->sub_count * sizeof *new->subs);
+	for (size_t i = 0; i < new->sub_count; i ++)
+		new->subs[i].interface = new;
+}
+
+bool loop_add_pcap(struct loop_configurator *configurator, const char *interface, bool promiscuous, enum capture_mode capture) {
+	assert(capture != CAPTURE_FILE);
 	// First, go through the old ones and copy it if is there.
 	LFOR(pcap, old, &configurator->loop->pcap_interfaces)
-		if (strcmp(interface, old->name) == 0 && old->promiscuous == promiscuous) {
-			old->mark = false; // We copy it, don't close it at commit
-			struct pcap_interface *new = pcap_append_pool(&configurator->pcap_interfaces, configurator->config_pool);
-			*new = *old;
-			new->next = NULL;
-			new->name = mem_pool_strdup(configurator->config_pool, interface);
-			new->directions[PCAP_DIR_IN].interface = new;
-			new->directions[PCAP_DIR_OUT].interface = new;
+		if (strcmp(interface, old->name) == 0 && old->promiscuous == promiscuous && old->capture == capture) {
+			pcap_copy(configurator, old);
 			return true;
 		}
-	pcap_t *pcap_in;
-	int fd_in = pcap_create_dir(&pcap_in, PCAP_D_IN, interface, "in", promiscuous);
-	if (fd_in == -1)
-		return false; // Error already reported
-
-	pcap_t *pcap_out;
-	int fd_out = pcap_create_dir(&pcap_out, PCAP_D_OUT, interface, "out", promiscuous);
-	if (fd_out == -1) {
-		pcap_close(pcap_in);
-		return false;
+	size_t sub_count = capture == CAPTURE_PCAP ? 2 : 1;
+	struct pcap_sub_interface *subs = mem_pool_alloc(configurator->config_pool, sub_count * sizeof *subs);
+	int datalink = -1;
+	// The plugins are added first, so the handles are opened with the final snaplen
+	size_t snaplen = snaplen_compute(configurator);
+	switch (capture) {
+		case CAPTURE_PCAP:
+			if (!pcap_create_sub(&subs[PCAP_DIR_IN], &datalink, PCAP_D_IN, interface, "in", promiscuous, snaplen))
+				return false; // Error already reported
+			if (!pcap_create_sub(&subs[PCAP_DIR_OUT], &datalink, PCAP_D_OUT, interface, "out", promiscuous, snaplen)) {
+				sub_close(&subs[PCAP_DIR_IN]);
+				return false;
+			}
+			break;
+		case CAPTURE_RING:
+			subs[0] = (struct pcap_sub_interface) {
+				.handler = ring_read
+			};
+			subs[0].fd = ring_create(&subs[0].ring, &datalink, interface, promiscuous);
+			if (subs[0].fd == -1)
+				return false;
+			break;
+		case CAPTURE_FILE:
+			insane("Files are added by loop_add_pcap_file\n");
 	}
 
-	// Put the PCAP into the new configuration loop.
+	// Put the capture into the new configuration loop.
 	struct pcap_interface *new = pcap_append_pool(&configurator->pcap_interfaces, configurator->config_pool);
 	*new = (struct pcap_interface) {
 		.loop = configurator->loop,
 		.name = mem_pool_strdup(configurator->config_pool, interface),
 		.promiscuous = promiscuous,
-		.directions = {
-			[PCAP_DIR_IN] = {
-				.handler = pcap_read,
-				.pcap = pcap_in,
-				.fd = fd_in,
-				.interface = new
-			},
-			[PCAP_DIR_OUT] = {
-				.handler = pcap_read,
-				.pcap = pcap_out,
-				.fd = fd_out,
-				.interface = new
-			}
-		},
-		.datalink = pcap_datalink(pcap_in),
+		.capture = capture,
+		.subs = subs,
+		.sub_count = sub_count,
+		.snaplen = snaplen,
+		.datalink = datalink,
 		.mark = true
 	};
+	for (size_t i = 0; i < sub_count; i ++)
+		subs[i].interface = new;
+	return true;
+}
+
+bool loop_add_pcap_file(struct loop_configurator *configurator, const char *file, enum replay_pacing pacing, double speed) {
+	if (pacing == REPLAY_ORIGINAL)
+		speed = 1;
+	if (pacing == REPLAY_SCALED && !(speed > 0)) {
+		ulog(LLOG_ERROR, "Replay speed of %s must be positive\n", file);
+		return false;
+	}
+	LFOR(pcap, other, &configurator->pcap_interfaces)
+		if (other->capture == CAPTURE_FILE) {
+			ulog(LLOG_ERROR, "Can't replay %s, already replaying %s\n", file, other->name);
+			return false;
+		}
+	// Continue where we were in case of reconfiguration
+	LFOR(pcap, old, &configurator->loop->pcap_interfaces)
+		if (old->capture == CAPTURE_FILE && strcmp(file, old->name) == 0 && old->replay.pacing == pacing && old->replay.speed == speed) {
+			pcap_copy(configurator, old);
+			return true;
+		}
+	char errbuf[PCAP_ERRBUF_SIZE];
+	pcap_t *pcap = pcap_open_offline(file, errbuf);
+	if (!pcap) {
+		ulog(LLOG_ERROR, "Can't open %s for replay (%s)\n", file, errbuf);
+		return false;
+	}
+	ulog(LLOG_INFO, "Replaying %s\n", file);
+	struct pcap_sub_interface *sub = mem_pool_alloc(configurator->config_pool, sizeof *sub);
+	struct pcap_interface *new = pcap_append_pool(&configurator->pcap_interfaces, configurator->config_pool);
+	*sub = (struct pcap_sub_interface) {
+		.pcap = pcap,
+		.fd = -1, // Not pollable, the loop drives it
+		.interface = new
+	};
+	*new = (struct pcap_interface) {
+		.loop = configurator->loop,
+		.name = mem_pool_strdup(configurator->config_pool, file),
+		.capture = CAPTURE_FILE,
+		.subs = sub,
+		.sub_count = 1,
+		.datalink = pcap_datalink(pcap),
+		.mark = true,
+		.replay = {
+			.pacing = pacing,
+			.speed = speed
+		}
+	};
+	return true;
+}
+
+// Read the statistics of one direction in the format of pcap.
+static bool sub_stats(struct pcap_sub_interface *sub, struct pcap_stat *ps) {
+	if (sub->interface->capture == CAPTURE_FILE) {
+		// Nothing gets lost in a file
+		*ps = (struct pcap_stat) {
+			.ps_recv = sub->interface->replay.packets
+		};
+		return true;
+	}
+	if (sub->pcap)
+		return pcap_stats(sub->pcap, ps) == 0;
+	struct tpacket_stats_v3 stats;
+	socklen_t len = sizeof stats;
+	if (getsockopt(sub->fd, SOL_PACKET, PACKET_STATISTICS, &stats, &len) == -1) {
+		ulog(LLOG_ERROR, "Can't read ring statistics on %s (%s)\n", sub->interface->name, strerror(errno));
+		return false;
+	}
+	// The kernel resets them on read, but we want them cumulative, like pcap has them
+	sub->ring_received += stats.tp_packets;
+	sub->ring_dropped += stats.tp_drops;
+	*ps = (struct pcap_stat) {
+		.ps_recv = sub->ring_received,
+		.ps_drop = sub->ring_dropped
+	};
 	return true;
 }
 
@@ -1022,10 +1850,9 @@ size_t *loop_pcap_stats(struct context *context) {
 	size_t pos = 1;
 	LFOR(pcap, interface, &loop->pcap_interfaces) {
 		memset(result + pos, 0, 3 * sizeof *result);
-		for (size_t i = 0; i < 2; i ++) {
+		for (size_t i = 0; i < interface->sub_count; i ++) {
 			struct pcap_stat ps;
-			int error = pcap_stats(interface->directions[i].pcap, &ps);
-			if (error) {
+			if (!sub_stats(&interface->subs[i], &ps)) {
 				memset(result + pos, 0xff, 3 * sizeof *result);
 				break;
 			} else {
@@ -1272,7 +2099,33 @@ void loop_unregister_fd(struct loop *loop, int fd) {
 	loop->fd_invalidated = true;
 }
 
+static struct mem_pool *pool_create(struct loop *loop, struct context *context, const char *name, bool huge) {
+	struct pool_list *list = &loop->pool_list;
+	struct mem_pool *pool = loop->permanent_pool;
+	if (context) {
+		struct plugin_holder *holder = (struct plugin_holder *) context;
+#ifdef DEBUG
+		assert(holder->canary == PLUGIN_HOLDER_CANARY);
+#endif
+		list = &holder->pool_list;
+		pool = context->permanent_pool;
+	}
+	struct mem_pool *new = huge ? mem_pool_create_huge(name) : mem_pool_create(name);
+	struct pool_node *node = pool_append_pool(list, pool);
+	node->pool = new;
+	node->slab = NULL;
+	return new;
+}
+
 struct mem_pool *loop_pool_create(struct loop *loop, struct context *context, const char *name) {
+	return pool_create(loop, context, name, false);
+}
+
+struct mem_pool *loop_pool_create_huge(struct loop *loop, struct context *context, const char *name) {
+	return pool_create(loop, context, name, true);
+}
+
+struct slab *loop_slab_create(struct loop *loop, struct context *context, const char *name) {
 	struct pool_list *list = &loop->pool_list;
 	struct mem_pool *pool = loop->permanent_pool;
 	if (context) {
@@ -1283,8 +2136,10 @@ struct mem_pool *loop_pool_create(struct loop *loop, struct context *context, co
 		list = &holder->pool_list;
 		pool = context->permanent_pool;
 	}
-	struct mem_pool *new = mem_pool_create(name);
-	pool_append_pool(list, pool)->pool = new;
+	struct slab *new = slab_create(name);
+	struct pool_node *node = pool_append_pool(list, pool);
+	node->pool = NULL;
+	node->slab = new;
 	return new;
 }
 
@@ -1332,70 +2187,54 @@ size_t loop_timeout_add(struct loop *loop, uint32_t after, struct context *conte
 		 * busy loop, as we accept signals only when waiting for events.
 		 */
 		after = 1;
-	// Enough space?
-	if (loop->timeout_count == loop->timeout_capacity) {
-		loop->timeout_capacity = loop->timeout_capacity * 2;
-		if (!loop->timeout_capacity)
-			loop->timeout_capacity = 2; // Some basic size for the start
-		struct timeout *new = mem_pool_alloc(loop->permanent_pool, loop->timeout_capacity * sizeof *new);
-		memcpy(new, loop->timeouts, loop->timeout_count * sizeof *new);
-		loop->timeouts = new;
-		/* Yes, throwing out the old array. But with the double-growth, only linear
-		 * amount of memory is wasted. And we reuse the space after timed-out timeouts,
-		 * so it should not grow indefinitely.
-		 */
-	}
-	uint64_t when = loop->now + after;
-	// Sort it in, according to the value of when.
-	size_t pos = 0;
-	for (size_t i = loop->timeout_count; i; i --) {
-		if (loop->timeouts[i - 1].when > when)
-			loop->timeouts[i] = loop->timeouts[i - 1];
-		else {
-			pos = i;
-			break;
+	// Get a free slot, make more if there's none
+	if (loop->timeout_free == TIMEOUT_NO_SLOT) {
+		if (loop->timeout_slots == loop->timeout_capacity) {
+			loop->timeout_capacity = loop->timeout_capacity ? 2 * loop->timeout_capacity : 16;
+			sanity(loop->timeout_capacity <= TIMEOUT_SLOT_MASK, "Too many timeouts (%zu)\n", loop->timeout_slots);
+			// The old arrays are released by realloc, unlike with the memory pool
+			loop->timeouts = realloc(loop->timeouts, loop->timeout_capacity * sizeof *loop->timeouts);
+			loop->timeout_heap = realloc(loop->timeout_heap, loop->timeout_capacity * sizeof *loop->timeout_heap);
+			if (!loop->timeouts || !loop->timeout_heap)
+				die("Couldn't allocate space for %zu timeouts\n", loop->timeout_capacity);
 		}
+		loop->timeouts[loop->timeout_slots] = (struct timeout) {
+			.heap_pos = TIMEOUT_NO_SLOT
+		};
+		loop->timeout_free = loop->timeout_slots ++;
 	}
+	size_t slot = loop->timeout_free;
+	loop->timeout_free = loop->timeouts[slot].heap_pos;
 	/*
-	 * We let the id wrap around. We expect the old one with the same value already
-	 * timed out a long time ago. But we still check it is OK and fix it if not.
+	 * The serial number wraps around, but that only makes the check for stale
+	 * ids less reliable. The slot makes the id unique anyway. Skip 0, so the id
+	 * is never 0.
 	 */
-	static size_t id = 0;
-	bool ok;
-	do {
-		ok = true;
-		id ++;
-		for (size_t i = 0; i <= loop->timeout_count; i ++) {
-			if (i == pos)
-				continue;
-			if (loop->timeouts[i].id == id) {
-				ok = false;
-				break;
-			}
-		}
-	} while (!ok);
-	loop->timeouts[pos] = (struct timeout) {
+	if (!(++ loop->timeout_serial & (SIZE_MAX >> TIMEOUT_SLOT_BITS)))
+		loop->timeout_serial ++;
+	uint64_t when = loop->now + after;
+	loop->timeouts[slot] = (struct timeout) {
 		.when = when,
 		.callback = callback,
 		.context = context,
 		.data = data,
-		.id = id
+		.id = ((loop->timeout_serial & (SIZE_MAX >> TIMEOUT_SLOT_BITS)) << TIMEOUT_SLOT_BITS) | slot
 	};
-	ulog(LLOG_DEBUG, "Adding timeout for %lu milliseconds, expected to fire at %llu, now %llu as ID %zu\n", (unsigned long) after,  (unsigned long long) when, (unsigned long long) loop->now, loop->timeouts[pos].id);
+	loop->timeout_heap[loop->timeout_count] = slot;
+	timeout_sift_up(loop, loop->timeout_count ++);
+	ulog(LLOG_DEBUG, "Adding timeout for %lu milliseconds, expected to fire at %llu, now %llu as ID %zu\n", (unsigned long) after,  (unsigned long long) when, (unsigned long long) loop->now, loop->timeouts[slot].id);
 	assert(loop->now < when);
-	loop->timeout_count ++;
-	return loop->timeouts[pos].id;
+	return loop->timeouts[slot].id;
 }
 
 void loop_timeout_cancel(struct loop *loop, size_t id) {
-	for (size_t i = 0; i < loop->timeout_count; i ++)
-		if (loop->timeouts[i].id == id) {
-			// Move the rest one position left
-			memmove(loop->timeouts + i, loop->timeouts + i + 1, (loop->timeout_count - 1 - i) * sizeof *loop->timeouts);
-			loop->timeout_count --;
-			return;
-		}
-	assert(0); // The ID is not there! Already called the timeout?
+	size_t slot = id & TIMEOUT_SLOT_MASK;
+	// Already called or cancelled (the slot may be free or belong to another timeout now)
+	if (slot >= loop->timeout_slots || loop->timeouts[slot].id != id) {
+		ulog(LLOG_DEBUG, "Ignoring cancel of stale timeout %zu\n", id);
+		return;
+	}
+	timeout_remove(loop, slot);
 }
 
 struct loop_configurator *loop_config_start(struct loop *loop) {
@@ -1496,6 +2335,230 @@ static void pcap_watchdog(struct context *context_unused, void *data, size_t id_
 	interface->watchdog_timer = loop_timeout_add(interface->loop, PCAP_WATCHDOG_TIME, NULL, interface, pcap_watchdog);
 }
 
+// Build a filter expression for one interest of a plugin. NULL if it needs nothing more than the base.
+static const char *interest_term(const struct packet_interest *interest, struct mem_pool *pool) {
+	if (interest->layer != 'I')
+		return NULL; // Non-IP packets pass through the base filter
+	const char *ip;
+	switch (interest->ip_protocol) {
+		case 4:
+			ip = "ip";
+			break;
+		case 6:
+			ip = "ip6";
+			break;
+		default:
+			ip = "(ip or ip6)";
+			break;
+	}
+	switch (interest->app_protocol) {
+		case 'T':
+			if (interest->tcp_flags) {
+				// The IPv6 may have extension headers, BPF can't find the flags there reliably. Let all v6 TCP through.
+				const char *v4 = mem_pool_printf(pool, "ip and tcp and tcp[tcpflags] & %u != 0", (unsigned) interest->tcp_flags);
+				switch (interest->ip_protocol) {
+					case 4:
+						return v4;
+					case 6:
+						return "ip6 and tcp";
+					default:
+						return mem_pool_printf(pool, "(%s) or (ip6 and tcp)", v4);
+				}
+			}
+			return mem_pool_printf(pool, "%s and tcp", ip);
+		case 'U':
+			return mem_pool_printf(pool, "%s and udp", ip);
+		case 'i':
+			return "icmp";
+		case 'I':
+			return "icmp6";
+		default:
+			return ip;
+	}
+}
+
+/*
+ * Union the interests of all the plugins into a filter expression. Return NULL if
+ * all packets need to be captured.
+ */
+static const char *filter_build(struct loop_configurator *configurator) {
+	if (!configurator->plugins.head)
+		return NULL;
+	/*
+	 * The interest is about the innermost packet, but BPF can't look inside tunnels
+	 * or into whatever is not plain IP. So let all that through. The same for the
+	 * fragments ‒ the non-first IPv4 ones have no L4 header to match (so tcp[] fails
+	 * on them) and the IPv6 ones hide the protocol behind the fragment header.
+	 */
+	const char *result = "not (ip or ip6) or ip proto 4 or ip proto 41 or ip6 proto 4 or ip6 proto 41 or (ip[6:2] & 0x1fff != 0) or ip6 proto 44";
+	LFOR(plugin, plugin, &configurator->plugins) {
+		if (plugin->api_version < 3 || !plugin->plugin.interests)
+			return NULL; // This one wants everything
+		for (const struct packet_interest *const *interest = plugin->plugin.interests; *interest; interest ++) {
+			const char *term = interest_term(*interest, configurator->config_pool);
+			if (term)
+				result = mem_pool_printf(configurator->config_pool, "%s or (%s)", result, term);
+		}
+	}
+	return result;
+}
+
+/*
+ * Compile the filter and put it into the kernel for all captures of the interface. NULL
+ * expression captures everything.
+ *
+ * The filter also returns how much of the packet to keep, which is how the rings
+ * get their snaplen. Libpcap ignores that and uses its own snaplen.
+ */
+static void filter_install(struct pcap_interface *interface, const char *expression, size_t snaplen) {
+	if (!expression)
+		expression = ""; // Empty filter accepts everything
+	ulog(LLOG_DEBUG, "Setting filter '%s' with snaplen %zu on %s\n", expression, snaplen, interface->name);
+	pcap_t *dead = pcap_open_dead(interface->datalink, snaplen ? snaplen : RING_BLOCK_SIZE);
+	if (!dead) {
+		ulog(LLOG_ERROR, "Can't create pcap handle to compile filter for %s\n", interface->name);
+		return;
+	}
+	struct bpf_program program;
+	if (pcap_compile(dead, &program, expression, 1, PCAP_NETMASK_UNKNOWN) == -1) {
+		ulog(LLOG_ERROR, "Can't compile filter '%s' for %s (%s), capturing everything\n", expression, interface->name, pcap_geterr(dead));
+		pcap_close(dead);
+		return;
+	}
+	for (size_t i = 0; i < interface->sub_count; i ++) {
+		struct pcap_sub_interface *sub = &interface->subs[i];
+		if (sub->pcap) {
+			if (pcap_setfilter(sub->pcap, &program) == -1)
+				ulog(LLOG_WARN, "Can't set filter on %s (%s)\n", interface->name, pcap_geterr(sub->pcap));
+		} else {
+			// The kernel uses the same instruction format as BPF
+			struct sock_fprog fprog = {
+				.len = program.bf_len,
+				.filter = (struct sock_filter *) program.bf_insns
+			};
+			if (setsockopt(sub->fd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof fprog) == -1)
+				ulog(LLOG_WARN, "Can't set filter on ring of %s (%s)\n", interface->name, strerror(errno));
+		}
+	}
+	pcap_freecode(&program);
+	pcap_close(dead);
+}
+
+// Does the interest cover the slot? Anything the slot may get must be covered.
+static bool interest_covers(const struct packet_interest *interest, const struct dispatch_slot *slot) {
+	if (slot->layer == '\0' || interest->layer != slot->layer)
+		return false;
+	return interest->app_protocol == '\0' || (!slot->any_app && interest->app_protocol == slot->app_protocol);
+}
+
+static void dispatch_slot_fill(struct loop *loop, struct dispatch_slot *slot, size_t plugin_count) {
+	slot->plugins = mem_pool_alloc(loop->config_pool, plugin_count * sizeof *slot->plugins);
+	slot->plugin_count = 0;
+	LFOR(plugin, plugin, &loop->plugins) {
+		if (plugin_batched(plugin))
+			continue; // These get everything, in the batches
+		bool wanted = plugin->api_version < 3 || !plugin->plugin.interests;
+		if (!wanted)
+			for (const struct packet_interest *const *interest = plugin->plugin.interests; *interest; interest ++)
+				if (interest_covers(*interest, slot)) {
+					wanted = true;
+					break;
+				}
+		if (wanted)
+			slot->plugins[slot->plugin_count ++] = plugin;
+	}
+}
+
+static bool dispatch_has(const struct dispatch_slot *slots, size_t count, char layer, char app_protocol, bool any_app) {
+	for (size_t i = 0; i < count; i ++)
+		if (slots[i].layer == layer && slots[i].any_app == any_app && (any_app || slots[i].app_protocol == app_protocol))
+			return true;
+	return false;
+}
+
+/*
+ * Build the table saying which plugin gets which packet, so we don't have to call
+ * every plugin with every packet. There's a slot for each (layer, app_protocol)
+ * some plugin declared an interest in, then a slot for each such layer with any
+ * app_protocol and a last one for everything else.
+ */
+static void dispatch_build(struct loop *loop) {
+	size_t max = 1, plugin_count = 0;
+	LFOR(plugin, plugin, &loop->plugins) {
+		plugin_count ++;
+		if (plugin->api_version >= 3 && plugin->plugin.interests)
+			for (const struct packet_interest *const *interest = plugin->plugin.interests; *interest; interest ++)
+				max += 2;
+	}
+	struct dispatch_slot *slots = mem_pool_alloc(loop->config_pool, max * sizeof *slots);
+	size_t count = 0;
+	for (size_t pass = 0; pass < 2; pass ++) {
+		bool any_app = pass == 1;
+		LFOR(plugin, plugin, &loop->plugins)
+			if (plugin->api_version >= 3 && plugin->plugin.interests)
+				for (const struct packet_interest *const *interest = plugin->plugin.interests; *interest; interest ++) {
+					if (!any_app && (*interest)->app_protocol == '\0')
+						continue; // Goes only to the any slot
+					if (!dispatch_has(slots, count, (*interest)->layer, (*interest)->app_protocol, any_app))
+						slots[count ++] = (struct dispatch_slot) {
+							.layer = (*interest)->layer,
+							.app_protocol = any_app ? '\0' : (*interest)->app_protocol,
+							.any_app = any_app
+						};
+				}
+	}
+	slots[count ++] = (struct dispatch_slot) {
+		.any_app = true
+	};
+	assert(count <= max);
+	for (size_t i = 0; i < count; i ++) {
+		dispatch_slot_fill(loop, &slots[i], plugin_count);
+		ulog(LLOG_DEBUG, "Dispatch slot %zu (%c/%c) has %zu plugins\n", i, slots[i].layer ? slots[i].layer : '*', slots[i].any_app ? '*' : slots[i].app_protocol, slots[i].plugin_count);
+	}
+	loop->dispatch = slots;
+	loop->dispatch_count = count;
+}
+
+/*
+ * Libpcap can't change the snaplen of an active handle. So open new handles and
+ * replace the old ones. If it fails, keep the old ones, it is not fatal.
+ *
+ * It makes the interface look new to the commit (mark), so it gets registered.
+ */
+static void pcap_snaplen_update(struct loop *loop, struct pcap_interface *interface, size_t snaplen) {
+	assert(interface->capture == CAPTURE_PCAP && interface->sub_count == 2);
+	ulog(LLOG_INFO, "Reopening %s to change snaplen from %zu to %zu\n", interface->name, interface->snaplen, snaplen);
+	struct pcap_sub_interface subs[2];
+	int datalink;
+	if (!pcap_create_sub(&subs[PCAP_DIR_IN], &datalink, PCAP_D_IN, interface->name, "in", interface->promiscuous, snaplen)) {
+		ulog(LLOG_WARN, "Keeping the old snaplen on %s\n", interface->name);
+		return;
+	}
+	if (!pcap_create_sub(&subs[PCAP_DIR_OUT], &datalink, PCAP_D_OUT, interface->name, "out", interface->promiscuous, snaplen)) {
+		sub_close(&subs[PCAP_DIR_IN]);
+		ulog(LLOG_WARN, "Keeping the old snaplen on %s\n", interface->name);
+		return;
+	}
+	if (!interface->mark) {
+		// Already running, get rid of the registrations
+		loop_timeout_cancel(loop, interface->watchdog_timer);
+		interface->watchdog_initialized = false;
+	}
+	for (size_t i = 0; i < 2; i ++) {
+		if (interface->registered)
+			loop_unregister_fd(loop, interface->subs[i].fd);
+		sub_close(&interface->subs[i]);
+		subs[i].interface = interface;
+		interface->subs[i] = subs[i];
+	}
+	interface->registered = false;
+	interface->mark = true;
+	interface->snaplen = snaplen;
+	interface->datalink = datalink;
+	// New handles start their statistics from zero
+	interface->captured = interface->dropped = interface->if_dropped = 0;
+}
+
 static const char *libname(const struct plugin_holder *plugin) {
 	const char *libname = rindex(plugin->libname, '/');
 	if (libname)
@@ -1535,6 +2598,66 @@ static void send_plugin_versions(struct loop *loop) {
 	uplink_send_message(loop->uplink, 'V', message, message_size);
 }
 
+void loop_cpu_stats_write(struct loop *loop, FILE *file) {
+	LFOR(plugin, plugin, &loop->plugins)
+		for (size_t kind = 0; kind < CALLBACK_KIND_COUNT; kind ++) {
+			const struct callback_stats *stats = &plugin->cpu[kind];
+			if (!stats->calls)
+				continue;
+			fprintf(file, "%s\t%s\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t", plugin->plugin.name, callback_kind_names[kind], stats->calls, stats->total, stats->max);
+			// Skip the empty buckets at the end, there are usually many
+			size_t used = CPU_HISTOGRAM_BUCKETS;
+			while (used && !stats->histogram[used - 1])
+				used --;
+			for (size_t i = 0; i < used; i ++)
+				fprintf(file, "%s%" PRIu32, i ? "," : "", stats->histogram[i]);
+			fputc('\n', file);
+		}
+}
+
+void loop_memory_stats_write(struct loop *loop, FILE *file) {
+	LFOR(plugin, plugin, &loop->plugins)
+		fprintf(file, "%s\tmemory\t%zu\t%zu\t%zu\n", plugin->plugin.name, plugin->memory_used, plugin->memory_peak, plugin->memory_budget);
+}
+
+static void render_uint64(uint64_t value, uint8_t **pos, size_t *rest) {
+	assert(*rest >= sizeof value);
+	value = htobe64(value);
+	memcpy(*pos, &value, sizeof value);
+	*pos += sizeof value;
+	*rest -= sizeof value;
+}
+
+void loop_cpu_stats_send(struct loop *loop) {
+	if (loop->uplink && uplink_connected(loop->uplink)) {
+		ulog(LLOG_DEBUG, "Sending CPU stats of plugins\n");
+		size_t message_size = 2 * sizeof(uint32_t);
+		LFOR(plugin, plugin, &loop->plugins)
+			message_size += sizeof(uint32_t) + strlen(plugin->plugin.name) + CALLBACK_KIND_COUNT * (3 * sizeof(uint64_t) + CPU_HISTOGRAM_BUCKETS * sizeof(uint32_t));
+		uint8_t *message = mem_pool_alloc(loop->temp_pool, message_size);
+		uint8_t *pos = message;
+		size_t rest = message_size;
+		uplink_render(&pos, &rest, "uu", (uint32_t)(loop->now - loop->cpu_stats_since), (uint32_t)CPU_HISTOGRAM_BUCKETS);
+		LFOR(plugin, plugin, &loop->plugins) {
+			uplink_render_string(plugin->plugin.name, strlen(plugin->plugin.name), &pos, &rest);
+			for (size_t kind = 0; kind < CALLBACK_KIND_COUNT; kind ++) {
+				const struct callback_stats *stats = &plugin->cpu[kind];
+				render_uint64(stats->calls, &pos, &rest);
+				render_uint64(stats->total, &pos, &rest);
+				render_uint64(stats->max, &pos, &rest);
+				for (size_t i = 0; i < CPU_HISTOGRAM_BUCKETS; i ++)
+					uplink_render_uint32(stats->histogram[i], &pos, &rest);
+			}
+		}
+		assert(rest == 0);
+		uplink_send_message(loop->uplink, 'T', message, message_size);
+	}
+	// Start a new period even if the server didn't get the old one, so the status file shows fresh data
+	LFOR(plugin, plugin, &loop->plugins)
+		memset(plugin->cpu, 0, sizeof plugin->cpu);
+	loop->cpu_stats_since = loop->now;
+}
+
 void loop_config_commit(struct loop_configurator *configurator) {
 	struct loop *loop = configurator->loop;
 	/*
@@ -1554,8 +2677,8 @@ void loop_config_commit(struct loop_configurator *configurator) {
 	LFOR(plugin, plugin, &configurator->plugins)
 		if (!plugin->mark) {
 			for (size_t i = 0; i < loop->timeout_count; i ++)
-				if (loop->timeouts[i].context == &plugin->original->context)
-					loop->timeouts[i].context = &plugin->context;
+				if (loop->timeouts[loop->timeout_heap[i]].context == &plugin->original->context)
+					loop->timeouts[loop->timeout_heap[i]].context = &plugin->context;
 			// Update pointers inside its FDs. The FDs are allocated from the plugin's pool, so they survive, but the kept context/plugin holder there would be outdated.
 			LFOR(plugin_fds, fd_holder, plugin)
 				fd_holder->plugin = plugin;
@@ -1583,7 +2706,13 @@ void loop_config_commit(struct loop_configurator *configurator) {
 					die("Failed to resolve functions for plugin %s despite checking first\n", plugin->plugin.name);
 			}
 		}
+	size_t snaplen = snaplen_compute(configurator);
+	LFOR(pcap, interface, &configurator->pcap_interfaces)
+		if (interface->capture == CAPTURE_PCAP && interface->snaplen != snaplen)
+			pcap_snaplen_update(loop, interface, snaplen);
 	LFOR(pcap, interface, &configurator->pcap_interfaces) {
+		if (interface->capture == CAPTURE_FILE)
+			continue; // Not in the epoll, the loop reads it
 		epoll_register_pcap(loop, interface, interface->mark ? EPOLL_CTL_ADD : EPOLL_CTL_MOD);
 		interface->registered = true;
 		if (!interface->mark)
@@ -1591,6 +2720,12 @@ void loop_config_commit(struct loop_configurator *configurator) {
 		interface->watchdog_timer = loop_timeout_add(loop, PCAP_WATCHDOG_TIME, NULL, interface, pcap_watchdog);
 		interface->watchdog_initialized = true;
 	}
+	// Let the kernel drop what no plugin wants. Change the filter only when needed.
+	const char *filter = filter_build(configurator);
+	bool filter_changed = (filter == NULL) != (loop->filter == NULL) || (filter && strcmp(filter, loop->filter) != 0) || snaplen != loop->snaplen;
+	LFOR(pcap, interface, &configurator->pcap_interfaces)
+		if (filter_changed || (interface->mark && (filter || snaplen)))
+			filter_install(interface, filter, snaplen);
 	// Change the uplink config or copy it
 	if (loop->uplink) {
 		if (configurator->remote_name)
@@ -1602,12 +2737,26 @@ void loop_config_commit(struct loop_configurator *configurator) {
 	if (loop->config_pool)
 		mem_pool_destroy(configurator->loop->config_pool);
 	loop->config_pool = configurator->config_pool;
+	loop->filter = filter;
+	loop->snaplen = snaplen;
 	loop->pcap_interfaces = configurator->pcap_interfaces;
+	loop->replay = NULL;
+	LFOR(pcap, interface, &loop->pcap_interfaces)
+		if (interface->capture == CAPTURE_FILE)
+			loop->replay = interface;
 	loop->plugins = configurator->plugins;
+	loop->batch_plugins = false;
+	LFOR(plugin, plugin, &loop->plugins)
+		if (plugin_batched(plugin))
+			loop->batch_plugins = true;
+	dispatch_build(loop);
 	// Initialize/commit configuration of the plugins
 	LFOR(plugin, plugin, &loop->plugins) {
 		plugin->config_trie = plugin->config_candidate;
 		plugin->config_candidate = NULL;
+		bool budget_ok = memory_budget_parse(plugin, &plugin->memory_budget);
+		assert(budget_ok); // Checked before
+		(void)budget_ok;
 		plugin_config_finish(plugin, true);
 	}
 	// Clean up unused pluglibs
@@ -1646,6 +2795,10 @@ uint64_t loop_now(struct loop *loop) {
 	return loop->now;
 }
 
+uint64_t loop_packet_time(struct loop *loop) {
+	return loop->packet_time;
+}
+
 static void plugin_fd_event(struct plugin_fd *fd, uint32_t events) {
 	(void) events;
 	ulog(LLOG_DEBUG, "Event on fd %d of plugin %s\n", fd->fd, fd->plugin->plugin.name);
@@ -1699,12 +2852,13 @@ pid_t loop_fork(struct loop *loop) {
 			}
 		}
 		LFOR(pcap, interface, &loop->pcap_interfaces) {
-			for (size_t i = 0; i < 2; i ++)
-				pcap_close(interface->directions[i].pcap);
+			for (size_t i = 0; i < interface->sub_count; i ++)
+				sub_close(&interface->subs[i]);
 		}
 		if (loop->uplink)
 			uplink_close(loop->uplink);
 		close(loop->epoll_fd);
+		close(loop->timer_fd);
 	}
 	return result;
 }
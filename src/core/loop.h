@@ -24,6 +24,7 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <unistd.h>
+#include <stdio.h>
 
 struct loop;
 struct loop_configurator;
@@ -63,7 +64,8 @@ size_t *loop_pcap_stats(struct context *context) __attribute__((nonnull)) __attr
  * When you want to configure the loop, you start by loop_config_start. You get
  * a handle to the configurator. You can then call loop_add_pcap and
  * loop_add_plugin functions with it. After you are done, you call loop_config_commit,
- * which will make the changes available.
+ * which will make the changes available. Add the plugins before the interfaces,
+ * the pcap handles are opened with the snaplen the plugins need.
  *
  * You can call loop_config_abort instead, which will throw out all the changes.
  *
@@ -79,7 +81,41 @@ struct loop_configurator *loop_config_start(struct loop *loop) __attribute__((no
 void loop_config_commit(struct loop_configurator *configurator) __attribute__((nonnull));
 void loop_config_abort(struct loop_configurator *configurator) __attribute__((nonnull));
 
-bool loop_add_pcap(struct loop_configurator *configurator, const char *interface, bool promiscuous) __attribute__((nonnull));
+/*
+ * How to capture packets on an interface.
+ *
+ * The CAPTURE_PCAP goes through libpcap. The CAPTURE_RING reads whole blocks of
+ * packets directly from a TPACKET_V3 ring shared with the kernel, without
+ * a copy or syscall per packet. It works only for ethernet-like and raw IP
+ * interfaces. The CAPTURE_FILE is a replay of a saved capture (see
+ * loop_add_pcap_file).
+ */
+enum capture_mode {
+	CAPTURE_PCAP,
+	CAPTURE_RING,
+	CAPTURE_FILE
+};
+
+bool loop_add_pcap(struct loop_configurator *configurator, const char *interface, bool promiscuous, enum capture_mode capture) __attribute__((nonnull));
+/*
+ * How fast to replay a file. The REPLAY_ORIGINAL keeps the gaps between the packets
+ * as they were captured, REPLAY_SCALED divides them by the speed and REPLAY_FAST
+ * doesn't wait at all.
+ */
+enum replay_pacing {
+	REPLAY_ORIGINAL,
+	REPLAY_SCALED,
+	REPLAY_FAST
+};
+/*
+ * Feed the packets from a pcap (or pcapng) file to the plugins, as if they were
+ * captured on an interface named by the file. The loop_now follows the timestamps
+ * of the packets during the replay, so the timeouts fire at the same places of
+ * the traffic each time. The loop terminates at the end of the file.
+ *
+ * Only one file may be replayed at a time. The speed is used with REPLAY_SCALED only.
+ */
+bool loop_add_pcap_file(struct loop_configurator *configurator, const char *file, enum replay_pacing pacing, double speed) __attribute__((nonnull));
 // Add a plugin. Provide the name of the library to load.
 bool loop_add_plugin(struct loop_configurator *configurator, const char *plugin) __attribute__((nonnull));
 // Set the remote endpoint of the uplink
@@ -140,6 +176,10 @@ void loop_unregister_fd(struct loop *loop, int fd) __attribute__((nonnull));
  * of plugin context (eg. from the framework).
  */
 struct mem_pool *loop_pool_create(struct loop *loop, struct context *current_context, const char *name) __attribute__((nonnull(1, 3))) __attribute__((malloc)) __attribute__((returns_nonnull));
+// The same, but for large tables, backed by huge pages once it grows (see mem_pool_create_huge).
+struct mem_pool *loop_pool_create_huge(struct loop *loop, struct context *current_context, const char *name) __attribute__((nonnull(1, 3))) __attribute__((malloc)) __attribute__((returns_nonnull));
+// The same for a slab (see mem_pool.h). Don't destroy it yourself.
+struct slab *loop_slab_create(struct loop *loop, struct context *current_context, const char *name) __attribute__((nonnull(1, 3))) __attribute__((malloc)) __attribute__((returns_nonnull));
 // Get a pool that lives for the whole life of the loop
 struct mem_pool *loop_permanent_pool(struct loop *loop) __attribute__((nonnull)) __attribute__((pure)) __attribute__((returns_nonnull));
 // Get a temporary pool that may be freed any time the control returns to main loop
@@ -169,15 +209,35 @@ void loop_plugin_unregister_fd(struct context *context, int fd) __attribute__((n
  * It returns an id that is then passed to the callback. It can also be used to cancel the timeout
  * before it happens.
  *
- * The timeouts are not expected to happen often, so this function is not very optimised.
+ * Adding and canceling a timeout is logarithmic in the number of active ones, so
+ * there may be many of them (eg. one per connection).
  */
 size_t loop_timeout_add(struct loop *loop, uint32_t after, struct context *context, void *data, void (*callback)(struct context *context, void *data, size_t id)) __attribute__((nonnull(1)));
-// Cancel a timeout. It must not have been called yet.
+// Cancel a timeout. Cancelling one that was already called or cancelled does nothing.
 void loop_timeout_cancel(struct loop *loop, size_t id) __attribute__((nonnull));
-// Return number of milliseconds since some unspecified time in the past
+// Return number of milliseconds since some unspecified time in the past (follows the packets when replaying a file)
 uint64_t loop_now(struct loop *loop) __attribute__((pure));
+/*
+ * Timestamp of the newest packet captured so far, in microseconds since epoch
+ * (like packet_info.timestamp), 0 before the first one. For plugins that want to
+ * run on the capture time instead of the time of the router.
+ */
+uint64_t loop_packet_time(struct loop *loop) __attribute__((pure));
 
 // Activate or deactivate plugins. If needed, send update of plugin versions and/or errors.
 void loop_plugin_activation(struct loop *loop, struct plugin_activation *plugins, size_t count) __attribute__((nonnull));
 
+/*
+ * The time spent in the callbacks of each plugin is measured. These write it
+ * as text lines to a file (one line per plugin and kind of callback with any
+ * calls) and send it to the server. Sending starts a new measurement period.
+ */
+void loop_cpu_stats_write(struct loop *loop, FILE *file) __attribute__((nonnull));
+void loop_cpu_stats_send(struct loop *loop) __attribute__((nonnull));
+/*
+ * Write the memory used by each plugin (as seen by the last check of the budgets),
+ * the most it has used and its budget (0 for none).
+ */
+void loop_memory_stats_write(struct loop *loop, FILE *file) __attribute__((nonnull));
+
 #endif
@@ -29,9 +29,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdbool.h>
 
 static void store(struct mem_pool *pool);
 static void drop(struct mem_pool *pool);
+static void slab_store(struct slab *slab);
+static void slab_drop(struct slab *slab);
 
 #ifdef MEM_POOL_DEBUG
 
@@ -58,6 +61,10 @@ struct mem_pool {
 #define LIST_WANT_INSERT_AFTER
 #include "link_list.h"
 
+struct mem_pool *mem_pool_create_huge(const char *name) {
+	return mem_pool_create(name); // Each allocation is separate here, no huge pages
+}
+
 struct mem_pool *mem_pool_create(const char *name) {
 	struct mem_pool *pool = malloc(sizeof *pool + strlen(name) + 1);
 	*pool = (struct mem_pool) {
@@ -97,6 +104,33 @@ void mem_pool_reset(struct mem_pool *pool) {
 	pool->requests = 0;
 }
 
+struct mem_pool_mark mem_pool_mark(const struct mem_pool *pool) {
+	// The chunks are prepended, so the head is the newest one
+	return (struct mem_pool_mark) {
+		.page = pool->head,
+		.used = pool->used,
+		.allocated = pool->allocated,
+		.requests = pool->requests
+	};
+}
+
+void mem_pool_rewind(struct mem_pool *pool, const struct mem_pool_mark *mark) {
+	while (pool->head != mark->page) {
+		struct pool_chunk *current = pool->head;
+		assert(current); // The mark must be from this pool
+		pool->head = current->next;
+		assert(current->canary == POOL_CANARY_BEGIN);
+		assert(*(uint32_t *) (current->data + current->length) == POOL_CANARY_END);
+		ulog(LLOG_DEBUG_VERBOSE, "Freeing %p of size %zu from %s\n", (void *) current, current->length, pool->name);
+		free(current);
+	}
+	if (!pool->head)
+		pool->tail = NULL;
+	pool->used = mark->used;
+	pool->allocated = mark->allocated;
+	pool->requests = mark->requests;
+}
+
 void mem_pool_destroy(struct mem_pool *pool) {
 	mem_pool_reset(pool);
 	ulog(LLOG_DEBUG, "Destroyed pool %s\n", pool->name);
@@ -104,6 +138,75 @@ void mem_pool_destroy(struct mem_pool *pool) {
 	free(pool);
 }
 
+struct slab_chunk {
+	struct slab_chunk *next, *prev;
+	size_t length;
+	uint32_t canary;
+	uint8_t data[];
+};
+
+struct slab {
+	struct slab_chunk *head, *tail;
+	size_t slab_index;
+	size_t used, allocated, requests;
+	char name[];
+};
+
+#define LIST_NODE struct slab_chunk
+#define LIST_BASE struct slab
+#define LIST_NAME(X) slab_chunk_##X
+#define LIST_PREV prev
+#define LIST_WANT_INSERT_AFTER
+#define LIST_WANT_REMOVE
+#include "link_list.h"
+
+struct slab *slab_create(const char *name) {
+	struct slab *slab = malloc(sizeof *slab + strlen(name) + 1);
+	*slab = (struct slab) {
+		.head = NULL
+	};
+	slab_store(slab);
+	strcpy(slab->name, name);
+	ulog(LLOG_DEBUG, "Created slab %s\n", name);
+	return slab;
+}
+
+void *slab_alloc(struct slab *slab, size_t size) {
+	struct slab_chunk *chunk = malloc(sizeof *chunk + size + sizeof(uint32_t));
+	chunk->canary = POOL_CANARY_BEGIN;
+	*(uint32_t *) (chunk->data + size) = POOL_CANARY_END;
+	chunk->length = size;
+	slab_chunk_insert_after(slab, chunk, NULL);
+	ulog(LLOG_DEBUG_VERBOSE, "Allocated %zu bytes from slab %s at address %p\n", size, slab->name, (void *) chunk);
+	slab->used += size;
+	slab->allocated += sizeof *chunk + size + sizeof(uint32_t);
+	slab->requests ++;
+	return chunk->data;
+}
+
+void slab_free(struct slab *slab, void *object) {
+	struct slab_chunk *chunk = (struct slab_chunk *) ((uint8_t *) object - offsetof(struct slab_chunk, data));
+	assert(chunk->canary == POOL_CANARY_BEGIN);
+	assert(*(uint32_t *) (chunk->data + chunk->length) == POOL_CANARY_END);
+	ulog(LLOG_DEBUG_VERBOSE, "Freeing %p of size %zu from slab %s\n", (void *) chunk, chunk->length, slab->name);
+	slab_chunk_remove(slab, chunk);
+	slab->used -= chunk->length;
+	slab->allocated -= sizeof *chunk + chunk->length + sizeof(uint32_t);
+	slab->requests --;
+	free(chunk);
+}
+
+void slab_destroy(struct slab *slab) {
+	while (slab->head) {
+		struct slab_chunk *current = slab->head;
+		slab->head = current->next;
+		free(current);
+	}
+	ulog(LLOG_DEBUG, "Destroyed slab %s\n", slab->name);
+	slab_drop(slab);
+	free(slab);
+}
+
 #else
 
 struct pool_page {
@@ -131,6 +234,8 @@ struct mem_pool {
 	size_t available;
 	size_t pool_index;
 	size_t used, allocated, requests;
+	// Get the memory in huge pages once the pool grows large
+	bool huge;
 	// The name of this memory pool (for debug and errors).
 	char name[];
 };
@@ -161,6 +266,54 @@ static struct pool_page *page_get(size_t size, const char *name) {
 	return result;
 }
 
+static bool hugetlb_failed __attribute__((unused));
+
+/*
+ * Get a page of given size (multiple of HUGE_PAGE_SIZE) backed by huge pages,
+ * if the system has them. Try the explicit (reserved) ones first, then ask for
+ * transparent ones on a suitably aligned mapping. If neither works, it is still
+ * just a large normal page.
+ */
+static struct pool_page *page_get_huge(size_t size, const char *name) {
+	struct pool_page *result;
+#if defined(MAP_HUGETLB) && defined(MAP_HUGE_SHIFT)
+	if (!hugetlb_failed) {
+		// Ask for our size of huge pages explicitly, the default might be larger and then munmap wouldn't work with our size
+		result = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (__builtin_ctz(HUGE_PAGE_SIZE) << MAP_HUGE_SHIFT), -1, 0);
+		if (result != MAP_FAILED) {
+			result->size = size;
+			result->next = NULL;
+			ulog(LLOG_DEBUG, "Got huge page %zu large for pool '%s' (%p)\n", size, name, (void *) result);
+			return result;
+		}
+		// Don't try again and again, there are usually no huge pages reserved
+		ulog(LLOG_DEBUG, "No explicit huge pages (%s)\n", strerror(errno));
+		hugetlb_failed = true;
+	}
+#endif
+#ifdef MADV_HUGEPAGE
+	// Map a bit more, so we can cut out an aligned piece
+	unsigned char *mapped = mmap(NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mapped == MAP_FAILED)
+		die("Couldn't get page of %zu bytes for pool '%s' (%s)\n", size, name, strerror(errno));
+	unsigned char *aligned = (unsigned char *) (((uintptr_t) mapped + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE);
+	if (aligned != mapped && munmap(mapped, aligned - mapped) != 0)
+		die("Couldn't trim page for pool '%s' (%s)\n", name, strerror(errno));
+	size_t tail = mapped + size + HUGE_PAGE_SIZE - (aligned + size);
+	if (tail && munmap(aligned + size, tail) != 0)
+		die("Couldn't trim page for pool '%s' (%s)\n", name, strerror(errno));
+	if (madvise(aligned, size, MADV_HUGEPAGE) != 0)
+		ulog(LLOG_DEBUG, "No transparent huge pages for pool '%s' (%s)\n", name, strerror(errno));
+	result = (struct pool_page *) aligned;
+	result->size = size;
+	result->next = NULL;
+	ulog(LLOG_DEBUG, "Got transparent huge page %zu large for pool '%s' (%p)\n", size, name, (void *) result);
+	return result;
+#else
+	return page_get(size, name);
+#endif
+}
+
 // Release a given page (previously allocated by page_get).
 static void page_return(struct pool_page *page, const char *name) {
 	ulog(LLOG_DEBUG, "Releasing page %zu large from pool '%s' (%p)%s\n", page->size, name, (void *) page, (page->size == PAGE_SIZE && page_cache_size < PAGE_CACHE_SIZE) ? " (cached)" : "");
@@ -206,6 +359,12 @@ static void page_walk_and_delete(struct pool_page *page, const char *name) {
 	}
 }
 
+struct mem_pool *mem_pool_create_huge(const char *name) {
+	struct mem_pool *pool = mem_pool_create(name);
+	pool->huge = true;
+	return pool;
+}
+
 struct mem_pool *mem_pool_create(const char *name) {
 	ulog(LLOG_DEBUG, "Creating memory pool '%s'\n", name);
 	size_t name_len = 1 + strlen(name);
@@ -252,13 +411,16 @@ void *mem_pool_alloc(struct mem_pool *pool, size_t size) {
 		 * the request can be larger than a single page.
 		 */
 		size_t page_size = (size + sizeof(struct pool_page) + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+		bool huge = pool->huge && pool->allocated >= HUGE_PAGE_SIZE;
+		if (huge)
+			page_size = (page_size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
 		/*
 		 * Get the page and put it into the pool. Keep the first page first,
 		 * it is special as it contains the pool itself, so we want to have
 		 * it at hand. Otherwise, the order does not matter, it is only
 		 * for clean up.
 		 */
-		struct pool_page *page = page_get(page_size, pool->name);
+		struct pool_page *page = huge ? page_get_huge(page_size, pool->name) : page_get(page_size, pool->name);
 		page->next = pool->first->next;
 		pool->first->next = page;
 		// Allocate.
@@ -300,6 +462,221 @@ void mem_pool_reset(struct mem_pool *pool) {
 #endif
 }
 
+struct mem_pool_mark mem_pool_mark(const struct mem_pool *pool) {
+	/*
+	 * The new pages are inserted right after the first one, so the ones
+	 * between the first and this one come after the mark.
+	 */
+	return (struct mem_pool_mark) {
+		.page = pool->first->next,
+		.pos = pool->pos,
+		.available = pool->available,
+		.used = pool->used,
+		.allocated = pool->allocated,
+		.requests = pool->requests
+	};
+}
+
+void mem_pool_rewind(struct mem_pool *pool, const struct mem_pool_mark *mark) {
+	// Release the pages got since the mark (a single one goes to the cache, to be reused hot)
+	while (pool->first->next != mark->page) {
+		struct pool_page *page = pool->first->next;
+		assert(page); // The mark must be from this pool
+		pool->first->next = page->next;
+		page_return(page, pool->name);
+	}
+	pool->pos = mark->pos;
+	pool->available = mark->available;
+	pool->used = mark->used;
+	pool->allocated = mark->allocated;
+	pool->requests = mark->requests;
+#ifdef DEBUG
+	memset(pool->pos, '*', pool->available);
+#endif
+}
+
+/*
+ * The slab. Objects of each size class live in their own pages, with the
+ * page header at the beginning of the page. So we can find the page of an
+ * object by rounding its address down. Large objects get pages of their own
+ * (with the same header).
+ */
+
+// The size classes, multiples of 16 to keep alignment
+static const size_t slab_sizes[] = { 16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024 };
+#define SLAB_CLASS_COUNT (sizeof slab_sizes / sizeof *slab_sizes)
+#define SLAB_LARGE SLAB_CLASS_COUNT
+
+struct slab_page {
+	struct slab_page *next, *prev;
+	size_t class; // Index to slab_sizes or SLAB_LARGE
+	size_t size; // Size of the whole page (more than PAGE_SIZE for the large ones)
+	size_t used; // Objects in use
+	void *free; // List of freed objects, linked through their first bytes
+	unsigned char *fresh; // The objects from here to the end of page were never used
+};
+
+#define SLAB_HEADER ((sizeof(struct slab_page) + 15) / 16 * 16)
+
+struct slab_list {
+	struct slab_page *head, *tail;
+};
+
+#define LIST_NODE struct slab_page
+#define LIST_BASE struct slab_list
+#define LIST_NAME(X) slab_list_##X
+#define LIST_PREV prev
+#define LIST_WANT_INSERT_AFTER
+#define LIST_WANT_REMOVE
+#include "link_list.h"
+
+struct slab_class {
+	// Pages with some free objects and the ones without any
+	struct slab_list partial, full;
+	// One empty page kept, so we don't map and unmap when an object comes and goes
+	struct slab_page *spare;
+};
+
+struct slab {
+	struct slab_class classes[SLAB_CLASS_COUNT];
+	struct slab_list large;
+	size_t slab_index;
+	size_t used, allocated, requests;
+	char name[];
+};
+
+static struct slab_page *slab_page_get(struct slab *slab, size_t size) {
+	struct slab_page *page = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (page == MAP_FAILED)
+		die("Couldn't get page of %zu bytes for slab '%s' (%s)\n", size, slab->name, strerror(errno));
+	ulog(LLOG_DEBUG, "Got page %zu large for slab '%s' (%p)\n", size, slab->name, (void *) page);
+	page->size = size;
+	slab->allocated += size;
+	return page;
+}
+
+static void slab_page_return(struct slab *slab, struct slab_page *page) {
+	ulog(LLOG_DEBUG, "Releasing page %zu large from slab '%s' (%p)\n", page->size, slab->name, (void *) page);
+	slab->allocated -= page->size;
+	if (munmap(page, page->size) != 0)
+		die("Couldn't return page %p of %zu bytes from slab '%s' (%s)\n", (void *) page, page->size, slab->name, strerror(errno));
+}
+
+static bool slab_page_full(const struct slab_page *page) {
+	return !page->free && page->fresh + slab_sizes[page->class] > (unsigned char *) page + page->size;
+}
+
+struct slab *slab_create(const char *name) {
+	ulog(LLOG_DEBUG, "Creating slab '%s'\n", name);
+	struct slab *slab = malloc(sizeof *slab + strlen(name) + 1);
+	if (!slab)
+		die("Couldn't allocate slab '%s'\n", name);
+	*slab = (struct slab) {
+		.large = { .head = NULL }
+	};
+	slab_store(slab);
+	strcpy(slab->name, name);
+	return slab;
+}
+
+void *slab_alloc(struct slab *slab, size_t size) {
+	size_t class = 0;
+	while (class < SLAB_CLASS_COUNT && slab_sizes[class] < size)
+		class ++;
+	slab->requests ++;
+	if (class == SLAB_LARGE) {
+		size_t page_size = (size + SLAB_HEADER + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+		struct slab_page *page = slab_page_get(slab, page_size);
+		page->class = SLAB_LARGE;
+		page->used = 1;
+		slab_list_insert_after(&slab->large, page, slab->large.tail);
+		slab->used += page_size - SLAB_HEADER;
+		return (unsigned char *) page + SLAB_HEADER;
+	}
+	struct slab_class *c = &slab->classes[class];
+	struct slab_page *page = c->partial.head;
+	if (!page) {
+		if (c->spare) {
+			page = c->spare;
+			c->spare = NULL;
+		} else
+			page = slab_page_get(slab, PAGE_SIZE);
+		page->class = class;
+		page->used = 0;
+		page->free = NULL;
+		page->fresh = (unsigned char *) page + SLAB_HEADER;
+		slab_list_insert_after(&c->partial, page, c->partial.tail);
+	}
+	void *result;
+	if (page->free) {
+		result = page->free;
+		page->free = *(void **) result;
+	} else {
+		result = page->fresh;
+		page->fresh += slab_sizes[class];
+	}
+	page->used ++;
+	if (slab_page_full(page)) {
+		slab_list_remove(&c->partial, page);
+		slab_list_insert_after(&c->full, page, c->full.tail);
+	}
+	slab->used += slab_sizes[class];
+	return result;
+}
+
+void slab_free(struct slab *slab, void *object) {
+	struct slab_page *page = (struct slab_page *) ((uintptr_t) object / PAGE_SIZE * PAGE_SIZE);
+	assert(page->used);
+	slab->requests --;
+	if (page->class == SLAB_LARGE) {
+		assert((unsigned char *) object == (unsigned char *) page + SLAB_HEADER);
+		slab_list_remove(&slab->large, page);
+		slab->used -= page->size - SLAB_HEADER;
+		slab_page_return(slab, page);
+		return;
+	}
+	assert(page->class < SLAB_CLASS_COUNT);
+	assert(((unsigned char *) object - (unsigned char *) page - SLAB_HEADER) % slab_sizes[page->class] == 0);
+	struct slab_class *c = &slab->classes[page->class];
+	slab->used -= slab_sizes[page->class];
+	if (slab_page_full(page)) {
+		slab_list_remove(&c->full, page);
+		slab_list_insert_after(&c->partial, page, c->partial.tail);
+	}
+	*(void **) object = page->free;
+	page->free = object;
+	if (-- page->used)
+		return;
+	// The page is empty now, keep it as spare or give it back
+	slab_list_remove(&c->partial, page);
+	if (c->spare)
+		slab_page_return(slab, page);
+	else
+		c->spare = page;
+}
+
+static void slab_list_release(struct slab *slab, struct slab_list *list) {
+	while (list->head) {
+		struct slab_page *page = list->head;
+		list->head = page->next;
+		slab_page_return(slab, page);
+	}
+}
+
+void slab_destroy(struct slab *slab) {
+	ulog(LLOG_DEBUG, "Destroying slab '%s'\n", slab->name);
+	for (size_t i = 0; i < SLAB_CLASS_COUNT; i ++) {
+		struct slab_class *c = &slab->classes[i];
+		slab_list_release(slab, &c->partial);
+		slab_list_release(slab, &c->full);
+		if (c->spare)
+			slab_page_return(slab, c->spare);
+	}
+	slab_list_release(slab, &slab->large);
+	slab_drop(slab);
+	free(slab);
+}
+
 #endif
 
 static struct mem_pool **pools;
@@ -319,6 +696,23 @@ static void drop(struct mem_pool *pool) {
 	pools = realloc(pools, (-- pool_count) * sizeof *pools);
 }
 
+static struct slab **slabs;
+static size_t slab_count;
+
+static void slab_store(struct slab *slab) {
+	slabs = realloc(slabs, (++ slab_count) * sizeof *slabs);
+	slabs[slab_count - 1] = slab;
+	slab->slab_index = slab_count - 1;
+}
+
+static void slab_drop(struct slab *slab) {
+	assert(slab_count > slab->slab_index);
+	assert(slab == slabs[slab->slab_index]);
+	slabs[slab->slab_index] = slabs[slab_count - 1];
+	slabs[slab->slab_index]->slab_index = slab->slab_index;
+	slabs = realloc(slabs, (-- slab_count) * sizeof *slabs);
+}
+
 char *mem_pool_strdup(struct mem_pool *pool, const char *string) {
 	size_t length = strlen(string);
 	char *result = mem_pool_alloc(pool, length + 1);
@@ -350,17 +744,31 @@ char *mem_pool_hex(struct mem_pool *pool, const uint8_t *data, size_t size) {
 	return result;
 }
 
+size_t mem_pool_allocated(const struct mem_pool *pool) {
+	return pool->allocated;
+}
+
+size_t slab_allocated(const struct slab *slab) {
+	return slab->allocated;
+}
+
 char *mem_pool_stats(struct mem_pool *tmp_pool) {
-	char **parts = mem_pool_alloc(tmp_pool, pool_count * sizeof *parts);
+	char **parts = mem_pool_alloc(tmp_pool, (pool_count + slab_count) * sizeof *parts);
 	size_t len = 1;
 	for (size_t i = 0; i < pool_count; i ++) {
 		struct mem_pool *p = pools[i];
 		parts[i] = mem_pool_printf(tmp_pool, "%s: %zu/%zu (%zu)", p->name, p->used, p->allocated, p->requests);
 		len += 2 + strlen(parts[i]);
 	}
+	// The slabs have the number of live objects instead of requests
+	for (size_t i = 0; i < slab_count; i ++) {
+		struct slab *s = slabs[i];
+		parts[pool_count + i] = mem_pool_printf(tmp_pool, "%s: %zu/%zu (%zu objects)", s->name, s->used, s->allocated, s->requests);
+		len += 2 + strlen(parts[pool_count + i]);
+	}
 	char *result = mem_pool_alloc(tmp_pool, len);
 	size_t pos = 0;
-	for (size_t i = 0; i < pool_count; i ++) {
+	for (size_t i = 0; i < pool_count + slab_count; i ++) {
 		if (pos) {
 			memcpy(result + pos, ", ", 2);
 			pos += 2;
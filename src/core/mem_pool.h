@@ -28,6 +28,11 @@ struct mem_pool;
 
 // Create a memory pool. The name is debug and error message aid.
 struct mem_pool *mem_pool_create(const char *name) __attribute__((malloc)) __attribute__((returns_nonnull));
+/*
+ * Create a memory pool for a large table. Once it grows to a few MB, it gets
+ * the memory in huge pages, if the system has them (fewer TLB misses).
+ */
+struct mem_pool *mem_pool_create_huge(const char *name) __attribute__((malloc)) __attribute__((returns_nonnull));
 // Destroy a memory pool, freeing all its memory as well.
 void mem_pool_destroy(struct mem_pool *pool) __attribute__((nonnull));
 
@@ -36,6 +41,24 @@ void *mem_pool_alloc(struct mem_pool *pool, size_t size) __attribute__((malloc))
 // Free all memory allocated from this memory pool. The pool can be used to get more allocations.
 void mem_pool_reset(struct mem_pool *pool) __attribute__((nonnull));
 
+/*
+ * A position in a memory pool. Rewinding the pool to it frees everything
+ * allocated after the mark was taken, but keeps the older allocations. This
+ * allows releasing scratch memory in a loop (eg. per packet) without waiting
+ * for the reset of the whole pool. The memory gets reused right away, while
+ * it is still in the CPU cache.
+ *
+ * The mark becomes invalid when the pool is reset or rewound to an older mark.
+ * Don't look inside.
+ */
+struct mem_pool_mark {
+	void *page, *pos;
+	size_t available, used, allocated, requests;
+};
+
+struct mem_pool_mark mem_pool_mark(const struct mem_pool *pool) __attribute__((nonnull)) __attribute__((pure));
+void mem_pool_rewind(struct mem_pool *pool, const struct mem_pool_mark *mark) __attribute__((nonnull));
+
 // Some convenience functions
 
 // Copy a string to memory from the pool
@@ -45,7 +68,28 @@ char *mem_pool_printf(struct mem_pool *pool, const char *format, ...) __attribut
 // Format binary data to hex
 char *mem_pool_hex(struct mem_pool *pool, const uint8_t *data, size_t size) __attribute__((malloc)) __attribute__((nonnull)) __attribute__((returns_nonnull));
 
-// Provide a string with statistics about all the memory pools. The result is allocated from tmp_pool
+/*
+ * A slab is for many objects that come and go one by one (eg. entries of a
+ * long-living table). Unlike with a memory pool, each object can be freed
+ * separately and the pages that get empty are returned to the OS. The sizes
+ * are rounded up to several size classes (objects of the same class share
+ * pages), objects larger than 1kB get whole pages.
+ */
+struct slab;
+
+struct slab *slab_create(const char *name) __attribute__((malloc)) __attribute__((nonnull)) __attribute__((returns_nonnull));
+// Destroy the slab, including all the objects still in there.
+void slab_destroy(struct slab *slab) __attribute__((nonnull));
+// Allocate an object from the slab. Never returns NULL.
+void *slab_alloc(struct slab *slab, size_t size) __attribute__((malloc)) __attribute__((nonnull)) __attribute__((alloc_size(2))) __attribute__((returns_nonnull));
+// Return an object allocated by slab_alloc from the same slab.
+void slab_free(struct slab *slab, void *object) __attribute__((nonnull));
+// How many bytes the slab currently holds (including the free objects in its pages)
+size_t slab_allocated(const struct slab *slab) __attribute__((nonnull)) __attribute__((pure));
+
+// Provide a string with statistics about all the memory pools (and slabs). The result is allocated from tmp_pool
 char *mem_pool_stats(struct mem_pool *tmp_pool) __attribute__((malloc)) __attribute__((nonnull));
+// How many bytes the pool currently holds (including the unused parts of pages)
+size_t mem_pool_allocated(const struct mem_pool *pool) __attribute__((nonnull)) __attribute__((pure));
 
 #endif
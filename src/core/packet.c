@@ -62,8 +62,8 @@ static void parse_internal(struct packet_info *packet, struct mem_pool *pool) {
 	 * is on the same place for v6 as for v4, so it works.
 	 */
 	const struct iphdr *iphdr = packet->data;
-	ulog(LLOG_DEBUG_VERBOSE, "Parsing packet of %zu bytes, version %i\n", packet->length, (int) iphdr->version);
-	if (packet->length < sizeof *iphdr) {
+	ulog(LLOG_DEBUG_VERBOSE, "Parsing packet of %zu bytes (%zu captured), version %i\n", packet->length, packet->captured, (int) iphdr->version);
+	if (packet->captured < sizeof *iphdr) {
 		// Packet too short. Not IP therefore, bail out.
 		packet->ip_protocol = 0;
 		return;
@@ -82,7 +82,7 @@ static void parse_internal(struct packet_info *packet, struct mem_pool *pool) {
 		case 6: {
 			// It's an IPv6 packet, put it into a v6 form instead.
 			const struct ip6_hdr *ip6 = packet->data;
-			if (packet->length < sizeof *ip6) {
+			if (packet->captured < sizeof *ip6) {
 				// It claims to be an IPv6 packet, but it's too short for that.
 				packet->ip_protocol = 0;
 				return;
@@ -113,7 +113,9 @@ static void parse_internal(struct packet_info *packet, struct mem_pool *pool) {
 	 */
 	const void *below_ip = (((const uint8_t *) packet->data) + packet->hdr_length);
 	const struct tcp_ports *tcp_ports = below_ip;
-	size_t length_rest = packet->length - packet->hdr_length;
+	// The IP header itself may have been cut off by the snaplen
+	size_t length_rest = packet->length > packet->hdr_length ? packet->length - packet->hdr_length : 0;
+	size_t captured_rest = packet->captured > packet->hdr_length ? packet->captured - packet->hdr_length : 0;
 	// Default protocol is unknown.
 	packet->app_protocol = '?';
 	switch (packet->app_protocol_raw) {
@@ -130,13 +132,14 @@ static void parse_internal(struct packet_info *packet, struct mem_pool *pool) {
 			packet->next = next;
 			next->data = below_ip;
 			next->length = length_rest;
+			next->captured = captured_rest;
 			next->interface = packet->interface;
 			next->direction = packet->direction;
 			next->timestamp = packet->timestamp;
 			uc_parse_packet(next, pool, DLT_RAW);
 			return; // And we're done (no ports here)
 		case 6: // TCP
-			if (length_rest < sizeof *tcp_ports)
+			if (captured_rest < sizeof *tcp_ports)
 				/*
 				 * It claims to be TCP, but it's too short for that.
 				 * Actually, even if it passes this check, it may be
@@ -152,7 +155,7 @@ static void parse_internal(struct packet_info *packet, struct mem_pool *pool) {
 			break;
 		case 17: // UDP
 			packet->app_protocol = 'U';
-			if (length_rest < UDP_LENGTH)
+			if (captured_rest < UDP_LENGTH)
 				// Too short for UDP
 				return;
 			packet->hdr_length += UDP_LENGTH;
@@ -201,19 +204,19 @@ static void parse_type(struct packet_info *packet, struct mem_pool *pool, const
 	while (type == 0x88a8 || type == 0x9100) { // IEEE 802.1ed (can be stacked)
 		data += 4;
 		skipped += 4;
-		if (skipped + 2 >= packet->length)
+		if (skipped + 2 >= packet->captured)
 			return; // Give up. Short packet.
 		type = ntohs(*(uint16_t *) data);
 	}
 	if (type == 0x8100) {// IEEE 802.1q
 		data += 2;
 		skipped += 2;
-		if (skipped + 2>= packet->length)
+		if (skipped + 2>= packet->captured)
 			return; // Give up. Short packet.
 		packet->vlan_tag = ntohs(*(uint16_t *)data);
 		data += 2;
 		skipped += 2;
-		if (skipped + 2 >= packet->length)
+		if (skipped + 2 >= packet->captured)
 			return; // Give up. Short packet.
 	} else
 		packet->vlan_tag = 0;
@@ -228,6 +231,7 @@ static void parse_type(struct packet_info *packet, struct mem_pool *pool, const
 	(*next) = (struct packet_info) {
 		.data = data,
 		.length = packet->length - skipped,
+		.captured = packet->captured - skipped,
 		.interface = packet->interface,
 		.direction = packet->direction,
 		.timestamp = packet->timestamp,
@@ -272,7 +276,7 @@ static void parse_type(struct packet_info *packet, struct mem_pool *pool, const
 static void parse_ethernet(struct packet_info *packet, struct mem_pool *pool) {
 	ulog(LLOG_DEBUG_VERBOSE, "Parse ethernet\n");
 	const unsigned char *data = packet->data;
-	if (packet->length < 14)
+	if (packet->captured < 14)
 		return;
 	/*
 	 * The ethernet frame defines that we should have the peramble and
@@ -294,7 +298,7 @@ static void parse_ethernet(struct packet_info *packet, struct mem_pool *pool) {
  */
 static void parse_cooked(struct packet_info *packet, struct mem_pool *pool) {
 	const unsigned char *data = packet->data;
-	if (packet->length < 16)
+	if (packet->captured < 16)
 		return;
 	//uint16_t ptype = ntohs(*(uint16_t *) data);
 	data += 2;
@@ -54,8 +54,13 @@ enum tcp_flags {
 struct packet_info {
 	// The parsed embedded packet, in case of app_protocol == '4' || '6'
 	const struct packet_info *next;
-	// Length and raw data of the packet (starts with IP header or similar on the same level)
-	size_t length;
+	/*
+	 * Length and raw data of the packet (starts with IP header or similar on the same level).
+	 *
+	 * The length is the one on the wire. But we may capture only part of the packet
+	 * (see the snaplen), so only the first captured bytes of data are available.
+	 */
+	size_t length, captured;
 	const void *data;
 	// Textual name of the interface it was captured on
 	const char *interface;
@@ -136,8 +141,8 @@ struct packet_info {
 };
 
 /*
- * Parse the stuff in the passed packet. It expects length and data are already
- * set, it fills the addresses, protocols, etc.
+ * Parse the stuff in the passed packet. It expects length, captured and data are
+ * already set, it fills the addresses, protocols, etc.
  */
 void uc_parse_packet(struct packet_info *packet, struct mem_pool *pool, int datalink) __attribute__((nonnull));
 
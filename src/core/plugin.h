@@ -35,6 +35,22 @@ struct config_node {
 	size_t value_count;
 };
 
+/*
+ * Description of packets a plugin wants to see. It is about the innermost packet
+ * (the end of the next chain), the fields correspond to the ones in packet_info.
+ *
+ * The core lets the kernel drop the packets nobody is interested in and calls
+ * the plugin only with packets whose innermost layer and app_protocol match.
+ * The rest (ip_protocol, tcp_flags) is only a hint, the plugin still may get
+ * other packets and needs to check them.
+ */
+struct packet_interest {
+	char layer; // Only 'I' is really used for filtering now
+	uint8_t ip_protocol; // 4 or 6, 0 for both
+	char app_protocol; // 'T', 'U', 'i', 'I', or '\0' for any
+	uint8_t tcp_flags; // At least one of these must be set (only with app_protocol 'T'), 0 for any
+};
+
 typedef void (*packet_callback_t)(struct context *context, const struct packet_info *info);
 typedef void (*fd_callback_t)(struct context *context, int fd, void *tag);
 
@@ -58,8 +74,33 @@ struct plugin {
 	/* ----- The below things are available only from API version 2 and above ----- */
 	// Broadcasted when a child of ucollect dies. It may belong to other plugin, for example. The state is one from the wait() function.
 	void (*child_died_callback)(struct context *context, int state, pid_t child);
+	/* ----- The below things are available only from API version 3 and above ----- */
+	/*
+	 * Handle a batch of packets at once (a burst from one read of the capture).
+	 * If set, it is called instead of the packet_callback. The packets are valid
+	 * only during the call and the temp pool is reset once per the whole batch.
+	 */
+	void (*packet_batch_callback)(struct context *context, const struct packet_info *const *packets, size_t count);
+	// NULL-terminated list of packets the plugin is interested in. If the list itself is NULL, it wants all of them.
+	const struct packet_interest *const *interests;
+	/*
+	 * If payload_limit is set, the plugin needs only payload_len bytes of the packet
+	 * past the L4 (TCP, UDP, ICMP...) header. The core may then capture only the beginning
+	 * of packets. Otherwise it needs whole packets. The wire length is still in packet_info.length,
+	 * the packet_info.captured says how much is available.
+	 */
+	bool payload_limit;
+	size_t payload_len;
+	// Pass the innermost packet_info (the one the interests are matched against) to the packet_callback instead of the outermost one.
+	bool packet_innermost;
+	/*
+	 * The plugin uses too much memory (see the memory_budget option). With hard being false,
+	 * it got over the soft limit and should get rid of some data if it can. With hard, it
+	 * is over the whole budget and gets reinitialized unless it frees enough right now.
+	 */
+	void (*memory_pressure_callback)(struct context *context, bool hard);
 };
 
-#define UCOLLECT_PLUGIN_API_VERSION 2
+#define UCOLLECT_PLUGIN_API_VERSION 3
 
 #endif
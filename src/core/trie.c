@@ -30,25 +30,49 @@ struct trie_node {
 	const uint8_t *key;
 	size_t key_size;
 	struct trie_node *head, *tail, *next, *prev;
+	struct trie_node *parent;
+	struct trie_node *older, *newer; // The order of the active nodes, in an ordered trie
+	uint8_t *buffer; // Memory for the key, owned by the node (it stays with it when recycled)
+	size_t buffer_size;
 	bool active;
 };
 
+struct trie {
+	struct trie_node root;
+	size_t active_count;
+	size_t max_key_len;
+	struct mem_pool *pool;
+	struct trie_node *unused; // Deleted nodes, for reuse
+	struct trie_node *oldest, *newest;
+	size_t modifications; // To detect use of an iterator after the trie changed
+	bool ordered, lru;
+};
+
 #define LIST_NODE struct trie_node
 #define LIST_BASE struct trie_node
 #define LIST_PREV prev
 #define LIST_NAME(X) trie_##X
-#define LIST_WANT_APPEND_POOL
 #define LIST_WANT_LFOR
 #define LIST_WANT_INSERT_AFTER
 #define LIST_WANT_REMOVE
 #include "link_list.h"
 
-struct trie {
-	struct trie_node root;
-	size_t active_count;
-	size_t max_key_len;
-	struct mem_pool *pool;
-};
+#define LIST_NODE struct trie_node
+#define LIST_BASE struct trie
+#define LIST_HEAD oldest
+#define LIST_TAIL newest
+#define LIST_NEXT newer
+#define LIST_PREV older
+#define LIST_NAME(X) trie_order_##X
+#define LIST_WANT_INSERT_AFTER
+#define LIST_WANT_REMOVE
+#include "link_list.h"
+
+#define RECYCLER_NODE struct trie_node
+#define RECYCLER_BASE struct trie
+#define RECYCLER_HEAD unused
+#define RECYCLER_NAME(X) trie_node_##X
+#include "recycler.h"
 
 struct trie *trie_alloc(struct mem_pool *pool) {
 	ulog(LLOG_DEBUG, "Allocating new trie\n");
@@ -59,26 +83,86 @@ struct trie *trie_alloc(struct mem_pool *pool) {
 	return result;
 }
 
+struct trie *trie_alloc_ordered(struct mem_pool *pool, bool lru) {
+	struct trie *result = trie_alloc(pool);
+	result->ordered = true;
+	result->lru = lru;
+	return result;
+}
+
 size_t trie_size(struct trie *trie) {
 	return trie->active_count;
 }
 
-static void walk_node(struct trie_node *node, trie_walk_callback callback, void *userdata, uint8_t *keybuf, size_t keypos) {
-	ulog(LLOG_DEBUG_VERBOSE, "Walk: %zu + %zu\n", keypos, node->key_size);
-	memcpy(keybuf + keypos, node->key, node->key_size);
-	keypos += node->key_size;
-	if (node->active) {
-		keybuf[keypos] = '\0';
-		callback(keybuf, keypos, node->data, userdata);
+struct trie_iter {
+	struct trie *trie;
+	size_t modifications;
+	const struct trie_node *node; // The current one
+	uint8_t *key; // Key of the current node
+	size_t key_size;
+	bool started;
+};
+
+struct trie_iter *trie_iter_begin(struct trie *trie, struct mem_pool *pool) {
+	struct trie_iter *iter = mem_pool_alloc(pool, sizeof *iter);
+	*iter = (struct trie_iter) {
+		.trie = trie,
+		.modifications = trie->modifications,
+		.key = mem_pool_alloc(pool, trie->max_key_len + 1)
+	};
+	return iter;
+}
+
+static const struct trie_node *iter_enter(struct trie_iter *iter, const struct trie_node *node) {
+	// We'll likely go to these soon
+	__builtin_prefetch(node->head);
+	__builtin_prefetch(node->next);
+	memcpy(iter->key + iter->key_size, node->key, node->key_size);
+	iter->key_size += node->key_size;
+	return node;
+}
+
+// Move to the next node in preorder (without recursion, by the parent links)
+static const struct trie_node *iter_advance(struct trie_iter *iter) {
+	const struct trie_node *node = iter->node;
+	if (!iter->started) {
+		iter->started = true;
+		return &iter->trie->root;
+	}
+	if (!node)
+		return NULL; // We are at the end already
+	if (node->head)
+		return iter_enter(iter, node->head);
+	while (node->parent) {
+		iter->key_size -= node->key_size;
+		if (node->next)
+			return iter_enter(iter, node->next);
+		node = node->parent;
 	}
-	LFOR(trie, child, node)
-		walk_node(child, callback, userdata, keybuf, keypos);
+	return NULL;
+}
+
+bool trie_iter_next(struct trie_iter *iter, const uint8_t **key, size_t *key_size, struct trie_data **data) {
+	sanity(iter->modifications == iter->trie->modifications, "Trie modified during iteration\n");
+	while ((iter->node = iter_advance(iter)))
+		if (iter->node->active) {
+			iter->key[iter->key_size] = '\0';
+			*key = iter->key;
+			*key_size = iter->key_size;
+			*data = iter->node->data;
+			return true;
+		}
+	return false;
 }
 
 void trie_walk(struct trie *trie, trie_walk_callback callback, void *userdata, struct mem_pool *temp_pool) {
 	ulog(LLOG_DEBUG, "Walking trie with %zu active nodes\n", trie->active_count);
-	uint8_t *keybuf = mem_pool_alloc(temp_pool, trie->max_key_len + 1);
-	walk_node(&trie->root, callback, userdata, keybuf, 0);
+	struct trie_iter *iter = trie_iter_begin(trie, temp_pool);
+	const uint8_t *key;
+	size_t key_size;
+	struct trie_data *data;
+	while (trie_iter_next(iter, &key, &key_size, &data))
+		callback(key, key_size, data, userdata);
 }
 
 // Longest common prefix
@@ -89,19 +173,55 @@ static size_t lcp(const uint8_t *_1, size_t s1, const uint8_t *_2, size_t s2) {
 	return s1 < s2 ? s1 : s2;
 }
 
+static void node_activate(struct trie *trie, struct trie_node *node) {
+	node->active = true;
+	trie->active_count ++;
+	if (trie->ordered)
+		trie_order_insert_after(trie, node, trie->newest);
+}
+
+// The node was accessed, make it the newest one if the order is by use
+static void node_touch(struct trie *trie, struct trie_node *node) {
+	if (trie->lru && node != trie->newest) {
+		trie_order_remove(trie, node);
+		trie_order_insert_after(trie, node, trie->newest);
+	}
+}
+
+// Get a clean node, possibly a recycled one
+static struct trie_node *node_get(struct trie *trie, struct trie_node *parent) {
+	bool recycled = trie->unused;
+	struct trie_node *node = trie_node_get(trie, trie->pool);
+	*node = (struct trie_node) {
+		.parent = parent,
+		// A fresh node from the pool has garbage there
+		.buffer = recycled ? node->buffer : NULL,
+		.buffer_size = recycled ? node->buffer_size : 0
+	};
+	return node;
+}
+
+// Make sure the node's own buffer is large enough for size bytes of key
+static uint8_t *node_buffer(struct trie *trie, struct trie_node *node, size_t size) {
+	if (node->buffer_size < size) {
+		node->buffer = mem_pool_alloc(trie->pool, size);
+		node->buffer_size = size;
+	}
+	return node->buffer;
+}
+
 static struct trie_data **trie_new_node(struct trie *trie, struct trie_node *parent, const uint8_t *key, size_t key_size, bool insert_new) {
 	if (!insert_new)
 		return NULL;
+	assert(key_size);
 	ulog(LLOG_DEBUG_VERBOSE, "Creating new node with %zu bytes of key\n", key_size);
-	struct trie_node *new = trie_append_pool(parent, trie->pool);
-	new->active = true;
-	trie->active_count ++;
-	new->head = new->tail = NULL; // No children yet
-	new->data = NULL;
-	uint8_t *new_key = mem_pool_alloc(trie->pool, key_size);
+	struct trie_node *new = node_get(trie, parent);
+	trie_insert_after(parent, new, parent->tail);
+	uint8_t *new_key = node_buffer(trie, new, key_size);
 	new->key = new_key;
 	memcpy(new_key, key, key_size);
 	new->key_size = key_size;
+	node_activate(trie, new);
 	return &new->data;
 }
 
@@ -115,10 +235,11 @@ static struct trie_data **trie_index_internal(struct trie *trie, struct trie_nod
 		if (key_size == 0) {
 			// We found the position
 			ulog(LLOG_DEBUG_VERBOSE, "Trie exact hit\n");
-			if (!node->active && insert_new) {
+			if (node->active) {
+				node_touch(trie, node);
+			} else if (insert_new) {
 				ulog(LLOG_DEBUG_VERBOSE, "Making node active\n");
-				node->active = true;
-				trie->active_count ++;
+				node_activate(trie, node);
 			}
 			return &node->data; // Will be NULL for sure if not active
 		} else {
@@ -139,33 +260,39 @@ static struct trie_data **trie_index_internal(struct trie *trie, struct trie_nod
 	} else if (insert_new) {
 		ulog(LLOG_DEBUG_VERBOSE, "Splitting node with key of %zu bytes after %zu bytes\n", node->key_size, prefix);
 		/*
-		 * We traversed only part of the path. We need to split it in half, and create a new node for the
-		 * rest of the path, and another new node for the one we want to index.
+		 * We traversed only part of the path. We need to split it in half. A new
+		 * node takes the first half and the place of the old one in its parent,
+		 * the old one (with the rest of the path) becomes its child. The old
+		 * node itself stays, as it may be in the order list.
 		 */
-		struct trie_node *new = mem_pool_alloc(trie->pool, sizeof *new);
-		// Move the content to the new node
-		*new = *node;
-		// Rip out the new node from the list
-		new->next = new->prev = NULL;
-		// Move the new key after the prefix
-		new->key += prefix;
-		new->key_size -= prefix;
-		// Reset data in the old node
-		node->active = false;
-		node->data = NULL;
-		node->head = NULL;
-		node->tail = NULL;
-		node->key_size = prefix;
-		// Add the new node as child
-		trie_insert_after(node, new, NULL);
+		struct trie_node *parent = node->parent;
+		assert(parent); // The root has empty key, so it is never split
+		struct trie_node *split = node_get(trie, parent);
+		// Copy the key, as the node's buffer may get reused if it is deleted
+		uint8_t *split_key = node_buffer(trie, split, prefix);
+		memcpy(split_key, node->key, prefix);
+		split->key = split_key;
+		split->key_size = prefix;
+		trie_insert_after(parent, split, node);
+		trie_remove(parent, node);
+		node->key += prefix;
+		node->key_size -= prefix;
+		node->parent = split;
+		trie_insert_after(split, node, NULL);
+		if (key_size == prefix) {
+			// The key ends right at the split
+			node_activate(trie, split);
+			return &split->data;
+		}
 		// And now add the rest of the index at the split node
-		return trie_new_node(trie, node, key + prefix, key_size - prefix, insert_new);
+		return trie_new_node(trie, split, key + prefix, key_size - prefix, insert_new);
 	} else
 		return NULL; // Not inserting a new one
 }
 
 struct trie_data **trie_index(struct trie *trie, const uint8_t *key, size_t key_size) {
 	ulog(LLOG_DEBUG_VERBOSE, "Indexing trie by %zu bytes of key\n", key_size);
+	trie->modifications ++;
 	if (key_size > trie->max_key_len)
 		trie->max_key_len = key_size;
 	return trie_index_internal(trie, &trie->root, key, key_size, true);
@@ -173,9 +300,127 @@ struct trie_data **trie_index(struct trie *trie, const uint8_t *key, size_t key_
 
 struct trie_data *trie_lookup(struct trie *trie, const uint8_t *key, size_t key_size) {
 	ulog(LLOG_DEBUG_VERBOSE, "Looking up in trie with %zu bytes of key\n", key_size);
+	trie->modifications ++; // The lookup reorders the nodes
 	struct trie_data **data = trie_index_internal(trie, &trie->root, key, key_size, false);
 	if (data)
 		return *data;
 	else
 		return NULL;
 }
+
+// Find the node of given key, NULL if there's none (active or not)
+static struct trie_node *node_find(struct trie *trie, const uint8_t *key, size_t key_size) {
+	struct trie_node *node = &trie->root;
+	for (;;) {
+		if (lcp(key, key_size, node->key, node->key_size) != node->key_size)
+			return NULL;
+		key += node->key_size;
+		key_size -= node->key_size;
+		if (!key_size)
+			return node;
+		struct trie_node *next = NULL;
+		LFOR(trie, child, node)
+			if (*child->key == *key) {
+				next = child;
+				break;
+			}
+		if (!next)
+			return NULL;
+		node = next;
+	}
+}
+
+bool trie_delete(struct trie *trie, const uint8_t *key, size_t key_size) {
+	ulog(LLOG_DEBUG_VERBOSE, "Deleting %zu bytes of key from trie\n", key_size);
+	trie->modifications ++;
+	struct trie_node *node = node_find(trie, key, key_size);
+	if (!node || !node->active)
+		return false;
+	node->active = false;
+	node->data = NULL;
+	trie->active_count --;
+	if (trie->ordered)
+		trie_order_remove(trie, node);
+	/*
+	 * Clean up the nodes that are no longer needed. A node without data
+	 * and children goes away (and then maybe its parent too), a node
+	 * without data and with a single child is merged with it.
+	 */
+	while (node->parent && !node->active) {
+		struct trie_node *parent = node->parent;
+		if (!node->head) {
+			trie_remove(parent, node);
+			trie_node_release(trie, node);
+			node = parent;
+		} else {
+			if (node->head == node->tail) {
+				// The child takes the node's place, so the active nodes stay where they are
+				struct trie_node *child = node->head;
+				size_t size = node->key_size + child->key_size;
+				uint8_t *merged;
+				if (child->buffer_size >= size) {
+					// The child's key is somewhere in its own buffer, make space for the node's part in front
+					merged = child->buffer;
+					memmove(merged + node->key_size, child->key, child->key_size);
+				} else {
+					merged = node_buffer(trie, child, size);
+					memcpy(merged + node->key_size, child->key, child->key_size);
+				}
+				memcpy(merged, node->key, node->key_size);
+				child->key = merged;
+				child->key_size += node->key_size;
+				child->parent = parent;
+				trie_remove(node, child);
+				trie_insert_after(parent, child, node);
+				trie_remove(parent, node);
+				trie_node_release(trie, node);
+			}
+			break;
+		}
+	}
+	return true;
+}
+
+static size_t node_key_size(const struct trie_node *node) {
+	size_t size = 0;
+	for (; node; node = node->parent)
+		size += node->key_size;
+	return size;
+}
+
+// Put the key together from the pieces on the path to the root, from the end
+static void node_key(const struct trie_node *node, uint8_t *key, size_t size) {
+	key[size] = '\0';
+	for (; node; node = node->parent) {
+		size -= node->key_size;
+		if (node->key_size)
+			memcpy(key + size, node->key, node->key_size);
+	}
+}
+
+const uint8_t *trie_oldest(struct trie *trie, size_t *key_size, struct trie_data **data, struct mem_pool *temp_pool) {
+	assert(trie->ordered);
+	struct trie_node *node = trie->oldest;
+	if (!node)
+		return NULL;
+	size_t size = node_key_size(node);
+	uint8_t *key = mem_pool_alloc(temp_pool, size + 1);
+	node_key(node, key, size);
+	*key_size = size;
+	*data = node->data;
+	return key;
+}
+
+void trie_walk_ordered(struct trie *trie, trie_walk_callback callback, void *userdata, struct mem_pool *temp_pool) {
+	if (!trie->ordered) {
+		trie_walk(trie, callback, userdata, temp_pool);
+		return;
+	}
+	ulog(LLOG_DEBUG, "Walking ordered trie with %zu active nodes\n", trie->active_count);
+	uint8_t *key = mem_pool_alloc(temp_pool, trie->max_key_len + 1);
+	for (const struct trie_node *node = trie->oldest; node; node = node->newer) {
+		size_t size = node_key_size(node);
+		node_key(node, key, size);
+		callback(key, size, node->data, userdata);
+	}
+}
@@ -25,8 +25,9 @@
  * arbitrary length.
  *
  * The trie can be used to access values indexed by the keys fast and new keys can
- * be added at any time. However, it doesn't support deletions and it can be only
- * destroyed as a whole.
+ * be added at any time. Keys can be deleted too, but the memory of the deleted
+ * keys is returned to the memory pool only when the whole trie is destroyed
+ * (most of it is reused for new keys in the meantime).
  *
  * Each node holds linked list of subnodes. Each subnode keeps part of the key
  * from the node to the subnode. The subnodes' parts of keys always differ in
@@ -34,10 +35,20 @@
  *
  * On each access, the currently accessed subnode is moved to the front of the
  * linked list, to keep the most often used ones somewhere to the front.
+ *
+ * An ordered trie (see trie_alloc_ordered) additionally keeps its keys in
+ * a list sorted by the time they were inserted (or last accessed), so the
+ * oldest ones can be expired.
+ *
+ * When built with TRIE_ART=1, an adaptive radix tree is used instead (see
+ * trie_art.c). It has the same interface, but the nodes are arrays indexed
+ * by the next byte of the key, which is faster with many different keys.
+ * The walk is in the order of the keys there.
  */
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <stdbool.h>
 
 // User data to store in the trie. Each module/plugin can have different implementation.
 struct trie_data;
@@ -52,6 +63,12 @@ struct mem_pool;
  * There's no deallocation routine for trie. You have to reset the memory pool.
  */
 struct trie *trie_alloc(struct mem_pool *pool) __attribute__((nonnull)) __attribute__((malloc)) __attribute__((returns_nonnull));
+/*
+ * Allocate a trie that remembers the order of its keys, for trie_oldest.
+ * If lru is false, it is the order of insertion. If it is true, each hit
+ * by trie_index or trie_lookup makes the key the newest one.
+ */
+struct trie *trie_alloc_ordered(struct mem_pool *pool, bool lru) __attribute__((nonnull)) __attribute__((malloc)) __attribute__((returns_nonnull));
 /*
  * Access a position in the trie. It is allowed (and expected) for the caller to change the data pointer.
  *
@@ -72,6 +89,17 @@ struct trie_data **trie_index(struct trie *trie, const uint8_t *key, size_t key_
 struct trie_data *trie_lookup(struct trie *trie, const uint8_t *key, size_t key_size) __attribute__((nonnull(1))) __attribute__((pure));
 // Return count of different positions accessed by trie_index
 size_t trie_size(struct trie *trie) __attribute__((nonnull)) __attribute__((pure));
+/*
+ * Remove the key from the trie. Returns if it was there. The data are not
+ * touched, it's up to the caller to release them.
+ */
+bool trie_delete(struct trie *trie, const uint8_t *key, size_t key_size) __attribute__((nonnull(1)));
+/*
+ * Provide the oldest key of an ordered trie and its data. The key is
+ * 0-terminated and allocated from the temp_pool, so it can be passed to
+ * trie_delete. Returns NULL if the trie is empty.
+ */
+const uint8_t *trie_oldest(struct trie *trie, size_t *key_size, struct trie_data **data, struct mem_pool *temp_pool) __attribute__((nonnull));
 /*
  * Walk the whole trie and call the callback for each key previously accessed
  * by trie_index. The value in key pointer will change (it is not valid after
@@ -86,5 +114,22 @@ size_t trie_size(struct trie *trie) __attribute__((nonnull)) __attribute__((pure
  */
 typedef void (*trie_walk_callback)(const uint8_t *key, size_t key_size, struct trie_data *data, void *userdata);
 void trie_walk(struct trie *trie, trie_walk_callback callback, void *userdata, struct mem_pool *temp_pool) __attribute__((nonnull(1,2,4)));
+/*
+ * Like trie_walk, but an ordered trie is walked from the oldest key to the
+ * newest one. Other tries are walked in the order of trie_walk.
+ */
+void trie_walk_ordered(struct trie *trie, trie_walk_callback callback, void *userdata, struct mem_pool *temp_pool) __attribute__((nonnull(1,2,4)));
+/*
+ * Iterate through the keys one by one, in the same order as trie_walk. The
+ * iterator is allocated from the pool. It can be kept between loop iterations,
+ * so a large trie can be processed in pieces, but the trie must not be
+ * changed (not even by trie_lookup) until the iteration is done.
+ *
+ * The trie_iter_next provides the next key (0-terminated, valid until the next
+ * call) and its data. It returns false when there are no more keys.
+ */
+struct trie_iter;
+struct trie_iter *trie_iter_begin(struct trie *trie, struct mem_pool *pool) __attribute__((nonnull)) __attribute__((malloc)) __attribute__((returns_nonnull));
+bool trie_iter_next(struct trie_iter *iter, const uint8_t **key, size_t *key_size, struct trie_data **data) __attribute__((nonnull));
 
 #endif
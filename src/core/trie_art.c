@@ -0,0 +1,819 @@
+/*
+    Ucollect - small utility for real-time analysis of network data
+    Copyright (C) 2015 CZ.NIC, z.s.p.o. (http://www.nic.cz/)
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/*
+ * Adaptive radix tree implementation of the trie.h interface. Used instead of
+ * the one in trie.c when built with TRIE_ART=1.
+ *
+ * Each inner node branches on one byte of the key and has one of four sizes,
+ * according to how many children it has. A node with up to 4 children keeps
+ * sorted arrays of the bytes and children, up to 16 the same (searched by SIMD
+ * where available), up to 48 has a 256-byte index into the children and the
+ * largest one has the children indexed directly by the byte. The nodes grow
+ * as the children get added.
+ *
+ * The bytes shared by all the keys below a node are kept in its prefix (path
+ * compression). The leaves hold whole keys, so a subtree with a single key is
+ * just the leaf (lazy expansion). A key that ends exactly at a node (a prefix
+ * of other keys) has its leaf in the node itself.
+ *
+ * Deleting a key shrinks the node it was in, if it has few children left.
+ * A node with only one thing left in it is replaced by that thing, so each
+ * node always branches.
+ */
+
+#include "trie.h"
+#include "mem_pool.h"
+#include "util.h"
+
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+enum node_type {
+	NODE_4,
+	NODE_16,
+	NODE_48,
+	NODE_256,
+	NODE_TYPE_COUNT
+};
+
+struct art_leaf {
+	struct trie_data *data;
+	struct art_leaf *older, *newer; // The order of the keys, in an ordered trie
+	size_t key_size;
+	uint8_t key[]; // 0-terminated, for the walk
+};
+
+struct art_node {
+	enum node_type type;
+	unsigned count; // Number of children (not counting the leaf)
+	size_t prefix_len;
+	const uint8_t *prefix;
+	struct art_leaf *leaf; // The key ending right after the prefix
+};
+
+/*
+ * The children are either nodes or leaves. The leaves are marked by the
+ * lowest bit of the pointer (everything from a pool is aligned).
+ */
+typedef void *art_ptr;
+
+// The nodes replaced by others (and deleted leaves) are linked through their first bytes
+struct free_node {
+	struct free_node *next;
+};
+
+struct node_4 {
+	struct art_node header;
+	uint8_t keys[4];
+	art_ptr children[4];
+};
+
+struct node_16 {
+	struct art_node header;
+	uint8_t keys[16];
+	art_ptr children[16];
+};
+
+struct node_48 {
+	struct art_node header;
+	uint8_t index[256]; // Position in children + 1, 0 for none
+	art_ptr children[48];
+};
+
+struct node_256 {
+	struct art_node header;
+	art_ptr children[256];
+};
+
+static const size_t node_sizes[NODE_TYPE_COUNT] = {
+	sizeof(struct node_4),
+	sizeof(struct node_16),
+	sizeof(struct node_48),
+	sizeof(struct node_256)
+};
+
+// Deleted leaves with keys shorter than this are kept for reuse (by the key size)
+#define LEAF_REUSE_MAX 64
+
+struct trie {
+	art_ptr root;
+	size_t active_count;
+	struct mem_pool *pool;
+	// Nodes replaced by others, to be reused
+	struct free_node *free_nodes[NODE_TYPE_COUNT];
+	struct free_node *free_leaves[LEAF_REUSE_MAX];
+	struct art_leaf *oldest, *newest;
+	size_t max_key_len; // Bounds the depth of the tree
+	size_t modifications; // To detect use of an iterator after the trie changed
+	bool ordered, lru;
+};
+
+#define LIST_NODE struct art_leaf
+#define LIST_BASE struct trie
+#define LIST_HEAD oldest
+#define LIST_TAIL newest
+#define LIST_NEXT newer
+#define LIST_PREV older
+#define LIST_NAME(X) leaf_order_##X
+#define LIST_WANT_INSERT_AFTER
+#define LIST_WANT_REMOVE
+#include "link_list.h"
+
+static bool is_leaf(art_ptr ptr) {
+	return (uintptr_t) ptr & 1;
+}
+
+static struct art_leaf *as_leaf(art_ptr ptr) {
+	return (struct art_leaf *) ((uintptr_t) ptr & ~(uintptr_t) 1);
+}
+
+static art_ptr leaf_ptr(struct art_leaf *leaf) {
+	return (art_ptr) ((uintptr_t) leaf | 1);
+}
+
+struct trie *trie_alloc(struct mem_pool *pool) {
+	ulog(LLOG_DEBUG, "Allocating new trie\n");
+	struct trie *result = mem_pool_alloc(pool, sizeof *result);
+	*result = (struct trie) {
+		.pool = pool
+	};
+	return result;
+}
+
+struct trie *trie_alloc_ordered(struct mem_pool *pool, bool lru) {
+	struct trie *result = trie_alloc(pool);
+	result->ordered = true;
+	result->lru = lru;
+	return result;
+}
+
+size_t trie_size(struct trie *trie) {
+	return trie->active_count;
+}
+
+static struct art_leaf *leaf_new(struct trie *trie, const uint8_t *key, size_t key_size) {
+	ulog(LLOG_DEBUG_VERBOSE, "Creating new leaf with %zu bytes of key\n", key_size);
+	struct art_leaf *leaf;
+	if (key_size < LEAF_REUSE_MAX && trie->free_leaves[key_size]) {
+		struct free_node *reused = trie->free_leaves[key_size];
+		trie->free_leaves[key_size] = reused->next;
+		leaf = (struct art_leaf *) reused;
+	} else {
+		leaf = mem_pool_alloc(trie->pool, sizeof *leaf + key_size + 1);
+	}
+	*leaf = (struct art_leaf) {
+		.key_size = key_size
+	};
+	memcpy(leaf->key, key, key_size);
+	leaf->key[key_size] = '\0';
+	trie->active_count ++;
+	if (trie->ordered)
+		leaf_order_insert_after(trie, leaf, trie->newest);
+	return leaf;
+}
+
+static void leaf_free(struct trie *trie, struct art_leaf *leaf) {
+	trie->active_count --;
+	if (trie->ordered)
+		leaf_order_remove(trie, leaf);
+	if (leaf->key_size < LEAF_REUSE_MAX) {
+		struct free_node *freed = (struct free_node *) leaf;
+		freed->next = trie->free_leaves[leaf->key_size];
+		trie->free_leaves[leaf->key_size] = freed;
+	}
+}
+
+// The leaf was accessed, make it the newest one if the order is by use
+static struct art_leaf *leaf_touch(struct trie *trie, struct art_leaf *leaf) {
+	if (trie->lru && leaf != trie->newest) {
+		leaf_order_remove(trie, leaf);
+		leaf_order_insert_after(trie, leaf, trie->newest);
+	}
+	return leaf;
+}
+
+static bool leaf_matches(const struct art_leaf *leaf, const uint8_t *key, size_t key_size) {
+	return leaf->key_size == key_size && (!key_size || memcmp(leaf->key, key, key_size) == 0);
+}
+
+static struct art_node *node_new(struct trie *trie, enum node_type type, const uint8_t *prefix, size_t prefix_len) {
+	struct art_node *node;
+	struct free_node *reused = trie->free_nodes[type];
+	if (reused) {
+		trie->free_nodes[type] = reused->next;
+		node = (struct art_node *) reused;
+	} else {
+		node = mem_pool_alloc(trie->pool, node_sizes[type]);
+	}
+	memset(node, 0, node_sizes[type]);
+	node->type = type;
+	node->prefix_len = prefix_len;
+	node->prefix = prefix;
+	return node;
+}
+
+static void node_free(struct trie *trie, struct art_node *node) {
+	enum node_type type = node->type;
+	struct free_node *freed = (struct free_node *) node;
+	freed->next = trie->free_nodes[type];
+	trie->free_nodes[type] = freed;
+}
+
+// Copy a piece of key, so the node doesn't reference the caller's memory
+static const uint8_t *prefix_copy(struct trie *trie, const uint8_t *key, size_t size) {
+	if (!size)
+		return NULL;
+	uint8_t *result = mem_pool_alloc(trie->pool, size);
+	memcpy(result, key, size);
+	return result;
+}
+
+// Longest common prefix
+static size_t lcp(const uint8_t *_1, size_t s1, const uint8_t *_2, size_t s2) {
+	size_t max = s1 < s2 ? s1 : s2;
+	for (size_t i = 0; i < max; i ++)
+		if (_1[i] != _2[i])
+			return i;
+	return max;
+}
+
+static int node_16_position(const struct node_16 *node, uint8_t byte) {
+#ifdef __SSE2__
+	__m128i cmp = _mm_cmpeq_epi8(_mm_set1_epi8((char) byte), _mm_loadu_si128((const __m128i *) node->keys));
+	unsigned mask = (unsigned) _mm_movemask_epi8(cmp) & ((1U << node->header.count) - 1);
+	return mask ? __builtin_ctz(mask) : -1;
+#else
+	for (unsigned i = 0; i < node->header.count; i ++)
+		if (node->keys[i] == byte)
+			return i;
+	return -1;
+#endif
+}
+
+// Find the slot of the child for the given byte, NULL if there's none
+static art_ptr *child_find(struct art_node *node, uint8_t byte) {
+	switch (node->type) {
+		case NODE_4: {
+			struct node_4 *n = (struct node_4 *) node;
+			for (unsigned i = 0; i < node->count; i ++)
+				if (n->keys[i] == byte)
+					return &n->children[i];
+			return NULL;
+		}
+		case NODE_16: {
+			struct node_16 *n = (struct node_16 *) node;
+			int pos = node_16_position(n, byte);
+			return pos == -1 ? NULL : &n->children[pos];
+		}
+		case NODE_48: {
+			struct node_48 *n = (struct node_48 *) node;
+			return n->index[byte] ? &n->children[n->index[byte] - 1] : NULL;
+		}
+		case NODE_256: {
+			struct node_256 *n = (struct node_256 *) node;
+			return n->children[byte] ? &n->children[byte] : NULL;
+		}
+		default:
+			insane("Unknown ART node type %d\n", (int) node->type);
+	}
+}
+
+// Put a child into a sorted array of keys and children, that has space for it
+static void sorted_insert(uint8_t *keys, art_ptr *children, unsigned count, uint8_t byte, art_ptr child) {
+	unsigned pos = 0;
+	while (pos < count && keys[pos] < byte)
+		pos ++;
+	memmove(keys + pos + 1, keys + pos, count - pos);
+	memmove(children + pos + 1, children + pos, (count - pos) * sizeof *children);
+	keys[pos] = byte;
+	children[pos] = child;
+}
+
+/*
+ * Add a child to the node (which is stored in *ref). If the node is full, it is
+ * replaced by a larger one.
+ */
+static void child_add(struct trie *trie, art_ptr *ref, uint8_t byte, art_ptr child) {
+	struct art_node *node = *ref;
+	switch (node->type) {
+		case NODE_4: {
+			struct node_4 *n = (struct node_4 *) node;
+			if (node->count < 4) {
+				sorted_insert(n->keys, n->children, node->count ++, byte, child);
+				return;
+			}
+			ulog(LLOG_DEBUG_VERBOSE, "Growing ART node to 16\n");
+			struct node_16 *bigger = (struct node_16 *) node_new(trie, NODE_16, node->prefix, node->prefix_len);
+			bigger->header.leaf = node->leaf;
+			bigger->header.count = node->count;
+			memcpy(bigger->keys, n->keys, sizeof n->keys);
+			memcpy(bigger->children, n->children, sizeof n->children);
+			node_free(trie, node);
+			*ref = bigger;
+			child_add(trie, ref, byte, child);
+			return;
+		}
+		case NODE_16: {
+			struct node_16 *n = (struct node_16 *) node;
+			if (node->count < 16) {
+				sorted_insert(n->keys, n->children, node->count ++, byte, child);
+				return;
+			}
+			ulog(LLOG_DEBUG_VERBOSE, "Growing ART node to 48\n");
+			struct node_48 *bigger = (struct node_48 *) node_new(trie, NODE_48, node->prefix, node->prefix_len);
+			bigger->header.leaf = node->leaf;
+			bigger->header.count = node->count;
+			for (unsigned i = 0; i < node->count; i ++) {
+				bigger->index[n->keys[i]] = i + 1;
+				bigger->children[i] = n->children[i];
+			}
+			node_free(trie, node);
+			*ref = bigger;
+			child_add(trie, ref, byte, child);
+			return;
+		}
+		case NODE_48: {
+			struct node_48 *n = (struct node_48 *) node;
+			if (node->count < 48) {
+				// The children are kept compact on removal, so the first free slot is at the end
+				n->children[node->count] = child;
+				n->index[byte] = ++ node->count;
+				return;
+			}
+			ulog(LLOG_DEBUG_VERBOSE, "Growing ART node to 256\n");
+			struct node_256 *bigger = (struct node_256 *) node_new(trie, NODE_256, node->prefix, node->prefix_len);
+			bigger->header.leaf = node->leaf;
+			bigger->header.count = node->count;
+			for (unsigned i = 0; i < 256; i ++)
+				if (n->index[i])
+					bigger->children[i] = n->children[n->index[i] - 1];
+			node_free(trie, node);
+			*ref = bigger;
+			child_add(trie, ref, byte, child);
+			return;
+		}
+		case NODE_256: {
+			struct node_256 *n = (struct node_256 *) node;
+			assert(!n->children[byte]);
+			n->children[byte] = child;
+			node->count ++;
+			return;
+		}
+		default:
+			insane("Unknown ART node type %d\n", (int) node->type);
+	}
+}
+
+/*
+ * Place a leaf into a fresh node, at the given depth. It is either the leaf of
+ * the node (if the key ends there) or its child.
+ */
+static void leaf_place(struct trie *trie, art_ptr *ref, struct art_leaf *leaf, size_t depth) {
+	struct art_node *node = *ref;
+	if (leaf->key_size == depth) {
+		assert(!node->leaf);
+		node->leaf = leaf;
+	} else {
+		child_add(trie, ref, leaf->key[depth], leaf_ptr(leaf));
+	}
+}
+
+static struct trie_data **art_index(struct trie *trie, const uint8_t *key, size_t key_size, bool insert_new) {
+	art_ptr *ref = &trie->root;
+	size_t depth = 0;
+	for (;;) {
+		if (!*ref) {
+			if (!insert_new)
+				return NULL;
+			struct art_leaf *leaf = leaf_new(trie, key, key_size);
+			*ref = leaf_ptr(leaf);
+			return &leaf->data;
+		}
+		if (is_leaf(*ref)) {
+			struct art_leaf *old = as_leaf(*ref);
+			if (leaf_matches(old, key, key_size)) {
+				ulog(LLOG_DEBUG_VERBOSE, "Trie exact hit\n");
+				return &leaf_touch(trie, old)->data;
+			}
+			if (!insert_new)
+				return NULL;
+			// Replace the leaf by a node holding both the keys, branching where they differ
+			size_t prefix = lcp(old->key + depth, old->key_size - depth, key + depth, key_size - depth);
+			ulog(LLOG_DEBUG_VERBOSE, "Splitting leaf after %zu bytes\n", prefix);
+			*ref = node_new(trie, NODE_4, prefix_copy(trie, key + depth, prefix), prefix);
+			struct art_leaf *leaf = leaf_new(trie, key, key_size);
+			leaf_place(trie, ref, old, depth + prefix);
+			leaf_place(trie, ref, leaf, depth + prefix);
+			return &leaf->data;
+		}
+		struct art_node *node = *ref;
+		if (node->prefix_len) {
+			size_t prefix = lcp(node->prefix, node->prefix_len, key + depth, key_size - depth);
+			if (prefix < node->prefix_len) {
+				if (!insert_new)
+					return NULL;
+				// The key leaves the path in the middle of the prefix, put a node there
+				ulog(LLOG_DEBUG_VERBOSE, "Splitting prefix of %zu bytes after %zu bytes\n", node->prefix_len, prefix);
+				*ref = node_new(trie, NODE_4, node->prefix, prefix);
+				uint8_t byte = node->prefix[prefix];
+				node->prefix += prefix + 1;
+				node->prefix_len -= prefix + 1;
+				child_add(trie, ref, byte, node);
+				struct art_leaf *leaf = leaf_new(trie, key, key_size);
+				leaf_place(trie, ref, leaf, depth + prefix);
+				return &leaf->data;
+			}
+			depth += prefix;
+		}
+		if (depth == key_size) {
+			if (!node->leaf) {
+				if (!insert_new)
+					return NULL;
+				node->leaf = leaf_new(trie, key, key_size);
+			} else {
+				leaf_touch(trie, node->leaf);
+			}
+			return &node->leaf->data;
+		}
+		art_ptr *child = child_find(node, key[depth]);
+		if (!child) {
+			if (!insert_new)
+				return NULL;
+			struct art_leaf *leaf = leaf_new(trie, key, key_size);
+			child_add(trie, ref, key[depth], leaf_ptr(leaf));
+			return &leaf->data;
+		}
+		ref = child;
+		depth ++;
+	}
+}
+
+struct trie_data **trie_index(struct trie *trie, const uint8_t *key, size_t key_size) {
+	ulog(LLOG_DEBUG_VERBOSE, "Indexing trie by %zu bytes of key\n", key_size);
+	trie->modifications ++;
+	if (key_size > trie->max_key_len)
+		trie->max_key_len = key_size;
+	return art_index(trie, key, key_size, true);
+}
+
+struct trie_data *trie_lookup(struct trie *trie, const uint8_t *key, size_t key_size) {
+	ulog(LLOG_DEBUG_VERBOSE, "Looking up in trie with %zu bytes of key\n", key_size);
+	trie->modifications ++; // It doesn't change the tree here, but it does in trie.c, so keep the same rules
+	struct trie_data **data = art_index(trie, key, key_size, false);
+	if (data)
+		return *data;
+	else
+		return NULL;
+}
+
+// Remove the child for the given byte from the node, keeping the arrays compact
+static void child_remove(struct art_node *node, uint8_t byte) {
+	switch (node->type) {
+		case NODE_4:
+		case NODE_16: {
+			uint8_t *keys = node->type == NODE_4 ? ((struct node_4 *) node)->keys : ((struct node_16 *) node)->keys;
+			art_ptr *children = node->type == NODE_4 ? ((struct node_4 *) node)->children : ((struct node_16 *) node)->children;
+			unsigned pos = 0;
+			while (keys[pos] != byte)
+				pos ++;
+			assert(pos < node->count);
+			node->count --;
+			memmove(keys + pos, keys + pos + 1, node->count - pos);
+			memmove(children + pos, children + pos + 1, (node->count - pos) * sizeof *children);
+			return;
+		}
+		case NODE_48: {
+			struct node_48 *n = (struct node_48 *) node;
+			unsigned pos = n->index[byte] - 1;
+			assert(n->index[byte]);
+			n->index[byte] = 0;
+			node->count --;
+			if (pos != node->count) {
+				// Move the last child into the hole
+				n->children[pos] = n->children[node->count];
+				for (unsigned i = 0; i < 256; i ++)
+					if (n->index[i] == node->count + 1) {
+						n->index[i] = pos + 1;
+						break;
+					}
+			}
+			return;
+		}
+		case NODE_256: {
+			struct node_256 *n = (struct node_256 *) node;
+			assert(n->children[byte]);
+			n->children[byte] = NULL;
+			node->count --;
+			return;
+		}
+		default:
+			insane("Unknown ART node type %d\n", (int) node->type);
+	}
+}
+
+// Provide the first child of a node and its byte
+static art_ptr child_first(struct art_node *node, uint8_t *byte) {
+	switch (node->type) {
+		case NODE_4:
+			*byte = ((struct node_4 *) node)->keys[0];
+			return ((struct node_4 *) node)->children[0];
+		case NODE_16:
+			*byte = ((struct node_16 *) node)->keys[0];
+			return ((struct node_16 *) node)->children[0];
+		case NODE_48: {
+			struct node_48 *n = (struct node_48 *) node;
+			for (unsigned i = 0; i < 256; i ++)
+				if (n->index[i]) {
+					*byte = i;
+					return n->children[n->index[i] - 1];
+				}
+			break;
+		}
+		case NODE_256: {
+			struct node_256 *n = (struct node_256 *) node;
+			for (unsigned i = 0; i < 256; i ++)
+				if (n->children[i]) {
+					*byte = i;
+					return n->children[i];
+				}
+			break;
+		}
+		default:
+			insane("Unknown ART node type %d\n", (int) node->type);
+	}
+	insane("No child in ART node\n");
+}
+
+/*
+ * Something was removed from the node in *ref. If there's only one thing left
+ * in it, replace the node by it. Otherwise, shrink it if it's too large.
+ */
+static void node_compact(struct trie *trie, art_ptr *ref) {
+	struct art_node *node = *ref;
+	if (!node->count) {
+		assert(node->leaf);
+		*ref = leaf_ptr(node->leaf);
+		node_free(trie, node);
+		return;
+	}
+	if (node->count == 1 && !node->leaf) {
+		uint8_t byte;
+		art_ptr child = child_first(node, &byte);
+		if (!is_leaf(child)) {
+			// The child gets the whole path from the node
+			struct art_node *c = child;
+			size_t prefix_len = node->prefix_len + 1 + c->prefix_len;
+			uint8_t *prefix = mem_pool_alloc(trie->pool, prefix_len);
+			if (node->prefix_len)
+				memcpy(prefix, node->prefix, node->prefix_len);
+			prefix[node->prefix_len] = byte;
+			if (c->prefix_len)
+				memcpy(prefix + node->prefix_len + 1, c->prefix, c->prefix_len);
+			c->prefix = prefix;
+			c->prefix_len = prefix_len;
+		}
+		*ref = child;
+		node_free(trie, node);
+		return;
+	}
+	switch (node->type) {
+		case NODE_16:
+			if (node->count <= 3) {
+				ulog(LLOG_DEBUG_VERBOSE, "Shrinking ART node to 4\n");
+				struct node_16 *n = (struct node_16 *) node;
+				struct node_4 *smaller = (struct node_4 *) node_new(trie, NODE_4, node->prefix, node->prefix_len);
+				smaller->header.leaf = node->leaf;
+				smaller->header.count = node->count;
+				memcpy(smaller->keys, n->keys, node->count);
+				memcpy(smaller->children, n->children, node->count * sizeof *n->children);
+				node_free(trie, node);
+				*ref = smaller;
+			}
+			break;
+		case NODE_48:
+			if (node->count <= 12) {
+				ulog(LLOG_DEBUG_VERBOSE, "Shrinking ART node to 16\n");
+				struct node_48 *n = (struct node_48 *) node;
+				struct node_16 *smaller = (struct node_16 *) node_new(trie, NODE_16, node->prefix, node->prefix_len);
+				smaller->header.leaf = node->leaf;
+				for (unsigned i = 0; i < 256; i ++)
+					if (n->index[i]) {
+						smaller->keys[smaller->header.count] = i;
+						smaller->children[smaller->header.count ++] = n->children[n->index[i] - 1];
+					}
+				node_free(trie, node);
+				*ref = smaller;
+			}
+			break;
+		case NODE_256:
+			if (node->count <= 36) {
+				ulog(LLOG_DEBUG_VERBOSE, "Shrinking ART node to 48\n");
+				struct node_256 *n = (struct node_256 *) node;
+				struct node_48 *smaller = (struct node_48 *) node_new(trie, NODE_48, node->prefix, node->prefix_len);
+				smaller->header.leaf = node->leaf;
+				for (unsigned i = 0; i < 256; i ++)
+					if (n->children[i]) {
+						smaller->children[smaller->header.count] = n->children[i];
+						smaller->index[i] = ++ smaller->header.count;
+					}
+				node_free(trie, node);
+				*ref = smaller;
+			}
+			break;
+		default:
+			break;
+	}
+}
+
+bool trie_delete(struct trie *trie, const uint8_t *key, size_t key_size) {
+	ulog(LLOG_DEBUG_VERBOSE, "Deleting %zu bytes of key from trie\n", key_size);
+	trie->modifications ++;
+	art_ptr *parent_ref = NULL, *ref = &trie->root;
+	size_t depth = 0;
+	for (;;) {
+		if (!*ref)
+			return false;
+		if (is_leaf(*ref)) {
+			struct art_leaf *leaf = as_leaf(*ref);
+			if (!leaf_matches(leaf, key, key_size))
+				return false;
+			leaf_free(trie, leaf);
+			if (parent_ref) {
+				child_remove(*parent_ref, key[depth - 1]);
+				node_compact(trie, parent_ref);
+			} else {
+				*ref = NULL;
+			}
+			return true;
+		}
+		struct art_node *node = *ref;
+		if (lcp(node->prefix, node->prefix_len, key + depth, key_size - depth) < node->prefix_len)
+			return false;
+		depth += node->prefix_len;
+		if (depth == key_size) {
+			if (!node->leaf)
+				return false;
+			leaf_free(trie, node->leaf);
+			node->leaf = NULL;
+			node_compact(trie, ref);
+			return true;
+		}
+		art_ptr *child = child_find(node, key[depth]);
+		if (!child)
+			return false;
+		parent_ref = ref;
+		ref = child;
+		depth ++;
+	}
+}
+
+const uint8_t *trie_oldest(struct trie *trie, size_t *key_size, struct trie_data **data, struct mem_pool *temp_pool) {
+	assert(trie->ordered);
+	struct art_leaf *leaf = trie->oldest;
+	if (!leaf)
+		return NULL;
+	// Copy the key, the leaf may get reused once it is deleted
+	uint8_t *key = mem_pool_alloc(temp_pool, leaf->key_size + 1);
+	memcpy(key, leaf->key, leaf->key_size + 1);
+	*key_size = leaf->key_size;
+	*data = leaf->data;
+	return key;
+}
+
+void trie_walk_ordered(struct trie *trie, trie_walk_callback callback, void *userdata, struct mem_pool *temp_pool) {
+	if (!trie->ordered) {
+		trie_walk(trie, callback, userdata, temp_pool);
+		return;
+	}
+	ulog(LLOG_DEBUG, "Walking ordered trie with %zu active nodes\n", trie->active_count);
+	for (struct art_leaf *leaf = trie->oldest; leaf; leaf = leaf->newer)
+		callback(leaf->key, leaf->key_size, leaf->data, userdata);
+}
+
+// Provide the next child of the node after the position and move the position past it. NULL if there's none.
+static art_ptr child_next(const struct art_node *node, unsigned *pos) {
+	switch (node->type) {
+		case NODE_4:
+		case NODE_16: {
+			art_ptr const *children = node->type == NODE_4 ? ((const struct node_4 *) node)->children : ((const struct node_16 *) node)->children;
+			if (*pos >= node->count)
+				return NULL;
+			if (*pos + 1 < node->count)
+				__builtin_prefetch(as_leaf(children[*pos + 1]));
+			return children[(*pos) ++];
+		}
+		case NODE_48: {
+			const struct node_48 *n = (const struct node_48 *) node;
+			for (; *pos < 256; (*pos) ++)
+				if (n->index[*pos])
+					return n->children[n->index[(*pos) ++] - 1];
+			return NULL;
+		}
+		case NODE_256: {
+			const struct node_256 *n = (const struct node_256 *) node;
+			for (; *pos < 256; (*pos) ++)
+				if (n->children[*pos])
+					return n->children[(*pos) ++];
+			return NULL;
+		}
+		default:
+			insane("Unknown ART node type %d\n", (int) node->type);
+	}
+}
+
+// Position in one node on the path from the root
+struct iter_frame {
+	const struct art_node *node;
+	unsigned pos; // The next child to visit
+	bool leaf_done; // The node's own leaf was visited
+};
+
+struct trie_iter {
+	struct trie *trie;
+	size_t modifications;
+	art_ptr root_leaf; // If the whole trie is a single leaf, before it is visited
+	struct iter_frame *stack;
+	size_t depth;
+};
+
+struct trie_iter *trie_iter_begin(struct trie *trie, struct mem_pool *pool) {
+	struct trie_iter *iter = mem_pool_alloc(pool, sizeof *iter);
+	*iter = (struct trie_iter) {
+		.trie = trie,
+		.modifications = trie->modifications,
+		// Each level eats at least one byte of the key
+		.stack = mem_pool_alloc(pool, (trie->max_key_len + 2) * sizeof *iter->stack)
+	};
+	if (trie->root) {
+		if (is_leaf(trie->root))
+			iter->root_leaf = trie->root;
+		else
+			iter->stack[iter->depth ++] = (struct iter_frame) { .node = trie->root };
+	}
+	return iter;
+}
+
+static bool iter_leaf(const struct art_leaf *leaf, const uint8_t **key, size_t *key_size, struct trie_data **data) {
+	*key = leaf->key;
+	*key_size = leaf->key_size;
+	*data = leaf->data;
+	return true;
+}
+
+bool trie_iter_next(struct trie_iter *iter, const uint8_t **key, size_t *key_size, struct trie_data **data) {
+	sanity(iter->modifications == iter->trie->modifications, "Trie modified during iteration\n");
+	if (iter->root_leaf) {
+		const struct art_leaf *leaf = as_leaf(iter->root_leaf);
+		iter->root_leaf = NULL;
+		return iter_leaf(leaf, key, key_size, data);
+	}
+	// Depth-first, in the order of the bytes, without recursion
+	while (iter->depth) {
+		struct iter_frame *frame = &iter->stack[iter->depth - 1];
+		if (!frame->leaf_done) {
+			frame->leaf_done = true;
+			if (frame->node->leaf)
+				return iter_leaf(frame->node->leaf, key, key_size, data);
+		}
+		art_ptr child = child_next(frame->node, &frame->pos);
+		if (!child)
+			iter->depth --;
+		else if (is_leaf(child))
+			return iter_leaf(as_leaf(child), key, key_size, data);
+		else
+			iter->stack[iter->depth ++] = (struct iter_frame) { .node = child };
+	}
+	return false;
+}
+
+void trie_walk(struct trie *trie, trie_walk_callback callback, void *userdata, struct mem_pool *temp_pool) {
+	ulog(LLOG_DEBUG, "Walking trie with %zu active nodes\n", trie->active_count);
+	struct trie_iter *iter = trie_iter_begin(trie, temp_pool);
+	const uint8_t *key;
+	size_t key_size;
+	struct trie_data *data;
+	while (trie_iter_next(iter, &key, &key_size, &data))
+		callback(key, key_size, data, userdata);
+}
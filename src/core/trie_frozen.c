@@ -0,0 +1,251 @@
+/*
+    Ucollect - small utility for real-time analysis of network data
+    Copyright (C) 2015 CZ.NIC, z.s.p.o. (http://www.nic.cz/)
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+#include "trie_frozen.h"
+#include "trie.h"
+#include "mem_pool.h"
+#include "util.h"
+
+#include <string.h>
+#include <stdbool.h>
+#include <endian.h>
+
+#define CACHE_LINE 64
+// The first bytes of each key are kept as a number, to compare them fast
+#define HEAD_SIZE sizeof(uint64_t)
+// Limit of the directory size, 2^16 entries
+#define MAX_DIRECTORY_BITS 16
+
+// Keys of the same length
+struct frozen_group {
+	uint32_t key_size;
+	uint32_t count;
+	// Offsets from the start of the frozen trie
+	uint32_t directory; // Index of the first key for each value of the first directory_bits bits of the keys, and the end
+	uint32_t heads; // The first HEAD_SIZE bytes of the sorted keys, as big endian numbers
+	uint32_t tails; // The rest of the keys
+	uint32_t data;
+	unsigned directory_bits;
+};
+
+struct trie_frozen {
+	uint32_t group_count;
+	uint32_t count;
+	struct frozen_group groups[];
+};
+
+struct frozen_entry {
+	const uint8_t *key;
+	size_t key_size;
+	struct trie_data *data;
+};
+
+struct collect_data {
+	struct mem_pool *pool;
+	struct frozen_entry *entries;
+	size_t count;
+};
+
+static void collect(const uint8_t *key, size_t key_size, struct trie_data *data, void *userdata) {
+	struct collect_data *d = userdata;
+	if (!data)
+		return;
+	uint8_t *copy = mem_pool_alloc(d->pool, key_size + 1);
+	memcpy(copy, key, key_size);
+	d->entries[d->count ++] = (struct frozen_entry) {
+		.key = copy,
+		.key_size = key_size,
+		.data = data
+	};
+}
+
+static int entry_cmp(const void *_1, const void *_2) {
+	const struct frozen_entry *e1 = _1, *e2 = _2;
+	if (e1->key_size != e2->key_size)
+		return e1->key_size < e2->key_size ? -1 : 1;
+	return memcmp(e1->key, e2->key, e1->key_size);
+}
+
+// Get the keys of the trie, sorted by the length and then the bytes
+static struct frozen_entry *entries_get(struct trie *trie, size_t *count, struct mem_pool *temp_pool) {
+	struct collect_data d = {
+		.pool = temp_pool,
+		.entries = mem_pool_alloc(temp_pool, (trie_size(trie) + 1) * sizeof *d.entries)
+	};
+	trie_walk(trie, collect, &d, temp_pool);
+	qsort(d.entries, d.count, sizeof *d.entries, entry_cmp);
+	*count = d.count;
+	return d.entries;
+}
+
+static size_t align(size_t size, size_t to) {
+	return (size + to - 1) / to * to;
+}
+
+static size_t tail_size(size_t key_size) {
+	return key_size > HEAD_SIZE ? key_size - HEAD_SIZE : 0;
+}
+
+// The start of the key as a number. The padding by zeroes keeps the order of same-length keys.
+static uint64_t key_head(const uint8_t *key, size_t key_size) {
+	uint64_t head = 0;
+	if (key_size)
+		memcpy(&head, key, key_size < HEAD_SIZE ? key_size : HEAD_SIZE);
+	return be64toh(head);
+}
+
+// Have about one key per directory entry, but don't let the directory grow too large
+static unsigned directory_bits(size_t count) {
+	unsigned bits = 0;
+	while (bits < MAX_DIRECTORY_BITS && ((size_t) 1 << bits) < count)
+		bits ++;
+	return bits;
+}
+
+static size_t directory_index(uint64_t head, unsigned bits) {
+	// Shifting by 64 is undefined, so shift twice
+	return (head >> (HEAD_SIZE * 8 - 1 - bits)) >> 1;
+}
+
+// The layout of the block. Returns the total size.
+static size_t layout(const struct frozen_entry *entries, size_t count, struct frozen_group *groups, size_t *group_count) {
+	size_t gcount = 0;
+	for (size_t i = 0; i < count; i ++)
+		if (!i || entries[i].key_size != entries[i - 1].key_size)
+			gcount ++;
+	size_t pos = align(sizeof(struct trie_frozen) + gcount * sizeof(struct frozen_group), CACHE_LINE);
+	size_t g = 0;
+	for (size_t i = 0; i < count; g ++) {
+		size_t start = i;
+		while (i < count && entries[i].key_size == entries[start].key_size)
+			i ++;
+		struct frozen_group group = {
+			.key_size = entries[start].key_size,
+			.count = i - start,
+			.directory_bits = directory_bits(i - start)
+		};
+		group.directory = pos;
+		pos = align(pos + (((size_t) 1 << group.directory_bits) + 1) * sizeof(uint32_t), CACHE_LINE);
+		group.heads = pos;
+		pos = align(pos + group.count * sizeof(uint64_t), CACHE_LINE);
+		group.tails = pos;
+		pos = align(pos + group.count * tail_size(group.key_size), CACHE_LINE);
+		group.data = pos;
+		pos = align(pos + group.count * sizeof(struct trie_data *), CACHE_LINE);
+		if (groups)
+			groups[g] = group;
+	}
+	*group_count = gcount;
+	return pos;
+}
+
+size_t trie_frozen_size(struct trie *trie, struct mem_pool *temp_pool) {
+	size_t count, group_count;
+	const struct frozen_entry *entries = entries_get(trie, &count, temp_pool);
+	// Room to align the start
+	return layout(entries, count, NULL, &group_count) + CACHE_LINE - 1;
+}
+
+static void group_fill(const struct frozen_entry *sorted, uint8_t *base, const struct frozen_group *group) {
+	uint32_t *directory = (uint32_t *) (base + group->directory);
+	uint64_t *heads = (uint64_t *) (base + group->heads);
+	struct trie_data **data = (struct trie_data **) (base + group->data);
+	size_t tail = tail_size(group->key_size);
+	size_t entry = 0;
+	for (size_t i = 0; i < group->count; i ++) {
+		heads[i] = key_head(sorted[i].key, sorted[i].key_size);
+		if (tail)
+			memcpy(base + group->tails + i * tail, sorted[i].key + HEAD_SIZE, tail);
+		data[i] = sorted[i].data;
+		// Point the directory entries up to this one's to it
+		size_t index = directory_index(heads[i], group->directory_bits);
+		while (entry <= index)
+			directory[entry ++] = i;
+	}
+	while (entry <= ((size_t) 1 << group->directory_bits))
+		directory[entry ++] = group->count;
+}
+
+const struct trie_frozen *trie_freeze_into(struct trie *trie, void *buffer, size_t size, struct mem_pool *temp_pool) {
+	size_t count, group_count;
+	const struct frozen_entry *entries = entries_get(trie, &count, temp_pool);
+	layout(entries, count, NULL, &group_count);
+	struct frozen_group *groups = mem_pool_alloc(temp_pool, (group_count + 1) * sizeof *groups);
+	size_t needed = layout(entries, count, groups, &group_count);
+	uint8_t *base = (uint8_t *) align((uintptr_t) buffer, CACHE_LINE);
+	sanity(base + needed <= (uint8_t *) buffer + size, "Buffer of %zu bytes too small to freeze trie into, need %zu\n", size, needed);
+	ulog(LLOG_DEBUG, "Freezing trie with %zu keys in %zu groups into %zu bytes\n", count, group_count, needed);
+	struct trie_frozen *result = (struct trie_frozen *) base;
+	result->group_count = group_count;
+	result->count = count;
+	size_t start = 0;
+	for (size_t g = 0; g < group_count; g ++) {
+		result->groups[g] = groups[g];
+		group_fill(entries + start, base, &groups[g]);
+		start += groups[g].count;
+	}
+	return result;
+}
+
+const struct trie_frozen *trie_freeze(struct trie *trie, struct mem_pool *pool, struct mem_pool *temp_pool) {
+	size_t size = trie_frozen_size(trie, temp_pool);
+	return trie_freeze_into(trie, mem_pool_alloc(pool, size), size, temp_pool);
+}
+
+struct trie_data *trie_frozen_lookup(const struct trie_frozen *frozen, const uint8_t *key, size_t key_size) {
+	const struct frozen_group *group = NULL;
+	for (size_t i = 0; i < frozen->group_count; i ++)
+		if (frozen->groups[i].key_size == key_size) {
+			group = &frozen->groups[i];
+			break;
+		}
+	if (!group)
+		return NULL;
+	const uint8_t *base = (const uint8_t *) frozen;
+	const uint32_t *directory = (const uint32_t *) (base + group->directory);
+	const uint64_t *heads = (const uint64_t *) (base + group->heads);
+	const uint8_t *tails = base + group->tails;
+	size_t tail = tail_size(key_size);
+	uint64_t head = key_head(key, key_size);
+	// The directory tells the range of keys with the same first bits
+	size_t index = directory_index(head, group->directory_bits);
+	size_t pos = directory[index], count = directory[index + 1] - pos;
+	// Binary search for the first key not smaller. The compiler turns the condition into a conditional move.
+	if (tail) {
+		while (count > 1) {
+			size_t half = count / 2;
+			size_t mid = pos + half - 1;
+			bool smaller = heads[mid] < head || (heads[mid] == head && memcmp(tails + mid * tail, key + HEAD_SIZE, tail) < 0);
+			pos = smaller ? mid + 1 : pos;
+			count -= half;
+		}
+	} else {
+		while (count > 1) {
+			size_t half = count / 2;
+			pos = heads[pos + half - 1] < head ? pos + half : pos;
+			count -= half;
+		}
+	}
+	if (count && heads[pos] == head && (!tail || memcmp(tails + pos * tail, key + HEAD_SIZE, tail) == 0))
+		return ((struct trie_data * const *) (base + group->data))[pos];
+	return NULL;
+}
+
+size_t trie_frozen_count(const struct trie_frozen *frozen) {
+	return frozen->count;
+}
@@ -0,0 +1,61 @@
+/*
+    Ucollect - small utility for real-time analysis of network data
+    Copyright (C) 2015 CZ.NIC, z.s.p.o. (http://www.nic.cz/)
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+#ifndef UCOLLECT_CORE_TRIE_FROZEN_H
+#define UCOLLECT_CORE_TRIE_FROZEN_H
+
+/*
+ * A read-only copy of a trie, for sets that are built once (or updated
+ * rarely) and then looked up a lot, like the addresses in filters.
+ *
+ * The copy lives in a single cache-line aligned block of memory and holds
+ * offsets instead of pointers. The keys are grouped by their length and each
+ * group is a sorted array. A directory indexed by the first bits of the key
+ * tells where the keys starting with them are, and only this (usually short)
+ * range is binary searched. The first 8 bytes of the keys are compared as
+ * numbers, so the search has no data-dependent branches for keys up to that
+ * size. It works best with few different key lengths, which is the case of
+ * addresses.
+ *
+ * The keys with NULL data are not copied.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+struct trie;
+struct trie_data;
+struct trie_frozen;
+struct mem_pool;
+
+// Compute the size of the buffer needed to freeze the trie
+size_t trie_frozen_size(struct trie *trie, struct mem_pool *temp_pool) __attribute__((nonnull));
+/*
+ * Freeze the trie into the buffer, which must be at least trie_frozen_size
+ * large (it doesn't need to be aligned). The trie is not modified and can be
+ * thrown away.
+ */
+const struct trie_frozen *trie_freeze_into(struct trie *trie, void *buffer, size_t size, struct mem_pool *temp_pool) __attribute__((nonnull)) __attribute__((returns_nonnull));
+// Freeze the trie into memory from the pool
+const struct trie_frozen *trie_freeze(struct trie *trie, struct mem_pool *pool, struct mem_pool *temp_pool) __attribute__((nonnull)) __attribute__((returns_nonnull));
+// Find the data for the key, NULL if it's not there.
+struct trie_data *trie_frozen_lookup(const struct trie_frozen *frozen, const uint8_t *key, size_t key_size) __attribute__((nonnull(1))) __attribute__((pure));
+// Number of keys in the frozen trie
+size_t trie_frozen_count(const struct trie_frozen *frozen) __attribute__((nonnull)) __attribute__((pure));
+
+#endif
@@ -0,0 +1,118 @@
+/*
+    Ucollect - small utility for real-time analysis of network data
+    Copyright (C) 2015 CZ.NIC, z.s.p.o. (http://www.nic.cz/)
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+#include "trie_lpm.h"
+#include "mem_pool.h"
+#include "util.h"
+
+#include <string.h>
+
+// Bits per level of the trie
+#define STRIDE 4
+#define FANOUT (1 << STRIDE)
+
+// One inserted prefix. It can be referenced from several entries.
+struct lpm_route {
+	struct trie_lpm_data *data;
+	size_t bits;
+	unsigned first; // The first entry it covers in its node
+	struct lpm_route *next; // Next route ending in the same node
+};
+
+struct lpm_entry {
+	const struct lpm_route *route; // The longest prefix ending at this level and covering the entry
+	struct lpm_node *child;
+};
+
+struct lpm_node {
+	struct lpm_entry entries[FANOUT];
+	/*
+	 * All the routes ending in this node. The entries don't have to hold
+	 * them all, a route may be hidden by longer ones, but we still need to
+	 * find it when it is inserted again.
+	 */
+	struct lpm_route *routes;
+};
+
+struct trie_lpm {
+	struct lpm_node root;
+	struct mem_pool *pool;
+};
+
+struct trie_lpm *trie_lpm_alloc(struct mem_pool *pool) {
+	struct trie_lpm *result = mem_pool_alloc(pool, sizeof *result);
+	*result = (struct trie_lpm) {
+		.pool = pool
+	};
+	return result;
+}
+
+// Get the piece of key at given bit position (which is multiple of STRIDE)
+static unsigned nibble(const uint8_t *key, size_t pos) {
+	return (key[pos / 8] >> (8 - STRIDE - pos % 8)) & (FANOUT - 1);
+}
+
+struct trie_lpm_data **trie_lpm_insert(struct trie_lpm *lpm, const uint8_t *prefix, size_t bits) {
+	ulog(LLOG_DEBUG_VERBOSE, "Inserting prefix of %zu bits into LPM trie\n", bits);
+	struct lpm_node *node = &lpm->root;
+	size_t depth = 0;
+	// Descend to the level where the prefix ends
+	while (bits > depth + STRIDE) {
+		struct lpm_entry *entry = &node->entries[nibble(prefix, depth)];
+		if (!entry->child) {
+			entry->child = mem_pool_alloc(lpm->pool, sizeof *entry->child);
+			memset(entry->child, 0, sizeof *entry->child);
+		}
+		node = entry->child;
+		depth += STRIDE;
+	}
+	// The remaining bits select a range of entries
+	size_t rest = bits - depth;
+	unsigned first = rest ? nibble(prefix, depth) & ~((1U << (STRIDE - rest)) - 1) & (FANOUT - 1) : 0;
+	unsigned count = 1U << (STRIDE - rest);
+	for (struct lpm_route *present = node->routes; present; present = present->next)
+		if (present->bits == bits && present->first == first)
+			return &present->data;
+	struct lpm_route *route = mem_pool_alloc(lpm->pool, sizeof *route);
+	*route = (struct lpm_route) {
+		.bits = bits,
+		.first = first,
+		.next = node->routes
+	};
+	node->routes = route;
+	for (unsigned i = first; i < first + count; i ++) {
+		struct lpm_entry *entry = &node->entries[i];
+		// Don't overwrite longer prefixes expanded here before
+		if (!entry->route || entry->route->bits < bits)
+			entry->route = route;
+	}
+	return &route->data;
+}
+
+struct trie_lpm_data *trie_lpm_lookup(const struct trie_lpm *lpm, const uint8_t *addr, size_t bits) {
+	const struct lpm_node *node = &lpm->root;
+	const struct lpm_route *best = NULL;
+	for (size_t depth = 0; node && depth < bits; depth += STRIDE) {
+		const struct lpm_entry *entry = &node->entries[nibble(addr, depth)];
+		// A prefix longer than the address may be in the last entry, ignore it
+		if (entry->route && entry->route->bits <= bits)
+			best = entry->route;
+		node = entry->child;
+	}
+	return best ? best->data : NULL;
+}
@@ -0,0 +1,63 @@
+/*
+    Ucollect - small utility for real-time analysis of network data
+    Copyright (C) 2015 CZ.NIC, z.s.p.o. (http://www.nic.cz/)
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+#ifndef UCOLLECT_CORE_TRIE_LPM_H
+#define UCOLLECT_CORE_TRIE_LPM_H
+
+/*
+ * A trie for the longest prefix match on bit strings, like CIDR ranges of
+ * IP addresses. Unlike the trie.h one, the prefixes can end in the middle
+ * of a byte.
+ *
+ * Each node branches on 4 bits of the address. A prefix whose length is not
+ * a multiple of 4 is expanded into all the branches it covers (a longer
+ * prefix in the same branch wins). A lookup therefore takes at most one step
+ * per 4 bits of the address, no matter how many prefixes there are.
+ *
+ * There are no deletions. Build a new one if the set of prefixes changes.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+// User data to store for each prefix. Each module/plugin can have different implementation.
+struct trie_lpm_data;
+// Opaque handle to the trie.
+struct trie_lpm;
+
+struct mem_pool;
+
+/*
+ * Allocate a new empty trie, using the memory pool for its structures.
+ * Reset the pool to get rid of it.
+ */
+struct trie_lpm *trie_lpm_alloc(struct mem_pool *pool) __attribute__((nonnull)) __attribute__((malloc)) __attribute__((returns_nonnull));
+/*
+ * Add a prefix of the given number of bits (the rest of the last byte is
+ * ignored). Returns the place for the data of the prefix, which is NULL the
+ * first time the prefix is inserted. The caller is expected to set it. The
+ * pointer is valid until the trie is destroyed.
+ */
+struct trie_lpm_data **trie_lpm_insert(struct trie_lpm *lpm, const uint8_t *prefix, size_t bits) __attribute__((nonnull(1)));
+/*
+ * Find the data of the longest inserted prefix of the address (which is
+ * bits long). Returns NULL if there's no such prefix.
+ */
+struct trie_lpm_data *trie_lpm_lookup(const struct trie_lpm *lpm, const uint8_t *addr, size_t bits) __attribute__((nonnull(1))) __attribute__((pure));
+
+#endif
@@ -0,0 +1,92 @@
+/*
+    Ucollect - small utility for real-time analysis of network data
+    Copyright (C) 2015 CZ.NIC, z.s.p.o. (http://www.nic.cz/)
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "trie_lpm.h"
+#include "mem_pool.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+
+/*
+ * Checks of the longest prefix match trie, mostly about the overlapping
+ * prefixes. It exits with an error at the first failure.
+ */
+
+struct trie_lpm_data {
+	const char *name;
+};
+
+#define CHECK(COND) do { if (!(COND)) die("Check failed at line %d: %s\n", __LINE__, #COND); } while (0)
+
+static struct trie_lpm_data *set(struct trie_lpm *lpm, struct mem_pool *pool, const uint8_t *prefix, size_t bits, const char *name) {
+	struct trie_lpm_data **slot = trie_lpm_insert(lpm, prefix, bits);
+	CHECK(!*slot);
+	*slot = mem_pool_alloc(pool, sizeof **slot);
+	(*slot)->name = name;
+	return *slot;
+}
+
+static const char *lookup(struct trie_lpm *lpm, uint8_t a, uint8_t b, uint8_t c, uint8_t d) {
+	const uint8_t addr[] = { a, b, c, d };
+	const struct trie_lpm_data *data = trie_lpm_lookup(lpm, addr, 32);
+	return data ? data->name : NULL;
+}
+
+static bool is(const char *name, const char *expected) {
+	return name == expected || (name && expected && strcmp(name, expected) == 0);
+}
+
+int main(int argc, const char *argv[]) {
+	(void) argc;
+	(void) argv;
+	struct mem_pool *pool = mem_pool_create("LPM test");
+	struct trie_lpm *lpm = trie_lpm_alloc(pool);
+	const uint8_t net8[] = { 8, 0, 0, 0 };
+	// A shorter prefix, then a longer one expanded into its first entry, then the shorter one again
+	struct trie_lpm_data *short_data = set(lpm, pool, net8, 6, "8/6");
+	struct trie_lpm_data *long_data = set(lpm, pool, net8, 8, "8/8");
+	CHECK(*trie_lpm_insert(lpm, net8, 6) == short_data);
+	CHECK(*trie_lpm_insert(lpm, net8, 8) == long_data);
+	CHECK(is(lookup(lpm, 8, 1, 2, 3), long_data->name));
+	CHECK(is(lookup(lpm, 9, 1, 2, 3), short_data->name));
+	CHECK(is(lookup(lpm, 11, 255, 255, 255), short_data->name));
+	CHECK(is(lookup(lpm, 12, 0, 0, 0), NULL));
+	// A prefix completely hidden by longer ones is still found when inserted again
+	const uint8_t net16[] = { 16, 0, 0, 0 }, net20[] = { 20, 0, 0, 0 };
+	struct trie_lpm_data *hidden = set(lpm, pool, net16, 5, "16/5");
+	set(lpm, pool, net16, 6, "16/6");
+	set(lpm, pool, net20, 6, "20/6");
+	CHECK(*trie_lpm_insert(lpm, net16, 5) == hidden);
+	CHECK(is(lookup(lpm, 17, 0, 0, 0), "16/6"));
+	CHECK(is(lookup(lpm, 23, 0, 0, 0), "20/6"));
+	// Prefixes longer than a byte and the default route
+	const uint8_t net10[] = { 10, 200, 0, 0 }, any[] = { 0, 0, 0, 0 };
+	set(lpm, pool, net10, 13, "10.200/13");
+	set(lpm, pool, any, 0, "default");
+	CHECK(*trie_lpm_insert(lpm, net10, 13) == *trie_lpm_insert(lpm, net10, 13));
+	CHECK(is(lookup(lpm, 10, 207, 1, 1), "10.200/13"));
+	CHECK(is(lookup(lpm, 10, 208, 1, 1), short_data->name));
+	CHECK(is(lookup(lpm, 192, 168, 1, 1), "default"));
+	CHECK(is(lookup(lpm, 8, 1, 2, 3), long_data->name));
+	mem_pool_destroy(pool);
+	printf("OK\n");
+	return 0;
+}
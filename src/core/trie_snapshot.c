@@ -0,0 +1,288 @@
+/*
+    Ucollect - small utility for real-time analysis of network data
+    Copyright (C) 2015 CZ.NIC, z.s.p.o. (http://www.nic.cz/)
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+#include "trie_snapshot.h"
+#include "trie.h"
+#include "mem_pool.h"
+#include "util.h"
+#include "tunable.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SNAPSHOT_MAGIC "UCTRIE\n"
+// Increment on any change of the file layout
+#define SNAPSHOT_FORMAT 2
+// The boot ID is a UUID in text form (36 characters), with space left for the terminating zero and padding
+#define BOOT_ID_SIZE 40
+// The keys and blobs are padded to this, so the blobs are aligned in the mapped file
+#define SNAPSHOT_ALIGN 8
+
+struct snapshot_header {
+	char magic[8];
+	uint32_t format; // Also tells if the byte order matches
+	uint32_t version; // Provided by the plugin
+	uint64_t timestamp; // The wall clock time of writing
+	uint64_t count; // Number of records
+	uint64_t size; // Size of the whole file, to detect truncation
+	char boot_id[BOOT_ID_SIZE]; // The boot the snapshot was written in
+};
+
+// Followed by the key and the blob, each padded to SNAPSHOT_ALIGN
+struct snapshot_record {
+	uint32_t key_size;
+	uint32_t blob_size;
+};
+
+static size_t padded(size_t size) {
+	return (size + SNAPSHOT_ALIGN - 1) / SNAPSHOT_ALIGN * SNAPSHOT_ALIGN;
+}
+
+// A relative path is taken inside the SNAPSHOT_DIR
+static const char *full_path(const char *path, char *buffer) {
+	if (*path == '/')
+		return path;
+	snprintf(buffer, PATH_MAX + 1, SNAPSHOT_DIR "/%s", path);
+	return buffer;
+}
+
+/*
+ * Get the ID of the current boot from the kernel. The data may hold times of
+ * the monotonic clock, which start over with each boot, so a snapshot is
+ * valid only within the boot it was written in.
+ */
+static bool boot_id_get(char *buffer) {
+	memset(buffer, 0, BOOT_ID_SIZE);
+	int fd = open("/proc/sys/kernel/random/boot_id", O_RDONLY);
+	if (fd == -1) {
+		ulog(LLOG_ERROR, "Couldn't open the boot ID: %s\n", strerror(errno));
+		return false;
+	}
+	ssize_t result = read(fd, buffer, BOOT_ID_SIZE - 1);
+	if (result == -1)
+		ulog(LLOG_ERROR, "Couldn't read the boot ID: %s\n", strerror(errno));
+	close(fd);
+	if (result <= 0)
+		return false;
+	// Drop the newline
+	buffer[strcspn(buffer, "\n")] = '\0';
+	return true;
+}
+
+struct save_context {
+	FILE *file;
+	trie_snapshot_encode encode;
+	void *userdata;
+	uint64_t count;
+	uint64_t size;
+	bool failed;
+};
+
+static bool write_padded(FILE *file, const void *data, size_t size) {
+	static const uint8_t zeroes[SNAPSHOT_ALIGN];
+	if (size && fwrite(data, size, 1, file) != 1)
+		return false;
+	size_t padding = padded(size) - size;
+	return !padding || fwrite(zeroes, padding, 1, file) == 1;
+}
+
+static void save_key(const uint8_t *key, size_t key_size, struct trie_data *data, void *userdata) {
+	struct save_context *context = userdata;
+	if (context->failed)
+		return;
+	size_t blob_size = 0;
+	const void *blob = context->encode(key, key_size, data, &blob_size, context->userdata);
+	if (!blob)
+		return;
+	sanity(key_size <= UINT32_MAX && blob_size <= UINT32_MAX, "Too large key (%zu) or blob (%zu) for snapshot\n", key_size, blob_size);
+	const struct snapshot_record record = {
+		.key_size = key_size,
+		.blob_size = blob_size
+	};
+	if (!write_padded(context->file, &record, sizeof record) || !write_padded(context->file, key, key_size) || !write_padded(context->file, blob, blob_size)) {
+		context->failed = true;
+		return;
+	}
+	context->count ++;
+	context->size += sizeof record + padded(key_size) + padded(blob_size);
+}
+
+bool trie_snapshot_save(struct trie *trie, const char *path, uint32_t version, bool sync, trie_snapshot_encode encode, void *userdata, struct mem_pool *temp_pool) {
+	struct snapshot_header header = {
+		.magic = SNAPSHOT_MAGIC,
+		.format = SNAPSHOT_FORMAT,
+		.version = version,
+		.timestamp = time(NULL)
+	};
+	// Without the boot ID the snapshot couldn't be loaded anyway
+	if (!boot_id_get(header.boot_id))
+		return false;
+	if (*path != '/' && mkdir(SNAPSHOT_DIR, 0700) == -1 && errno != EEXIST) {
+		ulog(LLOG_ERROR, "Couldn't create snapshot directory " SNAPSHOT_DIR ": %s\n", strerror(errno));
+		return false;
+	}
+	char buffer[PATH_MAX + 1];
+	path = full_path(path, buffer);
+	/*
+	 * A fresh file with an unpredictable name, readable only by us. Don't
+	 * reuse whatever lies at a fixed name, it may be a link planted by
+	 * someone else.
+	 */
+	char *tmp_path = mem_pool_printf(temp_pool, "%s.XXXXXX", path);
+	int fd = mkstemp(tmp_path);
+	if (fd == -1) {
+		ulog(LLOG_ERROR, "Couldn't create snapshot file %s: %s\n", tmp_path, strerror(errno));
+		return false;
+	}
+	FILE *file = fdopen(fd, "w");
+	if (!file) {
+		ulog(LLOG_ERROR, "Couldn't open snapshot file %s: %s\n", tmp_path, strerror(errno));
+		close(fd);
+		unlink(tmp_path);
+		return false;
+	}
+	struct save_context context = {
+		.file = file,
+		.encode = encode,
+		.userdata = userdata,
+		.size = sizeof header
+	};
+	// Reserve the place for the header, it is written once the counts are known
+	if (fwrite(&header, sizeof header, 1, file) != 1)
+		context.failed = true;
+	else
+		// Oldest first, so loading it back restores the order of an ordered trie
+		trie_walk_ordered(trie, save_key, &context, temp_pool);
+	if (!context.failed) {
+		header.count = context.count;
+		header.size = context.size;
+		context.failed = fseek(file, 0, SEEK_SET) == -1 || fwrite(&header, sizeof header, 1, file) != 1 || fflush(file) == EOF || (sync && fsync(fileno(file)) == -1);
+	}
+	if (context.failed)
+		ulog(LLOG_ERROR, "Couldn't write snapshot file %s: %s\n", tmp_path, strerror(errno));
+	if (fclose(file) == EOF && !context.failed) {
+		ulog(LLOG_ERROR, "Couldn't close snapshot file %s: %s\n", tmp_path, strerror(errno));
+		context.failed = true;
+	}
+	if (!context.failed && rename(tmp_path, path) == -1) {
+		ulog(LLOG_ERROR, "Couldn't move snapshot file %s to %s: %s\n", tmp_path, path, strerror(errno));
+		context.failed = true;
+	}
+	if (context.failed) {
+		unlink(tmp_path);
+		return false;
+	}
+	ulog(LLOG_DEBUG, "Saved %" PRIu64 " keys (%" PRIu64 " bytes) to snapshot %s\n", context.count, context.size, path);
+	return true;
+}
+
+// Check the records fit into the file, before any of them is used
+static bool records_valid(const uint8_t *records, size_t size, uint64_t count) {
+	for (uint64_t i = 0; i < count; i ++) {
+		struct snapshot_record record;
+		if (size < sizeof record)
+			return false;
+		memcpy(&record, records, sizeof record);
+		records += sizeof record;
+		size -= sizeof record;
+		// Check the raw sizes first, the padding could overflow on huge ones
+		if (record.key_size > size || record.blob_size > size - record.key_size)
+			return false;
+		size_t data_size = padded(record.key_size) + padded(record.blob_size);
+		if (size < data_size)
+			return false;
+		records += data_size;
+		size -= data_size;
+	}
+	return size == 0;
+}
+
+size_t trie_snapshot_load(struct trie *trie, const char *path, uint32_t version, uint64_t max_age, trie_snapshot_decode decode, void *userdata) {
+	char buffer[PATH_MAX + 1];
+	path = full_path(path, buffer);
+	int fd = open(path, O_RDONLY | O_NOFOLLOW);
+	if (fd == -1) {
+		if (errno != ENOENT)
+			ulog(LLOG_WARN, "Couldn't open snapshot file %s: %s\n", path, strerror(errno));
+		return 0;
+	}
+	struct stat st;
+	if (fstat(fd, &st) == -1) {
+		ulog(LLOG_WARN, "Couldn't stat snapshot file %s: %s\n", path, strerror(errno));
+		close(fd);
+		return 0;
+	}
+	// The data are trusted when loading, so accept only a file nobody else could have written
+	if (!S_ISREG(st.st_mode) || st.st_uid != geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH))) {
+		ulog(LLOG_WARN, "Snapshot file %s is not a regular file private to us, ignoring\n", path);
+		close(fd);
+		return 0;
+	}
+	size_t size = st.st_size;
+	if (size < sizeof(struct snapshot_header)) {
+		ulog(LLOG_WARN, "Snapshot file %s is too short (%zu bytes)\n", path, size);
+		close(fd);
+		return 0;
+	}
+	const uint8_t *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd); // The mapping holds the file
+	if (map == MAP_FAILED) {
+		ulog(LLOG_WARN, "Couldn't map snapshot file %s: %s\n", path, strerror(errno));
+		return 0;
+	}
+	size_t loaded = 0;
+	const struct snapshot_header *header = (const struct snapshot_header *)map;
+	uint64_t now = time(NULL);
+	char boot_id[BOOT_ID_SIZE];
+	if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof header->magic) != 0 || header->format != SNAPSHOT_FORMAT) {
+		ulog(LLOG_WARN, "File %s is not a snapshot of this format\n", path);
+	} else if (header->version != version) {
+		ulog(LLOG_INFO, "Ignoring snapshot %s of version %u, expected %u\n", path, (unsigned)header->version, (unsigned)version);
+	} else if (!boot_id_get(boot_id) || memcmp(header->boot_id, boot_id, BOOT_ID_SIZE) != 0) {
+		ulog(LLOG_INFO, "Ignoring snapshot %s from a different boot\n", path);
+	} else if (max_age && now > header->timestamp && now - header->timestamp > max_age) {
+		ulog(LLOG_INFO, "Ignoring snapshot %s, it is %" PRIu64 " seconds old\n", path, now - header->timestamp);
+	} else if (header->size != size || !records_valid(map + sizeof *header, size - sizeof *header, header->count)) {
+		ulog(LLOG_WARN, "Snapshot file %s is corrupted\n", path);
+	} else {
+		const uint8_t *pos = map + sizeof *header;
+		for (uint64_t i = 0; i < header->count; i ++) {
+			struct snapshot_record record;
+			memcpy(&record, pos, sizeof record);
+			const uint8_t *key = pos + sizeof record;
+			const uint8_t *blob = key + padded(record.key_size);
+			pos = blob + padded(record.blob_size);
+			struct trie_data *data = decode(key, record.key_size, blob, record.blob_size, userdata);
+			if (!data)
+				continue;
+			*trie_index(trie, key, record.key_size) = data;
+			loaded ++;
+		}
+		ulog(LLOG_INFO, "Loaded %zu keys from snapshot %s\n", loaded, path);
+	}
+	munmap((void *)map, size);
+	return loaded;
+}
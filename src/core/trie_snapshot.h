@@ -0,0 +1,79 @@
+/*
+    Ucollect - small utility for real-time analysis of network data
+    Copyright (C) 2015 CZ.NIC, z.s.p.o. (http://www.nic.cz/)
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+#ifndef UCOLLECT_CORE_TRIE_SNAPSHOT_H
+#define UCOLLECT_CORE_TRIE_SNAPSHOT_H
+
+/*
+ * Saving the content of a trie into a file and loading it back, so a plugin
+ * doesn't lose its data when ucollect restarts.
+ *
+ * The file is written into a temporary one first (created with a random name
+ * next to it and readable only by the owner) and then renamed over the old
+ * one, so there's always either the old or the new complete snapshot. Only a
+ * regular file owned by the same user and not writable by others is loaded.
+ * A relative path is taken inside the SNAPSHOT_DIR tunable, a directory
+ * private to ucollect that is created when saving if it doesn't exist yet.
+ *
+ * An ordered trie is saved from the oldest key to the newest one and the keys
+ * are inserted in the same order when loading, so the order survives.
+ * It is loaded by mapping it into memory, without parsing. The data of the
+ * keys are opaque to the snapshot, the plugin provides them as blobs of bytes
+ * when saving and turns them back into its data when loading.
+ *
+ * The file is in the native byte order and is not meant to be moved to
+ * another machine. Each snapshot carries a version provided by the plugin,
+ * the snapshot of a different version is not loaded. A snapshot is loaded
+ * only in the same boot it was written in (it carries the kernel's boot ID),
+ * so the data may contain times of the monotonic clock (like loop_now()).
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+struct trie;
+struct trie_data;
+struct mem_pool;
+
+/*
+ * Provide the bytes to store for the key. The result needs to live only until
+ * the next call. Returning NULL skips the key.
+ */
+typedef const void *(*trie_snapshot_encode)(const uint8_t *key, size_t key_size, struct trie_data *data, size_t *size, void *userdata);
+/*
+ * Make data for the key out of the stored bytes. The bytes are valid only
+ * during the call, so they need to be copied out. Returning NULL skips the key.
+ */
+typedef struct trie_data *(*trie_snapshot_decode)(const uint8_t *key, size_t key_size, const uint8_t *blob, size_t size, void *userdata);
+
+/*
+ * Save the trie to the file. With sync, the file is flushed to the disk
+ * before it replaces the old one, so it survives a power loss. It blocks the
+ * loop for a while, so it is better left out of frequent saves that protect
+ * only against a crash of ucollect. Returns if it was successful.
+ */
+bool trie_snapshot_save(struct trie *trie, const char *path, uint32_t version, bool sync, trie_snapshot_encode encode, void *userdata, struct mem_pool *temp_pool) __attribute__((nonnull(1, 2, 5, 7)));
+/*
+ * Load a snapshot from the file into the trie (the keys already there are
+ * overwritten). Snapshots of a different version or older than max_age
+ * seconds (if not 0) are ignored. Returns the number of keys loaded.
+ */
+size_t trie_snapshot_load(struct trie *trie, const char *path, uint32_t version, uint64_t max_age, trie_snapshot_decode decode, void *userdata) __attribute__((nonnull(1, 2, 5)));
+
+#endif
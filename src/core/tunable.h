@@ -26,11 +26,33 @@
 #define PCAP_TIMEOUT 100
 #define PCAP_BUFFER 3276800
 
+/*
+ * The TPACKET_V3 ring capture. The block size must be a multiple of page size
+ * and of the frame size. The whole ring is about the size of PCAP_BUFFER.
+ */
+#define RING_BLOCK_SIZE (1 << 17)
+#define RING_BLOCK_COUNT 25
+#define RING_FRAME_SIZE 2048
+// Hand a block over even if not full after this many milliseconds
+#define RING_BLOCK_TIMEOUT PCAP_TIMEOUT
+// How many blocks to process in one wakeup before looking at other events
+#define RING_MAX_BLOCKS 8
+/*
+ * How much to capture to get all the headers (link, VLAN tags, IP with options,
+ * possibly a tunnel and TCP with options). The plugins' payload needs are added.
+ */
+#define SNAPLEN_HEADERS 256
+
 // How many times a plugin may fail before we give up and disable it
 #define FAIL_COUNT 5
 // After how many milliseconds do we reset the count to zero?
 #define FAIL_COUNT_RESET (3600 * 1000)
 
+// How often to check the plugins fit into their memory budgets (milliseconds)
+#define MEMORY_CHECK_TIME 1000
+// The plugin is asked to free some memory when it uses this many percent of its budget
+#define MEMORY_SOFT_PERCENT 80
+
 /*
  * How long to wait before interface reconfiguration attempt happens (10s).
  * This is done if the interface breaks down (like when it is turned off).
@@ -44,6 +66,17 @@
 
 // For the memory pool
 #define PAGE_CACHE_SIZE 20
+/*
+ * The pools created for huge pages get memory in chunks of this size (and aligned
+ * to it), once they hold at least that much. Small tables stay on normal pages.
+ */
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+/*
+ * Where the trie snapshots of the plugins live, so their data survive a restart.
+ * Created (accessible only to us) if it doesn't exist.
+ */
+#define SNAPSHOT_DIR "/var/lib/ucollect"
 
 // Uplink compression level
 #define COMPRESSION_LEVEL 9
@@ -54,6 +87,17 @@
 // buffer of deflate(). There must be free space to store complete block header
 // (from 4 to 6 bytes) and some output. Do not use smaller buffers than 10 bytes.
 
+// Window of the zstd uplink compression (2^17 = 128kB), in both directions. The master uses the same.
+#define COMPRESSION_ZSTD_WINDOW_LOG 17
+
+/*
+ * The trained dictionary for the uplink compression, for the given protocol
+ * version. It is optional. The upper 16 bits of the dictionary ID need to be
+ * the protocol version.
+ */
+#define COMPRESSION_DICT_PATH "/usr/share/ucollect/uplink-%u.dict"
+#define COMPRESSION_DICT_MAX_SIZE (1024 * 1024)
+
 // Uplink reconnect times
 // First attempt after 2 seconds
 #define RECONNECT_BASE 2000
@@ -80,9 +124,18 @@
 // How many attempts to log in before giving up and exiting?
 #define LOGIN_FAILURE_LIMIT 10
 
+// Use the cheap coarse clock for the loop time if its resolution is at most this many nanoseconds
+#define COARSE_CLOCK_MAX_RES 10000000
+
 // Dump stats every hour
 #define STAT_DUMP_TIMEOUT (3600 * 1000)
 
+// Measure only every n-th call of the plugins' packet callbacks, reading the clock is not free
+#define CPU_PACKET_SAMPLE 64
+
+// Number of log2 buckets of the plugin callback duration histogram (in ns, the last one is 2^31 ns, about 2 seconds, and more)
+#define CPU_HISTOGRAM_BUCKETS 32
+
 // Base protocol version
 #define PROTOCOL_VERSION 1
 
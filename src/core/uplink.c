@@ -22,6 +22,7 @@
 #include "loop.h"
 #include "util.h"
 #include "context.h"
+#include "compress.h"
 
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -38,7 +39,6 @@
 #include <atsha204.h>
 #include <time.h>
 #include <stdio.h>
-#include <zlib.h>
 
 static void atsha_log_callback(const char *msg) {
 	ulog(LLOG_ERROR, "ATSHA: %s\n", msg);
@@ -95,10 +95,17 @@ struct uplink {
 	uint8_t address[IPV6_LEN];
 	enum auth_status auth_status;
 	size_t login_failure_count;
-	z_stream zstrm_send;
-	z_stream zstrm_recv;
+	struct compressor *compressor;
+	struct decompressor *decompressor;
+	// The codec the server picked, used once its current stream ends
+	struct decompressor *decompressor_next;
+	bool decompressor_ended; // The current stream ended, waiting for the switch to the next one
+	const uint8_t *dict; // The compression dictionary, if any
+	size_t dict_size;
+	uint32_t dict_id;
 	uint8_t *inc_buffer;
-	size_t inc_buffer_size;
+	const uint8_t *inc_pos; // Received data not yet decompressed
+	size_t inc_buffer_size, inc_available;
 	const char *status_file;
 };
 
@@ -129,12 +136,18 @@ static void dump_status(struct uplink *uplink) {
 		return;
 	}
 	fprintf(sf, "%s\t%llu\n", status, (unsigned long long)time(NULL));
+	// The rest of the lines are how much time and memory the plugins take
+	loop_cpu_stats_write(uplink->loop, sf);
+	loop_memory_stats_write(uplink->loop, sf);
 	if (fclose(sf) == EOF)
 		ulog(LLOG_WARN, "Error closing status file %s/%p: %s\n", uplink->status_file, (void *)sf, strerror(errno));
 }
 
 static void uplink_disconnect(struct uplink *uplink, bool reset_reconnect);
 static void connect_fail(struct uplink *uplink);
+static void compression_start(struct uplink *uplink);
+static void compression_stop(struct uplink *uplink);
+static void compression_switch(struct uplink *uplink);
 
 static void update_addrinfo(struct uplink *uplink) {
 	if (uplink->addrinfo) {
@@ -321,8 +334,7 @@ static void uplink_connect(struct uplink *uplink) {
 	uplink->ping_scheduled = true;
 	loop_register_fd(uplink->loop, uplink->fd, (struct epoll_handler *) uplink);
 	update_addrinfo(uplink);
-	deflateReset(&(uplink->zstrm_send));
-	inflateReset(&(uplink->zstrm_recv));
+	compression_start(uplink);
 }
 
 static void reconnect_now(struct context *unused, void *data, size_t id_unused) {
@@ -640,7 +652,10 @@ static void handle_buffer(struct uplink *uplink) {
 			char command = *uplink->buffer ++;
 			uplink->buffer_size --;
 			struct mem_pool *temp_pool = loop_temp_pool(uplink->loop);
-			if (uplink->auth_status == AUTHENTICATED || uplink->auth_status == SENT) {
+			if (command == 'Z') {
+				// The server picked a compression codec. It may come before the login.
+				compression_switch(uplink);
+			} else if (uplink->auth_status == AUTHENTICATED || uplink->auth_status == SENT) {
 				switch (command) {
 					case 'R': { // Route data to given plugin
 						uplink->login_failure_count = 0; // If we got data, we know the login was successful
@@ -776,29 +791,63 @@ static void handle_buffer(struct uplink *uplink) {
 	}
 }
 
-static enum rdd_status read_decompressed_data(struct uplink *uplink, ssize_t *available_output) {
-	// Update stream's output buffer according to uplink "request"
-	uplink->zstrm_recv.avail_out = (unsigned int)uplink->size_rest;
-	uplink->zstrm_recv.next_out = (unsigned char *)uplink->buffer_pos;
+/*
+ * Decompress from the data already received. Switches to the next codec when
+ * the current stream ends. Returns false if the data were broken (and the
+ * connection got closed).
+ */
+static bool decompress_received(struct uplink *uplink, ssize_t *available_output) {
+	for (;;) {
+		if (uplink->decompressor_ended) {
+			/*
+			 * The stream may end in the same call that decompresses the
+			 * message picking the new codec, so the switch happens only
+			 * once the message was handled.
+			 */
+			if (!uplink->decompressor_next)
+				goto CORRUPTED;
+			ulog(LLOG_DEBUG, "Compression stream from %s:%s ended, switching codec\n", uplink->remote_name, uplink->service);
+			decompressor_destroy(uplink->decompressor);
+			uplink->decompressor = uplink->decompressor_next;
+			uplink->decompressor_next = NULL;
+			uplink->decompressor_ended = false;
+		}
+		size_t output = uplink->size_rest;
+		size_t before = uplink->inc_available;
+		switch (decompressor_feed(uplink->decompressor, &uplink->inc_pos, &uplink->inc_available, uplink->buffer_pos, &output)) {
+			case DECOMPRESS_OK:
+				break;
+			case DECOMPRESS_END:
+				uplink->decompressor_ended = true;
+				break;
+			case DECOMPRESS_ERROR:
+				goto CORRUPTED;
+		}
+		*available_output = output;
+		// Some codecs take input without producing anything (headers, partial blocks), so go on while there's progress
+		if (output || !uplink->inc_available || (uplink->inc_available == before && !uplink->decompressor_ended))
+			return true;
+	}
+CORRUPTED:
+	ulog(LLOG_ERROR, "Data for decompression are corrupted. Reconnecting.\n");
+	// Data corrupted. Reconnect.
+	uplink_reconnect(uplink);
+	return false;
+}
 
+static enum rdd_status read_decompressed_data(struct uplink *uplink, ssize_t *available_output) {
 	// Try to read from buffers, they can have some data
-	int ret = inflate(&(uplink->zstrm_recv), Z_SYNC_FLUSH);
-	if (ret == Z_DATA_ERROR) {
-		ulog(LLOG_ERROR, "Data for decompression are corrupted. Reconnecting.");
-		// Data corrupted. Reconnect.
-		uplink_reconnect(uplink);
+	if (!decompress_received(uplink, available_output))
 		return RDD_END_LOOP;
-	}
-	*available_output = uplink->size_rest - uplink->zstrm_recv.avail_out;
 
-	// There was some data in deflate or receive buffer
+	// There was some data in decompressor or receive buffer
 	if (*available_output != 0) {
 		return RDD_DATA;
 	}
 
 	// Read is requested and there are no more received data
 	// So, try to read something
-	if (uplink->zstrm_recv.avail_in == 0) {
+	if (uplink->inc_available == 0) {
 		ssize_t amount = recv(uplink->fd, uplink->inc_buffer, uplink->inc_buffer_size, MSG_DONTWAIT);
 		if (amount == -1) {
 			switch (errno) {
@@ -833,8 +882,8 @@ CLOSED:
 			return RDD_END_LOOP; // We are done with this socket.
 		} else {
 			// Some data was read, so update input buffer for stream
-			uplink->zstrm_recv.avail_in = (unsigned int)amount;
-			uplink->zstrm_recv.next_in = (unsigned char *)uplink->inc_buffer;
+			uplink->inc_available = amount;
+			uplink->inc_pos = uplink->inc_buffer;
 
 			if (MAX_LOG_LEVEL == LLOG_DEBUG_VERBOSE) {
 
@@ -843,15 +892,9 @@ CLOSED:
 		}
 	}
 
-	// First time had inflate empty buffer - try it again after read
-	ret = inflate(&(uplink->zstrm_recv), Z_SYNC_FLUSH);
-	if (ret == Z_DATA_ERROR) {
-		ulog(LLOG_ERROR, "Data for decompression are corrupted. Reconnecting.");
-		// Data corrupted. Reconnect.
-		uplink_reconnect(uplink);
+	// First time had decompressor empty buffer - try it again after read
+	if (!decompress_received(uplink, available_output))
 		return RDD_END_LOOP;
-	}
-	*available_output = uplink->size_rest - uplink->zstrm_recv.avail_out;
 
 	if (*available_output == 0) {
 		// The same case as EAGAIN;
@@ -901,39 +944,64 @@ static void uplink_read(struct uplink *uplink, uint32_t unused) {
 	}
 }
 
+/*
+ * Load the compression dictionary for our protocol version. It is used only
+ * if the server has the same one.
+ */
+static void dict_load(struct uplink *uplink, struct mem_pool *pool) {
+	const char *path = mem_pool_printf(loop_temp_pool(uplink->loop), COMPRESSION_DICT_PATH, (unsigned) PROTOCOL_VERSION);
+	FILE *file = fopen(path, "rb");
+	if (!file) {
+		ulog(LLOG_DEBUG, "No compression dictionary %s: %s\n", path, strerror(errno));
+		return;
+	}
+	struct stat st;
+	if (fstat(fileno(file), &st) == -1 || !st.st_size || st.st_size > COMPRESSION_DICT_MAX_SIZE) {
+		ulog(LLOG_WARN, "Compression dictionary %s is empty, too large or broken\n", path);
+		fclose(file);
+		return;
+	}
+	size_t size = st.st_size;
+	uint8_t *dict = mem_pool_alloc(pool, size);
+	bool complete = fread(dict, 1, size, file) == size;
+	fclose(file);
+	if (!complete) {
+		ulog(LLOG_WARN, "Couldn't read compression dictionary %s\n", path);
+		return;
+	}
+	uint32_t id = compress_dict_id(dict, size);
+	if (id >> 16 != PROTOCOL_VERSION) {
+		ulog(LLOG_WARN, "Compression dictionary %s has ID %u, not for protocol version %u\n", path, (unsigned) id, (unsigned) PROTOCOL_VERSION);
+		return;
+	}
+	ulog(LLOG_INFO, "Loaded compression dictionary %s with ID %u\n", path, (unsigned) id);
+	uplink->dict = dict;
+	uplink->dict_size = size;
+	uplink->dict_id = id;
+}
+
 struct uplink *uplink_create(struct loop *loop) {
 	ulog(LLOG_INFO, "Creating uplink\n");
 	struct mem_pool *permanent_pool = loop_permanent_pool(loop);
 	struct uplink *result = mem_pool_alloc(permanent_pool, sizeof *result);
-	z_stream strm_compress;
-	strm_compress.zalloc = Z_NULL;
-	strm_compress.zfree = Z_NULL;
-	strm_compress.opaque = Z_NULL;
-	if (deflateInit(&strm_compress, COMPRESSION_LEVEL) != Z_OK)
-		die("Could not initialize zlib (compression stream)\n");
-	z_stream strm_decompress;
-	strm_decompress.zalloc = Z_NULL;
-	strm_decompress.zfree = Z_NULL;
-	strm_decompress.opaque = Z_NULL;
-	strm_decompress.avail_in = 0;
-	if (inflateInit(&strm_decompress) != Z_OK)
-		die("Could not initialize zlib (decompression stream)\n");
 	unsigned char *incoming_buffer = mem_pool_alloc(permanent_pool, COMPRESSION_BUFFSIZE);
 	*result = (struct uplink) {
 		.uplink_read = uplink_read,
 		.loop = loop,
 		.buffer_pool = loop_pool_create(loop, NULL, mem_pool_printf(loop_temp_pool(loop), "Buffer pool for uplink")),
 		.fd = -1,
-		.zstrm_send = strm_compress,
-		.zstrm_recv = strm_decompress,
 		.inc_buffer = incoming_buffer,
 		.inc_buffer_size = COMPRESSION_BUFFSIZE
-
 	};
+	dict_load(result, permanent_pool);
 	loop_uplink_set(loop, result);
 	return result;
 }
 
+void uplink_status_refresh(struct uplink *uplink) {
+	dump_status(uplink);
+}
+
 void uplink_set_status_file(struct uplink *uplink, const char *file) {
 	assert(!uplink->status_file);
 	uplink->status_file = file;
@@ -977,8 +1045,7 @@ void uplink_destroy(struct uplink *uplink) {
 	// The memory pools get destroyed by the loop, we just close the socket, if any.
 	uplink_disconnect(uplink, true);
 	// And destroy library handlers
-	deflateEnd(&(uplink->zstrm_send));
-	inflateEnd(&(uplink->zstrm_recv));
+	compression_stop(uplink);
 	if (uplink->status_file)
 		if (unlink(uplink->status_file) == -1)
 			ulog(LLOG_ERROR, "Couldn't remove status file %s: %s\n", uplink->status_file, strerror(errno));
@@ -1017,47 +1084,99 @@ static bool send_raw_data(struct uplink *uplink, const uint8_t *buffer, size_t s
 	return true;
 }
 
-static bool buffer_send(struct uplink *uplink, const uint8_t *buffer, size_t size, int flags) {
-	size_t buffsize = COMPRESSION_BUFFSIZE;
-	struct mem_pool *temp_pool = loop_temp_pool(uplink->loop);
-	uint8_t *output_buffer = mem_pool_alloc(temp_pool, buffsize);
-	uplink->zstrm_send.avail_in = size;
-	uplink->zstrm_send.next_in = (unsigned char *)buffer;
+static bool send_output(const uint8_t *data, size_t size, bool more, void *userdata) {
+	return send_raw_data(userdata, data, size, more ? MSG_MORE : 0);
+}
 
+static bool buffer_send(struct uplink *uplink, const uint8_t *buffer, size_t size, int flags) {
 	if (MAX_LOG_LEVEL == LLOG_DEBUG_VERBOSE) {
 		ulog(LLOG_DEBUG_VERBOSE, "compression: send: original data (size %zu, %s): %s\n", size, (flags == 0) ? "LAST" : "MSG_MORE", mem_pool_hex(loop_temp_pool(uplink->loop), buffer, size));
 	}
-	unsigned int available_output = 0;
-	while (uplink->zstrm_send.avail_in > 0) {
-		uplink->zstrm_send.avail_out = buffsize;
-		uplink->zstrm_send.next_out = output_buffer;
-		deflate(&(uplink->zstrm_send), Z_NO_FLUSH);
-		available_output = buffsize - uplink->zstrm_send.avail_out;
-		if (available_output == 0) {
-			ulog(LLOG_DEBUG_VERBOSE, "compression: no output data prepared after deflate call\n");
-		}
-		if (!send_raw_data(uplink, output_buffer, available_output, MSG_MORE)) {
-			return false;
-		}
+	// No more data (flags == 0) means flushing the rest of compressed message and sending it.
+	return compressor_feed(uplink->compressor, buffer, size, flags ? COMPRESS_NO_FLUSH : COMPRESS_FLUSH, send_output, uplink);
+}
+
+static void compression_stop(struct uplink *uplink) {
+	if (uplink->compressor)
+		compressor_destroy(uplink->compressor);
+	if (uplink->decompressor)
+		decompressor_destroy(uplink->decompressor);
+	if (uplink->decompressor_next)
+		decompressor_destroy(uplink->decompressor_next);
+	uplink->compressor = NULL;
+	uplink->decompressor = uplink->decompressor_next = NULL;
+	uplink->decompressor_ended = false;
+	uplink->inc_available = 0;
+}
+
+/*
+ * Each connection starts with zlib in both directions. Offer the other codecs
+ * to the server right away, it may pick one of them.
+ */
+static void compression_start(struct uplink *uplink) {
+	compression_stop(uplink);
+	uplink->compressor = compressor_create(COMPRESS_ZLIB, COMPRESSION_LEVEL, NULL, 0);
+	uplink->decompressor = decompressor_create(COMPRESS_ZLIB, NULL, 0);
+	size_t codecs_len = strlen(compress_codecs);
+	size_t len = 2 * sizeof(uint32_t) + codecs_len;
+	uint8_t message[len];
+	uint8_t *pos = message;
+	size_t rest = len;
+	uplink_render_string(compress_codecs, codecs_len, &pos, &rest);
+	// The dictionary we have (0 for none)
+	uint32_t dict_id = htonl(uplink->dict_id);
+	memcpy(pos, &dict_id, sizeof dict_id);
+	rest -= sizeof dict_id;
+	assert(!rest);
+	uplink_send_message(uplink, 'Z', message, len);
+}
+
+/*
+ * The server picked a codec, level and dictionary for us. It ends its zlib
+ * stream after this message and starts the new codec. We do the same.
+ */
+static void compression_switch(struct uplink *uplink) {
+	if (uplink->buffer_size != 2 + sizeof(uint32_t) || uplink->decompressor_next) {
+		ulog(LLOG_ERROR, "Broken compression switch from %s:%s, reconnecting\n", uplink->remote_name, uplink->service);
+		uplink_reconnect(uplink);
+		return;
 	}
-	if (flags == 0) { // No more data, flush the rest of compressed message and sent it.
-		ulog(LLOG_DEBUG_VERBOSE, "compression: start sync flushing\n");
-		do {
-			uplink->zstrm_send.avail_out = buffsize;
-			uplink->zstrm_send.next_out = output_buffer;
-			deflate(&(uplink->zstrm_send), Z_SYNC_FLUSH);
-			available_output = buffsize - uplink->zstrm_send.avail_out;
-			if (available_output == 0) {
-				ulog(LLOG_DEBUG_VERBOSE, "compression: no output data prepared after deflate call (SYNC)\n");
-			}
-			int finish_flag = (uplink->zstrm_send.avail_out == 0) ? MSG_MORE : 0;
-			if (!send_raw_data(uplink, output_buffer, available_output, finish_flag)) {
-				return false;
-			}
-		} while (uplink->zstrm_send.avail_out == 0);
+	enum compress_codec codec = uplink->buffer[0];
+	int level = (int8_t)uplink->buffer[1];
+	uint32_t dict_id;
+	memcpy(&dict_id, uplink->buffer + 2, sizeof dict_id);
+	dict_id = ntohl(dict_id);
+	if (dict_id && dict_id != uplink->dict_id) {
+		ulog(LLOG_ERROR, "Server %s:%s picked compression dictionary %u we don't have, reconnecting\n", uplink->remote_name, uplink->service, (unsigned) dict_id);
+		uplink_reconnect(uplink);
+		return;
 	}
-	ulog(LLOG_DEBUG_VERBOSE, "compression: return\n");
-	return true;
+	if (dict_id && codec == COMPRESS_LZ4) {
+		ulog(LLOG_ERROR, "Server %s:%s picked lz4 with a dictionary, reconnecting\n", uplink->remote_name, uplink->service);
+		uplink_reconnect(uplink);
+		return;
+	}
+	const uint8_t *dict = dict_id ? uplink->dict : NULL;
+	size_t dict_size = dict_id ? uplink->dict_size : 0;
+	struct compressor *compressor = compressor_create(codec, level, dict, dict_size);
+	struct decompressor *decompressor = decompressor_create(codec, dict, dict_size);
+	if (!compressor || !decompressor) {
+		ulog(LLOG_ERROR, "Server %s:%s picked unknown compression codec %c, reconnecting\n", uplink->remote_name, uplink->service, codec);
+		if (compressor)
+			compressor_destroy(compressor);
+		if (decompressor)
+			decompressor_destroy(decompressor);
+		uplink_reconnect(uplink);
+		return;
+	}
+	ulog(LLOG_INFO, "Switching uplink compression to %c (level %d, dictionary %u)\n", codec, level, (unsigned) dict_id);
+	uplink->decompressor_next = decompressor;
+	if (!compressor_feed(uplink->compressor, NULL, 0, COMPRESS_FINISH, send_output, uplink)) {
+		compressor_destroy(compressor);
+		return; // Lost the connection
+	}
+	compressor_destroy(uplink->compressor);
+	uplink->compressor = compressor;
 }
 
 bool uplink_send_message(struct uplink *uplink, char type, const void *data, size_t size) {
@@ -51,6 +51,8 @@ struct uplink *uplink_create(struct loop *loop) __attribute__((malloc)) __attrib
  * It'll keep the pointer provided, so don't free it.
  */
 void uplink_set_status_file(struct uplink *uplink, const char *path) __attribute__((nonnull));
+// Rewrite the status file with the current state (it is done automatically when the connection state changes).
+void uplink_status_refresh(struct uplink *uplink) __attribute__((nonnull));
 /*
  * Set or change the remote endpoint of the uplink. It'll (re)connect.
  *
@@ -21,6 +21,7 @@
 #include "diff_store.h"
 
 #include "../../core/trie.h"
+#include "../../core/trie_frozen.h"
 #include "../../core/util.h"
 #include "../../core/mem_pool.h"
 
@@ -30,6 +31,21 @@ struct trie_data {
 
 static struct trie_data mark; // To have a valid pointer to something, not used by itself
 
+// Build a frozen copy of the current trie in the spare buffer and swap it in
+static void store_freeze(struct diff_addr_store *store, struct mem_pool *tmp_pool) {
+	size_t next = store->frozen ? !store->frozen_current : 0;
+	size_t size = trie_frozen_size(store->trie, tmp_pool);
+	if (store->frozen_sizes[next] < size) {
+		// Leave some space, so the buffers don't get replaced by every small update
+		size += size / 4;
+		store->frozen_buffers[next] = mem_pool_alloc(store->pool, size);
+		store->frozen_sizes[next] = size;
+	}
+	const struct trie_frozen *frozen = trie_freeze_into(store->trie, store->frozen_buffers[next], store->frozen_sizes[next], tmp_pool);
+	store->frozen = frozen;
+	store->frozen_current = next;
+}
+
 static struct diff_addr_store *diff_addr_store_init(struct mem_pool *pool, const char *name) {
 	sanity(name, "No name of store provided\n");
 	struct diff_addr_store *result = mem_pool_alloc(pool, sizeof *result);
@@ -38,6 +54,8 @@ static struct diff_addr_store *diff_addr_store_init(struct mem_pool *pool, const
 		.name = name,
 		.pool = pool
 	};
+	// The trie is empty, the copy takes almost no temporary memory
+	store_freeze(result, pool);
 	return result;
 }
 
@@ -128,6 +146,7 @@ static enum diff_store_action diff_addr_store_apply(struct mem_pool *tmp_pool, s
 		diff_size -= addr_len;
 		addr_no ++;
 	}
+	store_freeze(store, tmp_pool);
 	if (signal_end && store->replace_end_hook)
 		store->replace_end_hook(store);
 	store->epoch = epoch;
@@ -154,6 +173,7 @@ static void diff_addr_store_cp(struct diff_addr_store *target, const struct diff
 	target->epoch = source->epoch;
 	target->version = source->version;
 	trie_walk(source->trie, das_cp, target, tmp_pool);
+	store_freeze(target, tmp_pool);
 }
 
 struct pluglib *pluglib_info(void) {
@@ -167,7 +187,7 @@ struct pluglib *pluglib_info(void) {
 	static struct pluglib pluglib = {
 		.name = "Diff Store",
 		.compat = 1,
-		.version = 1,
+		.version = 2,
 		.exports = exports
 	};
 	return &pluglib;
@@ -24,6 +24,7 @@
 #include <stdint.h>
 
 struct trie;
+struct trie_frozen;
 struct mem_pool;
 
 enum diff_store_action {
@@ -56,6 +57,13 @@ struct diff_addr_store {
 	/* The user data can be extracted by the hook from the passed store. It is not passed
 	 * as a parameter to the hooks directly. */
 	void *userdata;
+	/* Read-only copy of the trie, for fast lookups (see trie_frozen.h). It is rebuilt
+	 * after each update into the other of two buffers and then swapped in, so it is
+	 * always complete. */
+	const struct trie_frozen *frozen;
+	void *frozen_buffers[2];
+	size_t frozen_sizes[2];
+	size_t frozen_current;
 };
 
 #endif
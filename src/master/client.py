@@ -30,10 +30,14 @@ import time
 import plugin_versions
 import database
 import timers
+import master_config
 
 logger = logging.getLogger(name='client')
 sysrand = random.SystemRandom()
 challenge_len = 128 # 128 bits of random should be enough for log-in to protect against replay attacks
+# Capture of the messages from the clients, for training the compression dictionary
+capture_path = master_config.get_default('capture', None)
+capture = open(capture_path, 'ab') if capture_path else None
 
 with database.transaction() as t:
 	# As we just started, there's no plugin active anywhere.
@@ -127,6 +131,9 @@ class ClientConn(twisted.protocols.basic.Int32StringReceiver):
 			return
 		(msg, params) = (string[0], string[1:])
 		logger.trace("Received from %s: %s", self.cid(), repr(string))
+		if capture and self.__logged_in:
+			# Only after login, there are the credentials before
+			capture.write(struct.pack('!I', len(string)) + string)
 		if not self.__logged_in:
 			def login_failure(msg):
 				logger.warn('Login failure from %s: %s', self.cid(), msg)
@@ -195,6 +202,9 @@ class ClientConn(twisted.protocols.basic.Int32StringReceiver):
 					logger.warn("Wrong session ID length on client %s: %s", self.cid(), len(params))
 					return
 				(self.session_id,) = struct.unpack("!I", params)
+			elif msg == 'Z':
+				# The offer of compression codecs. The soxy handles it, it gets here only on uncompressed connections.
+				logger.debug("Client %s offered compression on uncompressed connection, ignoring", self.cid())
 			return
 		elif msg == 'P': # Ping. Answer pong.
 			self.sendString('p' + params)
@@ -215,9 +225,28 @@ class ClientConn(twisted.protocols.basic.Int32StringReceiver):
 					params = params[2:]
 			else:
 				self.__handle_versions(params)
+		elif msg == 'T': # How much time the plugins take on the client
+			self.__handle_cpu_stats(params)
 		else:
 			logger.warn("Unknown message from client %s: %s", self.cid(), msg)
 
+	def __handle_cpu_stats(self, params):
+		"""
+		Parse the client's CPU stats of plugins and log them. There's
+		no table for them, it's mostly for debugging a busy client.
+		"""
+		(period, buckets) = struct.unpack('!II', params[:8])
+		params = params[8:]
+		kinds = ('packet', 'timeout', 'fd', 'uplink-data', 'other')
+		block = 24 + 4 * buckets
+		while len(params) > 0:
+			(name, params) = extract_string(params)
+			for kind in kinds:
+				(calls, total, maximum) = struct.unpack('!QQQ', params[:24])
+				params = params[block:]
+				if calls:
+					logger.info("CPU of plugin %s on client %s in %s ms: %s %s calls, %s ns total, %s ns max", name, self.cid(), period, calls, kind, total, maximum)
+
 	def __handle_versions(self, params):
 		"""
 		Parse the client's message about the plugins it knows.
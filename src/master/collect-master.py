@@ -82,7 +82,7 @@ class Socat(protocol.ProcessProtocol):
 #args = ['./soxy/soxy', master_config.get('cert'), master_config.get('key'), str(master_config.getint('port')), os.getcwd() + '/collect-master.sock']
 #logging.debug('Starting proxy with: %s', args)
 #reactor.spawnProcess(Socat(), './soxy/soxy', args=args, env=os.environ)
-args = ['./soxy/soxy', master_config.get('cert'), master_config.get('key'), str(master_config.getint('port_compression')), os.getcwd() + '/collect-master.sock', 'compress']
+args = ['./soxy/soxy', master_config.get('cert'), master_config.get('key'), str(master_config.getint('port_compression')), os.getcwd() + '/collect-master.sock', 'compress', master_config.get_default('compression', 'zstd:3,lz4:1,zlib:9'), master_config.get_default('compression_dicts', '')]
 logging.debug('Starting proxy with: %s', args)
 reactor.spawnProcess(Socat(), './soxy/soxy', args=args, env=os.environ)
 
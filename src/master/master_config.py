@@ -31,6 +31,13 @@ def get(name):
 	global config_data
 	return config_data.get('main', name)
 
+def get_default(name, default):
+	global config_data
+	if config_data.has_option('main', name):
+		return config_data.get('main', name)
+	else:
+		return default
+
 def getint(name):
 	global config_data
 	return config_data.getint('main', name)
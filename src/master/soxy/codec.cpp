@@ -0,0 +1,492 @@
+/*
+    Ucollect - small utility for real-time analysis of network data
+    Copyright (C) 2015 CZ.NIC, z.s.p.o. (http://www.nic.cz/)
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "codec.h"
+
+#include <cstring>
+#include <arpa/inet.h>
+#include <zlib.h>
+#include <zstd.h>
+#include <lz4frame.h>
+
+/*
+ * A trained dictionary, with the digested forms for the codecs. These are
+ * shared by all the connections (the libraries allow that, they are read-only).
+ */
+class Dictionary {
+public:
+	Dictionary(const QByteArray &data, const QList<int> &zstdLevels) :
+		data(data),
+		id(ZSTD_getDictID_fromDict(data.constData(), data.size())),
+		zstdDecompress(ZSTD_createDDict(data.constData(), data.size()))
+	{
+		// The zstd digests it for each level separately
+		foreach (int level, zstdLevels) {
+			ZstdLevel digest = { level, ZSTD_createCDict(data.constData(), data.size(), level) };
+			zstdCompress << digest;
+		}
+	}
+	~Dictionary() {
+		ZSTD_freeDDict(zstdDecompress);
+		foreach (const ZstdLevel &digest, zstdCompress)
+			ZSTD_freeCDict(digest.dict);
+	}
+	bool ok() const {
+		if (!id || !zstdDecompress)
+			return false;
+		foreach (const ZstdLevel &digest, zstdCompress)
+			if (!digest.dict)
+				return false;
+		return true;
+	}
+	const ZSTD_CDict *zstd(int level) const {
+		foreach (const ZstdLevel &digest, zstdCompress)
+			if (digest.level == level)
+				return digest.dict;
+		return NULL;
+	}
+	const QByteArray data;
+	const uint32_t id;
+	ZSTD_DDict *const zstdDecompress;
+private:
+	Dictionary(const Dictionary &);
+	Dictionary &operator =(const Dictionary &);
+	struct ZstdLevel {
+		int level;
+		ZSTD_CDict *dict;
+	};
+	QList<ZstdLevel> zstdCompress;
+};
+
+namespace {
+
+const size_t BUFFER_SIZE = 4096;
+
+class ZlibCompressor : public Compressor {
+public:
+	ZlibCompressor(int level, const Dictionary *dict) : ok(false) {
+		memset(&stream, 0, sizeof stream);
+		if (level < 0)
+			level = 0;
+		if (level > 9)
+			level = 9;
+		ok = deflateInit(&stream, level) == Z_OK;
+		if (ok && dict && deflateSetDictionary(&stream, (const unsigned char *)dict->data.constData(), dict->data.size()) != Z_OK) {
+			deflateEnd(&stream);
+			ok = false;
+		}
+	}
+	~ZlibCompressor() {
+		if (ok)
+			deflateEnd(&stream);
+	}
+	bool compress(const char *data, size_t size, Flush flush, QByteArray &output) {
+		if (!ok)
+			return false;
+		static const int modes[] = { Z_NO_FLUSH, Z_SYNC_FLUSH, Z_FINISH };
+		stream.next_in = (unsigned char *)data;
+		stream.avail_in = size;
+		for (;;) {
+			stream.next_out = buffer;
+			stream.avail_out = BUFFER_SIZE;
+			int result = deflate(&stream, modes[flush]);
+			if (result == Z_STREAM_ERROR)
+				return false;
+			output.append((const char *)buffer, BUFFER_SIZE - stream.avail_out);
+			if (flush == Finish ? result == Z_STREAM_END : (stream.avail_in == 0 && stream.avail_out != 0))
+				return true;
+		}
+	}
+private:
+	z_stream stream;
+	bool ok;
+	unsigned char buffer[BUFFER_SIZE];
+};
+
+class ZlibDecompressor : public Decompressor {
+public:
+	ZlibDecompressor(const Dictionary *dict) : ok(false), dict(dict) {
+		memset(&stream, 0, sizeof stream);
+		ok = inflateInit(&stream) == Z_OK;
+	}
+	~ZlibDecompressor() {
+		if (ok)
+			inflateEnd(&stream);
+	}
+	Status decompress(const char *&data, size_t &size, QByteArray &output) {
+		if (!ok)
+			return Error;
+		stream.next_in = (unsigned char *)data;
+		stream.avail_in = size;
+		int result;
+		do {
+			stream.next_out = buffer;
+			stream.avail_out = BUFFER_SIZE;
+			result = inflate(&stream, Z_SYNC_FLUSH);
+			if (result == Z_NEED_DICT && dict) {
+				// Right after the header
+				if (inflateSetDictionary(&stream, (const unsigned char *)dict->data.constData(), dict->data.size()) != Z_OK)
+					return Error;
+				result = inflate(&stream, Z_SYNC_FLUSH);
+			}
+			output.append((const char *)buffer, BUFFER_SIZE - stream.avail_out);
+		} while (result == Z_OK && (stream.avail_in || !stream.avail_out));
+		data = (const char *)stream.next_in;
+		size = stream.avail_in;
+		switch (result) {
+			case Z_OK:
+			case Z_BUF_ERROR: // No more input
+				return Ok;
+			case Z_STREAM_END:
+				return End;
+			default:
+				return Error;
+		}
+	}
+private:
+	z_stream stream;
+	bool ok;
+	const Dictionary *dict;
+	unsigned char buffer[BUFFER_SIZE];
+};
+
+class ZstdCompressor : public Compressor {
+public:
+	ZstdCompressor(int level, const Dictionary *dict) : context(ZSTD_createCCtx()) {
+		if (context && (ZSTD_isError(ZSTD_CCtx_setParameter(context, ZSTD_c_compressionLevel, level)) || ZSTD_isError(ZSTD_CCtx_setParameter(context, ZSTD_c_windowLog, ZSTD_WINDOW_LOG)) || (dict && (!dict->zstd(level) || ZSTD_isError(ZSTD_CCtx_refCDict(context, dict->zstd(level))))))) {
+			ZSTD_freeCCtx(context);
+			context = NULL;
+		}
+	}
+	~ZstdCompressor() {
+		ZSTD_freeCCtx(context);
+	}
+	bool compress(const char *data, size_t size, Flush flush, QByteArray &output) {
+		if (!context)
+			return false;
+		static const ZSTD_EndDirective modes[] = { ZSTD_e_continue, ZSTD_e_flush, ZSTD_e_end };
+		ZSTD_inBuffer in = { data, size, 0 };
+		for (;;) {
+			ZSTD_outBuffer out = { buffer, BUFFER_SIZE, 0 };
+			size_t remaining = ZSTD_compressStream2(context, &out, &in, modes[flush]);
+			if (ZSTD_isError(remaining))
+				return false;
+			output.append((const char *)buffer, out.pos);
+			if (flush == NoFlush ? in.pos == in.size : remaining == 0)
+				return true;
+		}
+	}
+private:
+	ZSTD_CCtx *context;
+	char buffer[BUFFER_SIZE];
+};
+
+class ZstdDecompressor : public Decompressor {
+public:
+	ZstdDecompressor(const Dictionary *dict) : context(ZSTD_createDCtx()) {
+		if (context && dict && ZSTD_isError(ZSTD_DCtx_refDDict(context, dict->zstdDecompress))) {
+			ZSTD_freeDCtx(context);
+			context = NULL;
+		}
+	}
+	~ZstdDecompressor() {
+		ZSTD_freeDCtx(context);
+	}
+	Status decompress(const char *&data, size_t &size, QByteArray &output) {
+		if (!context)
+			return Error;
+		ZSTD_inBuffer in = { data, size, 0 };
+		size_t result;
+		ZSTD_outBuffer out;
+		do {
+			out.dst = buffer;
+			out.size = BUFFER_SIZE;
+			out.pos = 0;
+			result = ZSTD_decompressStream(context, &out, &in);
+			if (ZSTD_isError(result))
+				return Error;
+			output.append((const char *)buffer, out.pos);
+			// The client never ends the frame, so an end is the end of the stream
+		} while (result && (in.pos < in.size || out.pos == out.size));
+		data += in.pos;
+		size -= in.pos;
+		return result ? Ok : End;
+	}
+private:
+	ZSTD_DCtx *context;
+	char buffer[BUFFER_SIZE];
+};
+
+class Lz4Compressor : public Compressor {
+public:
+	Lz4Compressor(int level) : context(NULL), started(false) {
+		memset(&prefs, 0, sizeof prefs);
+		prefs.frameInfo.blockSizeID = LZ4F_max64KB;
+		prefs.frameInfo.blockMode = LZ4F_blockLinked;
+		prefs.compressionLevel = level;
+		if (LZ4F_isError(LZ4F_createCompressionContext(&context, LZ4F_VERSION)))
+			context = NULL;
+	}
+	~Lz4Compressor() {
+		LZ4F_freeCompressionContext(context);
+	}
+	bool compress(const char *data, size_t size, Flush flush, QByteArray &output) {
+		if (!context)
+			return false;
+		// The lz4 wants the space for the worst case up-front
+		QByteArray buffer(LZ4F_HEADER_SIZE_MAX + LZ4F_compressBound(size, &prefs), '\0');
+		char *pos = buffer.data();
+		size_t rest = buffer.size();
+		size_t result;
+		if (!started) {
+			result = LZ4F_compressBegin(context, pos, rest, &prefs);
+			if (LZ4F_isError(result))
+				return false;
+			pos += result;
+			rest -= result;
+			started = true;
+		}
+		if (size) {
+			result = LZ4F_compressUpdate(context, pos, rest, data, size, NULL);
+			if (LZ4F_isError(result))
+				return false;
+			pos += result;
+			rest -= result;
+		}
+		if (flush != NoFlush) {
+			result = flush == Finish ? LZ4F_compressEnd(context, pos, rest, NULL) : LZ4F_flush(context, pos, rest, NULL);
+			if (LZ4F_isError(result))
+				return false;
+			pos += result;
+		}
+		output.append(buffer.constData(), pos - buffer.constData());
+		return true;
+	}
+private:
+	LZ4F_cctx *context;
+	LZ4F_preferences_t prefs;
+	bool started;
+};
+
+class Lz4Decompressor : public Decompressor {
+public:
+	Lz4Decompressor() : context(NULL) {
+		if (LZ4F_isError(LZ4F_createDecompressionContext(&context, LZ4F_VERSION)))
+			context = NULL;
+	}
+	~Lz4Decompressor() {
+		LZ4F_freeDecompressionContext(context);
+	}
+	Status decompress(const char *&data, size_t &size, QByteArray &output) {
+		if (!context)
+			return Error;
+		size_t result;
+		do {
+			size_t produced = BUFFER_SIZE;
+			size_t consumed = size;
+			result = LZ4F_decompress(context, buffer, &produced, data, &consumed, NULL);
+			if (LZ4F_isError(result))
+				return Error;
+			output.append(buffer, produced);
+			data += consumed;
+			size -= consumed;
+			if (!consumed && !produced)
+				break; // Needs more input
+		} while (result);
+		return result ? Ok : End;
+	}
+private:
+	LZ4F_dctx *context;
+	char buffer[BUFFER_SIZE];
+};
+
+}
+
+Compressor *Compressor::create(char codec, int level, const Dictionary *dict) {
+	switch (codec) {
+		case CODEC_ZLIB:
+			return new ZlibCompressor(level, dict);
+		case CODEC_ZSTD:
+			return new ZstdCompressor(level, dict);
+		case CODEC_LZ4:
+			return new Lz4Compressor(level);
+		default:
+			return NULL;
+	}
+}
+
+Decompressor *Decompressor::create(char codec, const Dictionary *dict) {
+	switch (codec) {
+		case CODEC_ZLIB:
+			return new ZlibDecompressor(dict);
+		case CODEC_ZSTD:
+			return new ZstdDecompressor(dict);
+		case CODEC_LZ4:
+			return new Lz4Decompressor();
+		default:
+			return NULL;
+	}
+}
+
+QList<Compression::Preference> Compression::preferences;
+QList<const Dictionary *> Compression::dictionaries;
+
+// The connection starts with this one, before anything is negotiated
+static const int ZLIB_LEVEL = 9;
+// Limit of the offer message from the client, anything longer is not an offer
+static const uint32_t OFFER_MAX = 1024;
+
+Compression::Compression() :
+	compressor(Compressor::create(CODEC_ZLIB, ZLIB_LEVEL, NULL)),
+	decompressor(Decompressor::create(CODEC_ZLIB, NULL)),
+	decompressorNext(NULL),
+	decompressorEnded(false),
+	expectOffer(true)
+{}
+
+Compression::~Compression() {
+	delete compressor;
+	delete decompressor;
+	delete decompressorNext;
+}
+
+void Compression::addPreference(char codec, int level) {
+	Preference preference = { codec, level };
+	preferences << preference;
+}
+
+uint32_t Compression::addDictionary(const QByteArray &data) {
+	QList<int> zstdLevels;
+	foreach (const Preference &preference, preferences)
+		if (preference.codec == CODEC_ZSTD)
+			zstdLevels << preference.level;
+	Dictionary *dictionary = new Dictionary(data, zstdLevels);
+	if (!dictionary->ok() || findDictionary(dictionary->id)) {
+		delete dictionary;
+		return 0;
+	}
+	dictionaries << dictionary;
+	return dictionary->id;
+}
+
+const Dictionary *Compression::findDictionary(uint32_t id) {
+	foreach (const Dictionary *dictionary, dictionaries)
+		if (dictionary->id == id)
+			return dictionary;
+	return NULL;
+}
+
+bool Compression::incoming(const char *data, size_t size, QByteArray &local, QByteArray &remote) {
+	QByteArray plain;
+	while (size) {
+		if (decompressorEnded) {
+			// The client switched to the codec we picked
+			if (!decompressorNext)
+				return false;
+			delete decompressor;
+			decompressor = decompressorNext;
+			decompressorNext = NULL;
+			decompressorEnded = false;
+		}
+		Decompressor::Status status = decompressor->decompress(data, size, plain);
+		if (status == Decompressor::Error)
+			return false;
+		if (status == Decompressor::End)
+			decompressorEnded = true;
+		else
+			break; // Everything consumed
+	}
+	if (!expectOffer) {
+		local += plain;
+		return true;
+	}
+	// Look at the first message, if it is the offer of codecs. It is not passed on.
+	firstMessage += plain;
+	const size_t head = sizeof(uint32_t) + 1;
+	if ((size_t)firstMessage.size() < head)
+		return true; // Not complete yet
+	uint32_t length;
+	memcpy(&length, firstMessage.constData(), sizeof length);
+	length = ntohl(length);
+	if (firstMessage.constData()[sizeof length] != 'Z' || length > OFFER_MAX) {
+		// Not an offer, an old client
+		expectOffer = false;
+		local += firstMessage;
+		firstMessage.clear();
+		return true;
+	}
+	if ((size_t)firstMessage.size() < sizeof length + length)
+		return true;
+	expectOffer = false;
+	bool result = handleOffer(firstMessage.mid(head, length - 1), remote);
+	local += firstMessage.mid(sizeof length + length);
+	firstMessage.clear();
+	return result;
+}
+
+bool Compression::handleOffer(const QByteArray &offer, QByteArray &remote) {
+	uint32_t length;
+	if ((size_t)offer.size() < sizeof length)
+		return false;
+	memcpy(&length, offer.constData(), sizeof length);
+	length = ntohl(length);
+	if (length > (size_t)offer.size() - sizeof length)
+		return false;
+	QByteArray codecs = offer.mid(sizeof length, length);
+	// The dictionary the client has follows (0 for none)
+	uint32_t dictId = 0;
+	if ((size_t)offer.size() >= 2 * sizeof length + length) {
+		memcpy(&dictId, offer.constData() + sizeof length + length, sizeof dictId);
+		dictId = ntohl(dictId);
+	}
+	const Dictionary *offered = dictId ? findDictionary(dictId) : NULL;
+	foreach (const Preference &preference, preferences) {
+		if (!codecs.contains(preference.codec))
+			continue;
+		// The lz4 works without the dictionary, the client expects it so
+		const Dictionary *dictionary = preference.codec == CODEC_LZ4 ? NULL : offered;
+		if (!dictionary)
+			dictId = 0;
+		Compressor *newCompressor = Compressor::create(preference.codec, preference.level, dictionary);
+		Decompressor *newDecompressor = Decompressor::create(preference.codec, dictionary);
+		if (!newCompressor || !newDecompressor) {
+			delete newCompressor;
+			delete newDecompressor;
+			return false;
+		}
+		// Tell the client and end our zlib stream, the new codec follows
+		const uint32_t dictIdNet = htonl(dictId);
+		char answer[11] = { 0, 0, 0, 7, 'Z', preference.codec, (char)preference.level };
+		memcpy(answer + 7, &dictIdNet, sizeof dictIdNet);
+		if (!compressor->compress(answer, sizeof answer, Compressor::Finish, remote)) {
+			delete newCompressor;
+			delete newDecompressor;
+			return false;
+		}
+		delete compressor;
+		compressor = newCompressor;
+		decompressorNext = newDecompressor;
+		return true;
+	}
+	return true; // Nothing we like, stay with zlib
+}
+
+bool Compression::outgoing(const char *data, size_t size, QByteArray &remote) {
+	return compressor->compress(data, size, Compressor::SyncFlush, remote);
+}
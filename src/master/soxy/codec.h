@@ -0,0 +1,120 @@
+/*
+    Ucollect - small utility for real-time analysis of network data
+    Copyright (C) 2015 CZ.NIC, z.s.p.o. (http://www.nic.cz/)
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <QByteArray>
+#include <QList>
+#include <cstddef>
+#include <stdint.h>
+
+/*
+ * The compression codecs of the connection. Each connection starts with zlib
+ * and may switch to another codec, if the client offers it (see uplink.txt in
+ * the client).
+ *
+ * The codecs are identified by the same letters as on the wire.
+ */
+
+static const char CODEC_ZLIB = 'Z';
+static const char CODEC_ZSTD = 'S';
+static const char CODEC_LZ4 = 'L';
+// The window of zstd. The client refuses larger ones.
+static const int ZSTD_WINDOW_LOG = 17;
+
+// A trained dictionary, shared by the connections. Internal to the codecs.
+class Dictionary;
+
+class Compressor {
+public:
+	enum Flush {
+		NoFlush,
+		SyncFlush, // Make all the data so far available to the other side
+		Finish // End the stream
+	};
+	virtual ~Compressor() {}
+	// Compress the data and append the result to the output. Returns false on error.
+	virtual bool compress(const char *data, size_t size, Flush flush, QByteArray &output) = 0;
+	// Returns NULL for unknown codec. The dictionary may be NULL, the lz4 ignores it.
+	static Compressor *create(char codec, int level, const Dictionary *dict);
+};
+
+class Decompressor {
+public:
+	enum Status {
+		Ok,
+		End, // The stream ended, the rest of the data is not part of it
+		Error
+	};
+	virtual ~Decompressor() {}
+	/*
+	 * Decompress the data and append the result to the output. The data
+	 * and size are moved past what was consumed (everything, unless the
+	 * stream ended).
+	 */
+	virtual Status decompress(const char *&data, size_t &size, QByteArray &output) = 0;
+	static Decompressor *create(char codec, const Dictionary *dict);
+};
+
+/*
+ * The compression of a single connection, including the switch to another
+ * codec if the client offers one (in its first message).
+ */
+class Compression {
+public:
+	Compression();
+	~Compression();
+	/*
+	 * Data from the client. The decompressed data are appended to local,
+	 * anything to be sent back to the client to remote. Returns false on
+	 * broken data.
+	 */
+	bool incoming(const char *data, size_t size, QByteArray &local, QByteArray &remote);
+	// Data to the client. They are compressed and flushed into remote.
+	bool outgoing(const char *data, size_t size, QByteArray &remote);
+	// Add a codec we are willing to switch to. The ones added first are preferred.
+	static void addPreference(char codec, int level);
+	/*
+	 * Add a trained dictionary. It is used if the client has the same
+	 * one (by ID) and the codec is not lz4. Call after all the preferences
+	 * are added. Returns the
+	 * ID of the dictionary, 0 if it is not a trained dictionary or the ID
+	 * is already taken.
+	 */
+	static uint32_t addDictionary(const QByteArray &data);
+private:
+	Compression(const Compression &);
+	Compression &operator =(const Compression &);
+	bool handleOffer(const QByteArray &offer, QByteArray &remote);
+	Compressor *compressor;
+	Decompressor *decompressor, *decompressorNext;
+	bool decompressorEnded; // Waiting for the client to start the next codec
+	bool expectOffer; // The first message from the client was not seen yet
+	QByteArray firstMessage;
+	struct Preference {
+		char codec;
+		int level;
+	};
+	static QList<Preference> preferences;
+	static QList<const Dictionary *> dictionaries;
+	static const Dictionary *findDictionary(uint32_t id);
+};
+
+#endif
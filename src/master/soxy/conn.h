@@ -25,9 +25,9 @@
 #include <QByteArray>
 #include <QSslConfiguration>
 #include <QTimer>
-#include <zlib.h>
 
-static const int COMPRESSION_LEVEL = 9;
+class Compression;
+
 static const unsigned int COMPRESSION_BUFFSIZE = 4096;
 
 class Connection : public QObject {
@@ -41,10 +41,7 @@ private:
 	QLocalSocket local;
 	QTimer timer;
 	QByteArray inBuf, outBuf;
-	unsigned char compressOutBuffer[COMPRESSION_BUFFSIZE];
-	unsigned char decompressOutBuffer[COMPRESSION_BUFFSIZE];
-	z_stream zStreamCompress;
-	z_stream zStreamDecompress;
+	Compression *compression; // NULL if not compressed
 	bool inReady, outReady;
 	void touch();
 private slots:
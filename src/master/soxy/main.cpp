@@ -22,6 +22,7 @@
 #include <QSslCipher>
 #include <QSslKey>
 #include <QFile>
+#include <QDir>
 #include <QStringList>
 #include <cstdio>
 #include <sys/types.h>
@@ -34,6 +35,7 @@
 
 #include "handler.h"
 #include "conn.h"
+#include "codec.h"
 
 bool Connection::enableCompression = false;
 
@@ -73,27 +75,12 @@ void Handler::putFd(int fd) {
 QList<Handler *> handlers;
 
 Connection::Connection(int sock, QSslConfiguration &config) :
+	compression(NULL),
 	inReady(false),
 	outReady(false)
 {
-	memset(&zStreamCompress, 0, sizeof zStreamCompress);
-	memset(&zStreamDecompress, 0, sizeof zStreamDecompress);
-	zStreamCompress.zalloc = Z_NULL;
-	zStreamCompress.zfree = Z_NULL;
-	zStreamCompress.opaque = Z_NULL;
-	zStreamDecompress.zalloc = Z_NULL;
-	zStreamDecompress.zfree = Z_NULL;
-	zStreamDecompress.opaque = Z_NULL;
-	if (Connection::enableCompression) {
-		if (deflateInit(&zStreamCompress, COMPRESSION_LEVEL) != Z_OK) {
-			error("Could not initialize zlib (compression stream)");
-			return;
-		}
-		if (inflateInit(&zStreamDecompress) != Z_OK) {
-			error("Could not initialize zlib (decompression stream)");
-			return;
-		}
-	}
+	if (Connection::enableCompression)
+		compression = new Compression;
 	connect(&timer, SIGNAL(timeout()), SLOT(deleteLater()));
 	remote.setSocketDescriptor(sock);
 	remote.setSslConfiguration(config);
@@ -115,35 +102,21 @@ Connection::Connection(int sock, QSslConfiguration &config) :
 }
 
 Connection::~Connection() {
-	if (Connection::enableCompression) {
-		deflateEnd(&zStreamCompress);
-		inflateEnd(&zStreamDecompress);
-	}
+	delete compression;
 }
 
 void Connection::incoming() {
 	QByteArray ar = remote.read(COMPRESSION_BUFFSIZE);
 	if (ar.isEmpty())
 		return;
-	if (Connection::enableCompression) {
-		unsigned int available_output;
-		unsigned char *input_data = (unsigned char *)ar.data();
-		zStreamDecompress.next_in = input_data;
-		zStreamDecompress.avail_in = ar.size();
-
-		while (zStreamDecompress.avail_in > 0) {
-			zStreamDecompress.next_out = decompressOutBuffer;
-			zStreamDecompress.avail_out = COMPRESSION_BUFFSIZE;
-			int ret = inflate(&zStreamDecompress, Z_SYNC_FLUSH);
-			if (ret == Z_DATA_ERROR) {
-				deleteLater();
-				return;
-			}
-			available_output = COMPRESSION_BUFFSIZE - zStreamDecompress.avail_out;
-			if (available_output == 0)
-				return;
-			inBuf.append((char *)decompressOutBuffer, available_output);
+	if (compression) {
+		size_t pending = outBuf.size();
+		if (!compression->incoming(ar.constData(), ar.size(), inBuf, outBuf)) {
+			error("Broken compressed data");
+			return;
 		}
+		if (outBuf.size() != pending)
+			tryWriteRemote(); // Answer to the offer of codecs
 	} else {
 		inBuf += ar;
 	}
@@ -195,20 +168,10 @@ void Connection::outgoing() {
 	QByteArray ar = local.read(COMPRESSION_BUFFSIZE);
 	if (ar.isEmpty())
 		return;
-	if (Connection::enableCompression) {
-		unsigned int available_output;
-		unsigned char *input_data = (unsigned char *)ar.data();
-		zStreamCompress.next_in = input_data;
-		zStreamCompress.avail_in = ar.size();
-
-		while (zStreamCompress.avail_in > 0) {
-			zStreamCompress.next_out = compressOutBuffer;
-			zStreamCompress.avail_out = COMPRESSION_BUFFSIZE;
-			deflate(&zStreamCompress, Z_SYNC_FLUSH);
-			available_output = COMPRESSION_BUFFSIZE - zStreamCompress.avail_out;
-			if (available_output == 0)
-				return;
-			outBuf.append((char *)compressOutBuffer, available_output);
+	if (compression) {
+		if (!compression->outgoing(ar.constData(), ar.size(), outBuf)) {
+			error("Could not compress data");
+			return;
 		}
 	} else {
 		outBuf += ar;
@@ -327,8 +290,45 @@ int main(int argc, char *argv[]) {
 	addr.sin6_port = htons(QCoreApplication::arguments()[3].toInt());
 	c(bind(sock, static_cast<sockaddr *>(static_cast<void *>(&addr)), sizeof addr), "bind");
 	c(listen(sock, 50), "listen");
-	if (QCoreApplication::arguments().count() == 6 && QCoreApplication::arguments().at(5) == "compress") {
+	if (QCoreApplication::arguments().count() >= 6 && QCoreApplication::arguments().at(5) == "compress") {
 		Connection::enableCompression = true;
+		// The codecs to switch to, if the client supports them. Like zstd:3,lz4:1,zlib:9
+		if (QCoreApplication::arguments().count() >= 7)
+			foreach (const QString &codec, QCoreApplication::arguments().at(6).split(',', QString::SkipEmptyParts)) {
+				QStringList parts = codec.split(':');
+				char letter;
+				if (parts[0] == "zlib")
+					letter = CODEC_ZLIB;
+				else if (parts[0] == "zstd")
+					letter = CODEC_ZSTD;
+				else if (parts[0] == "lz4")
+					letter = CODEC_LZ4;
+				else {
+					fprintf(stderr, "Unknown codec %s\n", parts[0].toLocal8Bit().data());
+					return 1;
+				}
+				// Without a level, use the default of the library (0 is no compression in zlib, though)
+				int level = letter == CODEC_ZLIB ? 9 : 0;
+				if (parts.size() > 1)
+					level = parts[1].toInt();
+				Compression::addPreference(letter, level);
+			}
+		// The directory with the trained dictionaries. All of them are loaded, the client picks by the ID.
+		if (QCoreApplication::arguments().count() >= 8 && !QCoreApplication::arguments().at(7).isEmpty()) {
+			QDir dir(QCoreApplication::arguments().at(7));
+			foreach (const QString &name, dir.entryList(QStringList() << "*.dict", QDir::Files)) {
+				QFile file(dir.filePath(name));
+				if (!file.open(QIODevice::ReadOnly)) {
+					fprintf(stderr, "Could not open dictionary %s\n", name.toLocal8Bit().data());
+					continue;
+				}
+				uint32_t id = Compression::addDictionary(file.readAll());
+				if (id)
+					fprintf(stderr, "Loaded dictionary %s with ID %u\n", name.toLocal8Bit().data(), (unsigned) id);
+				else
+					fprintf(stderr, "Dictionary %s is not a trained one or has a duplicate ID\n", name.toLocal8Bit().data());
+			}
+		}
 	}
 	for (int *sig = sigs; *sig; sig ++) {
 		struct sigaction action;
@@ -2,10 +2,10 @@ TEMPLATE = app
 TARGET = soxy
 DEPENDPATH += .
 INCLUDEPATH += .
-LIBS += -lz
+LIBS += -lz -lzstd -llz4
 
 # Input
-SOURCES += main.cpp
-HEADERS += handler.h conn.h
+SOURCES += main.cpp codec.cpp
+HEADERS += handler.h conn.h codec.h
 QT += network
 QT -= gui
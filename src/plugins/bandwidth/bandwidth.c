@@ -214,6 +214,12 @@ void packet_handle(struct context *context, const struct packet_info *info) {
 		}
 	}
 }
+
+static void packet_batch_handle(struct context *context, const struct packet_info *const *packets, size_t count) {
+	for (size_t i = 0; i < count; i ++)
+		packet_handle(context, packets[i]);
+}
+
 static void communicate(struct context *context, const uint8_t *data, size_t length) {
 	struct user_data *d = context->user_data;
 
@@ -439,6 +445,12 @@ void init(struct context *context) {
 	}
 }
 
+#ifndef STATIC
+unsigned api_version() {
+	return UCOLLECT_PLUGIN_API_VERSION;
+}
+#endif
+
 #ifdef STATIC
 struct plugin *plugin_info_bandwidth(void) {
 #else
@@ -447,9 +459,11 @@ struct plugin *plugin_info(void) {
 	static struct plugin plugin = {
 		.name = "Bandwidth",
 		.packet_callback = packet_handle,
+		.packet_batch_callback = packet_batch_handle,
 		.init_callback = init,
 		.uplink_data_callback = communicate,
-		.version = 3
+		.version = 3,
+		.payload_limit = true
 	};
 	return &plugin;
 }
@@ -198,7 +198,7 @@ static void configure(struct context *context, const uint8_t *data, size_t lengt
 	for (size_t i = 0; i <= u->history_size; i ++) {
 		struct generation *g = &u->generations[i];
 		*g = (struct generation) {
-			.pool = loop_pool_create(context->loop, context, mem_pool_printf(context->temp_pool, "Generation %zu", i)),
+			.pool = loop_pool_create_huge(context->loop, context, mem_pool_printf(context->temp_pool, "Generation %zu", i)),
 			.criteria = mem_pool_alloc(context->permanent_pool, u->criteria_count * sizeof *g->criteria)
 		};
 		for (size_t j = 0; j < u->criteria_count; j ++)
@@ -471,7 +471,10 @@ static void packet(struct context *context, const struct packet_info *packet) {
 	if (u->biggest_timeslot >= u->max_timeslots)
 		// Nobody asked for data for way too long. The data will be unusable anyway..
 		return;
+	// The keys are needed only until they are stored, reuse the memory for each criterion
+	const struct mem_pool_mark mark = mem_pool_mark(context->temp_pool);
 	for (size_t i = 0; i < u->criteria_count; i ++) {
+		mem_pool_rewind(context->temp_pool, &mark);
 		// Extract the key first
 		const uint8_t *key = u->criteria[i]->extract_key(packet, context->temp_pool);
 		size_t length = u->criteria[i]->key_size;
@@ -139,6 +139,11 @@ static void packet_handle(struct context *context, const struct packet_info *inf
 	packet_handle_internal(context, info, info->length, false);
 }
 
+static void packet_batch_handle(struct context *context, const struct packet_info *const *packets, size_t count) {
+	for (size_t i = 0; i < count; i ++)
+		packet_handle_internal(context, packets[i], packets[i]->length, false);
+}
+
 static void initialize(struct context *context) {
 	context->user_data = mem_pool_alloc(context->permanent_pool, sizeof *context->user_data);
 	// We would initialize with {} to zero everything, but iso C doesn't seem to allow that.
@@ -193,6 +198,12 @@ static void communicate(struct context *context, const uint8_t *data, size_t len
 	};
 }
 
+#ifndef STATIC
+unsigned api_version() {
+	return UCOLLECT_PLUGIN_API_VERSION;
+}
+#endif
+
 #ifdef STATIC
 struct plugin *plugin_info_count(void) {
 #else
@@ -201,9 +212,11 @@ struct plugin *plugin_info(void) {
 	static struct plugin plugin = {
 		.name = "Count",
 		.packet_callback = packet_handle,
+		.packet_batch_callback = packet_batch_handle,
 		.init_callback = initialize,
 		.uplink_data_callback = communicate,
-		.version = 1
+		.version = 1,
+		.payload_limit = true
 	};
 	return &plugin;
 }
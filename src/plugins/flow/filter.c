@@ -23,6 +23,7 @@
 #include "../../libs/diffstore/diff_store.h"
 
 #include "../../core/trie.h"
+#include "../../core/trie_frozen.h"
 #include "../../core/mem_pool.h"
 #include "../../core/util.h"
 #include "../../core/packet.h"
@@ -45,7 +46,7 @@ struct filter {
 	filter_fun function;
 	size_t sub_count;
 	struct filter *subfilters;
-	struct trie *trie;
+	const struct trie_frozen *values; // For the value matches
 	const struct filter_type *type;
 	// Info for differential plugins
 	struct diff_addr_store *diff_addr_store;
@@ -116,7 +117,7 @@ static bool filter_value_match(struct mem_pool *tmp_pool, const struct filter *f
 			return false;
 	}
 	// Look if this one is one of the matched
-	return trie_lookup(filter->trie, data, size);
+	return trie_frozen_lookup(filter->values, data, size);
 }
 
 static bool filter_differential(struct mem_pool *tmp_pool, const struct filter *filter, const struct packet_info *packet) {
@@ -124,14 +125,14 @@ static bool filter_differential(struct mem_pool *tmp_pool, const struct filter *
 	if (endpoint == END_COUNT)
 		return false; // No packets with unknown direction pass the filter
 	// Check for IP address match first
-	if (trie_lookup(filter->diff_addr_store->trie, packet->addresses[endpoint], packet->addr_len))
+	if (trie_frozen_lookup(filter->diff_addr_store->frozen, packet->addresses[endpoint], packet->addr_len))
 		return true;
 	// We now abuse the fact that IP addresses have either 4 or 16 bytes. If it has 6 or 18, it can't be IP only, it must be IP + port
 	uint8_t *compound = mem_pool_alloc(tmp_pool, packet->addr_len + sizeof(uint16_t));
 	memcpy(compound, packet->addresses[endpoint], packet->addr_len);
 	uint16_t port_net = htons(packet->ports[endpoint]);
 	memcpy(compound + packet->addr_len, &port_net, sizeof port_net);
-	return trie_lookup(filter->diff_addr_store->trie, compound, packet->addr_len + sizeof port_net);
+	return trie_frozen_lookup(filter->diff_addr_store->frozen, compound, packet->addr_len + sizeof port_net);
 }
 
 static bool filter_range(struct mem_pool *tmp_pool, const struct filter *filter, const struct packet_info *packet) {
@@ -194,17 +195,19 @@ static void parse_ip_match(struct mem_pool *pool, struct filter *dest, const str
 	(*desc) += sizeof ip_count;
 	(*size) -= sizeof ip_count;
 	ip_count = ntohl(ip_count);
-	dest->trie = trie_alloc(pool);
+	struct trie *trie = trie_alloc(pool);
 	for (size_t i = 0; i < ip_count; i ++) {
 		sanity(*size, "Short data for IP address size in %c filter at IP #%zu\n", type->code, i);
 		uint8_t ip_size = **desc;
 		(*desc) ++;
 		(*size) --;
 		sanity(*size >= ip_size, "Short data for IP address in %c filter at IP %zu (available %zu, need %hhu)\n", type->code, i, *size, ip_size);
-		*trie_index(dest->trie, *desc, ip_size) = &mark;
+		*trie_index(trie, *desc, ip_size) = &mark;
 		(*desc) += ip_size;
 		(*size) -= ip_size;
 	}
+	// There's no temporary pool here. The configuration doesn't come often, so it's OK to waste a bit.
+	dest->values = trie_freeze(trie, pool, pool);
 }
 
 static void parse_port_match(struct mem_pool *pool, struct filter *dest, const struct filter_type *type, const uint8_t **desc, size_t *size) {
@@ -214,15 +217,16 @@ static void parse_port_match(struct mem_pool *pool, struct filter *dest, const s
 	(*desc) += sizeof port_count;
 	(*size) -= sizeof port_count;
 	port_count = ntohs(port_count);
-	dest->trie = trie_alloc(pool);
+	struct trie *trie = trie_alloc(pool);
 	for (size_t i = 0; i < port_count; i ++) {
 		uint16_t port;
 		sanity(*size >= sizeof port, "Short data for port in %c filter at port #%zu, only %zu available\n", type->code, i, *size);
 		memcpy(&port, *desc, sizeof port);
 		(*desc) += sizeof port;
 		(*size) -= sizeof port;
-		*trie_index(dest->trie, (const uint8_t *)&port, sizeof port) = &mark;
+		*trie_index(trie, (const uint8_t *)&port, sizeof port) = &mark;
 	}
+	dest->values = trie_freeze(trie, pool, pool);
 }
 
 static void parse_differential(struct mem_pool *pool, struct filter *dest, const struct filter_type *type, const uint8_t **desc, size_t *size) {
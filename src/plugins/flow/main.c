@@ -31,92 +31,216 @@
 #include "../../core/uplink.h"
 #include "../../core/util.h"
 #include "../../core/trie.h"
+#include "../../core/trie_snapshot.h"
 
 #include <arpa/inet.h>
 #include <string.h>
 #include <endian.h>
 
+// When there are too many flows, send this part of them (the ones idle for the longest time)
+#define EXPIRE_PART 4
+// The flows are sent in messages of at most this many, one message in each loop iteration
+#define SEND_CHUNK 1024
+// How often to save the flows (in ms). They are also saved on shutdown and after each flush.
+#define SNAPSHOT_INTERVAL 60000
+
 struct trie_data {
 	struct flow flow;
+	struct trie_data *next; // In the list of unused ones
 };
 
 struct user_data {
 	struct mem_pool *conf_pool, *flow_pool;
 	struct trie *trie;
+	struct trie_data *unused; // Flows already sent, to be reused
+	// The flows being sent (in their own pool, swapped with the flow_pool on each flush)
+	struct mem_pool *send_pool;
+	struct trie_iter *send_iter;
+	uint32_t send_conf_id;
+	size_t send_timeout_id;
+	bool sending;
 	struct filter *filter;
 	uint32_t conf_id;
 	uint32_t max_flows;
 	uint32_t timeout;
 	uint32_t min_packets;
 	size_t timeout_id;
+	size_t snapshot_timeout_id;
 	bool configured;
 	bool timeout_scheduled;
 	bool timeout_missed;
 };
 
-struct flush_data {
-	size_t size;
-	size_t i;
-	size_t *sizes;
-	size_t pos;
-	uint32_t min_packets;
-	uint8_t *output;
-};
+#define RECYCLER_NODE struct trie_data
+#define RECYCLER_BASE struct user_data
+#define RECYCLER_HEAD unused
+#define RECYCLER_NAME(X) flow_##X
+#include "../../core/recycler.h"
 
-static void get_size(const uint8_t *key, size_t key_size, struct trie_data *flow, void *userdata) {
-	struct flush_data *data = userdata;
-	(void)key;
-	(void)key_size;
-	if (flow && flow->flow.count[0] + flow->flow.count[1] >= data->min_packets) {
-		data->size += data->sizes[data->i ++] = flow_size(&flow->flow);
-	} else {
-		// Empty flow, created when the limit is reached.
-		data->sizes[data->i ++] = 0;
+// Send the flows in one message. The ones with too few packets are skipped.
+static bool flows_send(struct context *context, struct trie_data *const *flows, size_t count, uint32_t conf_id) {
+	struct user_data *u = context->user_data;
+	size_t *sizes = mem_pool_alloc(context->temp_pool, count * sizeof *sizes);
+	size_t header = sizeof(char) + sizeof(uint32_t) + sizeof(uint64_t);
+	size_t total_size = header;
+	for (size_t i = 0; i < count; i ++) {
+		if (flows[i] && flows[i]->flow.count[0] + flows[i]->flow.count[1] >= u->min_packets)
+			total_size += sizes[i] = flow_size(&flows[i]->flow);
+		else
+			sizes[i] = 0; // Empty flow, created when the limit is reached, or too small one
 	}
+	uint8_t *output = mem_pool_alloc(context->temp_pool, total_size);
+	*output = 'D';
+	uint32_t conf_id_net = htonl(conf_id);
+	memcpy(output + sizeof(char), &conf_id_net, sizeof conf_id_net);
+	uint64_t now = htobe64(loop_now(context->loop));
+	memcpy(output + sizeof(char) + sizeof conf_id_net, &now, sizeof now);
+	size_t pos = header;
+	for (size_t i = 0; i < count; i ++)
+		if (sizes[i]) {
+			flow_render(output + pos, sizes[i], &flows[i]->flow);
+			pos += sizes[i];
+		}
+	sanity(pos == total_size, "Wrong size after flow flush: %zu/%zu\n", pos, total_size);
+	return uplink_plugin_send_message(context, output, total_size);
 }
 
-static void format_flow(const uint8_t *key, size_t key_size, struct trie_data *flow, void *userdata) {
-	struct flush_data *data = userdata;
-	(void)key;
-	(void)key_size;
-	if (flow && flow->flow.count[0] + flow->flow.count[1] >= data->min_packets) {
-		flow_render(data->output + data->pos, data->sizes[data->i], &flow->flow);
-		data->pos += data->sizes[data->i ++];
-	} else {
-		// Empty flow, skip
-		data->i ++;
+static const void *snapshot_encode(const uint8_t *key, size_t key_size, struct trie_data *data, size_t *size, void *userdata) {
+	(void) key;
+	(void) key_size;
+	(void) userdata;
+	if (!data)
+		return NULL;
+	*size = sizeof data->flow;
+	return &data->flow;
+}
+
+static struct trie_data *snapshot_decode(const uint8_t *key, size_t key_size, const uint8_t *blob, size_t size, void *userdata) {
+	(void) key;
+	(void) key_size;
+	struct user_data *u = userdata;
+	if (size != sizeof(struct flow)) {
+		ulog(LLOG_WARN, "Flow of wrong size %zu in the snapshot, skipping\n", size);
+		return NULL;
 	}
+	struct trie_data *result = flow_get(u, u->flow_pool);
+	memcpy(&result->flow, blob, size);
+	return result;
+}
+
+/*
+ * Save the current flows, tagged with the config ID. The ones being sent are
+ * not included, they'll be gone in few moments anyway. The periodic saves
+ * don't sync, to not block the loop on the disk.
+ */
+static void snapshot_save(struct context *context, bool sync) {
+	struct user_data *u = context->user_data;
+	if (!u->configured)
+		return; // Don't overwrite a snapshot we didn't get to load yet
+	trie_snapshot_save(u->trie, "flow.snapshot", u->conf_id, sync, snapshot_encode, u, context->temp_pool);
+}
+
+static void snapshot_fired(struct context *context, void *unused_data, size_t id) {
+	(void) unused_data;
+	(void) id;
+	snapshot_save(context, false);
+	context->user_data->snapshot_timeout_id = loop_timeout_add(context->loop, SNAPSHOT_INTERVAL, context, NULL, snapshot_fired);
+}
+
+// Send another piece of the flows being sent. Returns if there are more.
+static bool send_chunk(struct context *context) {
+	struct user_data *u = context->user_data;
+	struct trie_data **flows = mem_pool_alloc(context->temp_pool, SEND_CHUNK * sizeof *flows);
+	size_t count = 0;
+	const uint8_t *key;
+	size_t key_size;
+	while (count < SEND_CHUNK && trie_iter_next(u->send_iter, &key, &key_size, &flows[count]))
+		count ++;
+	if (count && !flows_send(context, flows, count, u->send_conf_id))
+		ulog(LLOG_WARN, "Failed to send %zu flows, dropping them\n", count);
+	if (count == SEND_CHUNK)
+		return true;
+	// All sent
+	mem_pool_reset(u->send_pool);
+	u->send_iter = NULL;
+	u->sending = false;
+	return false;
+}
+
+static void send_continue(struct context *context, void *unused_data, size_t id) {
+	(void) unused_data;
+	(void) id;
+	struct user_data *u = context->user_data;
+	if (send_chunk(context))
+		// Let the packets in the meantime
+		u->send_timeout_id = loop_timeout_add(context->loop, 0, context, NULL, send_continue);
+}
+
+// Send the rest of the flows being sent right away
+static void send_finish(struct context *context) {
+	struct user_data *u = context->user_data;
+	if (!u->sending)
+		return;
+	loop_timeout_cancel(context->loop, u->send_timeout_id);
+	const struct mem_pool_mark mark = mem_pool_mark(context->temp_pool);
+	while (send_chunk(context))
+		mem_pool_rewind(context->temp_pool, &mark);
 }
 
+/*
+ * Send all the flows. The table is replaced by an empty one right away, but
+ * the old one is sent in pieces over several loop iterations, so the
+ * packets are not held up by a large table.
+ */
 static bool flush(struct context *context, bool force) {
 	if (!force && !uplink_connected(context->uplink))
 		return false; // Don't try to send if we are not connected.
 	struct user_data *u = context->user_data;
-	size_t header = sizeof(char) + sizeof(uint32_t) + sizeof(uint64_t);
-	struct flush_data d = {
-		.sizes = mem_pool_alloc(context->temp_pool, trie_size(u->trie) * sizeof *d.sizes),
-		.pos = header,
-		.min_packets = u->min_packets
-	};
+	send_finish(context); // We need the pool of the previous ones
 	ulog(LLOG_INFO, "Sending %zu flows\n", trie_size(u->trie));
-	trie_walk(u->trie, get_size, &d, context->temp_pool);
-	sanity(d.i == trie_size(u->trie), "Wrong number of flows counted: %zu/%zu\n", d.i, trie_size(u->trie));
-	size_t total_size = header + d.size;
-	d.output = mem_pool_alloc(context->temp_pool, total_size);
-	*d.output = 'D';
-	uint32_t conf_id = htonl(u->conf_id);
-	memcpy(d.output + sizeof(char), &conf_id, sizeof conf_id);
-	uint64_t now = htobe64(loop_now(context->loop));
-	memcpy(d.output + sizeof(char) + sizeof conf_id, &now, sizeof now);
-	d.i = 0;
-	trie_walk(u->trie, format_flow, &d, context->temp_pool);
-	sanity(d.i == trie_size(u->trie), "Wrong number of flows flushed: %zu/%zu\n", d.i, trie_size(u->trie));
-	sanity(d.pos == total_size, "Wrong size after flow flush: %zu/%zu\n", d.pos, total_size);
-	if (!uplink_plugin_send_message(context, d.output, total_size) && !force)
-		return false; // Don't clean the data if we failed to send. But do clean them if the force is in effect, to not overflow the limit by too much
-	mem_pool_reset(u->flow_pool);
-	u->trie = trie_alloc(u->flow_pool);
+	struct mem_pool *pool = u->send_pool;
+	u->send_pool = u->flow_pool;
+	u->flow_pool = pool;
+	u->send_iter = trie_iter_begin(u->trie, u->send_pool);
+	u->send_conf_id = u->conf_id;
+	u->sending = true;
+	u->trie = trie_alloc_ordered(u->flow_pool, true);
+	u->unused = NULL;
 	u->timeout_missed = false;
+	if (send_chunk(context))
+		u->send_timeout_id = loop_timeout_add(context->loop, 0, context, NULL, send_continue);
+	// The old snapshot holds the flows just sent, don't let them come back after a restart
+	snapshot_save(context, true);
+	return true;
+}
+
+/*
+ * Send only the flows not seen for the longest time and forget them, to make
+ * space for new ones. The newest flow is always kept (it is the one we make
+ * the space for).
+ */
+static bool expire(struct context *context, bool force) {
+	if (!force && !uplink_connected(context->uplink))
+		return false;
+	struct user_data *u = context->user_data;
+	size_t count = u->max_flows / EXPIRE_PART;
+	if (!count)
+		count = 1;
+	if (count >= trie_size(u->trie))
+		count = trie_size(u->trie) - 1;
+	ulog(LLOG_INFO, "Expiring %zu oldest flows out of %zu\n", count, trie_size(u->trie));
+	struct trie_data **flows = mem_pool_alloc(context->temp_pool, count * sizeof *flows);
+	for (size_t i = 0; i < count; i ++) {
+		size_t key_size;
+		const uint8_t *key = trie_oldest(u->trie, &key_size, &flows[i], context->temp_pool);
+		trie_delete(u->trie, key, key_size);
+	}
+	// The flows are out of the trie already, there's no way back
+	if (!flows_send(context, flows, count, u->conf_id))
+		ulog(LLOG_WARN, "Failed to send %zu expired flows, dropping them\n", count);
+	for (size_t i = 0; i < count; i ++)
+		if (flows[i])
+			flow_release(u, flows[i]);
 	return true;
 }
 
@@ -162,6 +286,16 @@ static void configure(struct context *context, uint32_t conf_id, uint32_t max_fl
 		schedule_timeout(context);
 	u->filter = filter_parse(u->conf_pool, filter_desc, filter_size);
 	u->min_packets = min_packets;
+	if (!u->configured) {
+		/*
+		 * Pick up the flows from before a restart. Only if they were
+		 * gathered with the same config and are not older than one
+		 * gathering period. The snapshot is not loaded after a reboot,
+		 * so the times in the flows stay comparable.
+		 */
+		uint64_t max_age = timeout / 1000 ? timeout / 1000 : 1;
+		trie_snapshot_load(u->trie, "flow.snapshot", conf_id, max_age, snapshot_decode, u);
+	}
 	u->configured = true;
 }
 
@@ -175,26 +309,21 @@ static void packet_handle(struct context *context, const struct packet_info *inf
 		return; // Broken packet, we don't want that
 	if (info->layer != 'I' || (info->ip_protocol != 4 && info->ip_protocol != 6) || (info->app_protocol != 'T' && info->app_protocol != 'U'))
 		return; // Something we don't track
+	const struct mem_pool_mark mark = mem_pool_mark(context->temp_pool);
 	if (!filter_apply(context->temp_pool, u->filter, info))
 		return; // This packet is not interesting
+	mem_pool_rewind(context->temp_pool, &mark); // Drop the scratch memory of the filter
 	size_t key_size;
 	uint8_t *key = flow_key(info, &key_size, context->temp_pool);
 	struct trie_data **data = trie_index(u->trie, key, key_size);
 	sanity(data, "Trie index fault\n");
 	if (!*data) {
 		// We don't have this flow yet
-		if (trie_size(u->trie) >= u->max_flows) {
-			// We are full, no space for another flow
-			flush(context, trie_size(u->trie) >= 2 * u->max_flows);
-			sanity(u->timeout_scheduled, "Missing timeout after flush\n");
-			loop_timeout_cancel(context->loop, u->timeout_id);
-			u->timeout_scheduled = false;
-			schedule_timeout(context);
-			// We may have destroyed the previous trie, index the new one
+		if (trie_size(u->trie) > u->max_flows && expire(context, trie_size(u->trie) > 2 * u->max_flows))
+			// The trie changed, find the place again
 			data = trie_index(u->trie, key, key_size);
-		}
 		ulog(LLOG_DEBUG_VERBOSE, "Creating new flow\n");
-		*data = mem_pool_alloc(u->flow_pool, sizeof **data);
+		*data = flow_get(u, u->flow_pool);
 		flow_parse(&(*data)->flow, info);
 	}
 	// Add to statisticts
@@ -219,13 +348,25 @@ static void connected(struct context *context) {
 		flush(context, false);
 }
 
+static void memory_pressure(struct context *context, bool hard) {
+	struct user_data *u = context->user_data;
+	if (!u->configured)
+		return; // No flows gathered yet
+	// Send what we have early. If it's urgent, drop the flows even if they can't be sent.
+	u->timeout_missed = !flush(context, hard);
+	if (hard)
+		send_finish(context); // Release the memory now
+}
+
 static void initialize(struct context *context) {
 	context->user_data = mem_pool_alloc(context->permanent_pool, sizeof *context->user_data);
-	struct mem_pool *flow_pool = loop_pool_create(context->loop, context, "Flow pool");
+	struct mem_pool *flow_pool = loop_pool_create_huge(context->loop, context, "Flow pool");
 	*context->user_data = (struct user_data) {
 		.conf_pool = loop_pool_create(context->loop, context, "Flow conf pool"),
 		.flow_pool = flow_pool,
-		.trie = trie_alloc(flow_pool)
+		.send_pool = loop_pool_create_huge(context->loop, context, "Flow send pool"),
+		.trie = trie_alloc_ordered(flow_pool, true),
+		.snapshot_timeout_id = loop_timeout_add(context->loop, SNAPSHOT_INTERVAL, context, NULL, snapshot_fired)
 	};
 	/*
 	 * Ask for config right away. In case we get reloaded, we won't
@@ -237,6 +378,12 @@ static void initialize(struct context *context) {
 	connected(context);
 }
 
+static void finish(struct context *context) {
+	// Send what is in progress and keep the rest for the next start
+	send_finish(context);
+	snapshot_save(context, true);
+}
+
 struct config {
 	uint32_t conf_id;
 	uint32_t max_flows;
@@ -373,14 +520,26 @@ struct plugin *plugin_info(void) {
 		&diff_addr_store_apply_import,
 		NULL
 	};
+	static const struct packet_interest tcp = { .layer = 'I', .app_protocol = 'T' };
+	static const struct packet_interest udp = { .layer = 'I', .app_protocol = 'U' };
+	static const struct packet_interest *const interests[] = {
+		&tcp,
+		&udp,
+		NULL
+	};
 	static struct plugin plugin = {
 		.packet_callback = packet_handle,
 		.init_callback = initialize,
+		.finish_callback = finish,
 		.uplink_connected_callback = connected,
 		.uplink_data_callback = communicate,
 		.name = "Flow",
 		.version = 2,
-		.imports = imports
+		.imports = imports,
+		.interests = interests,
+		.payload_limit = true,
+		.packet_innermost = true,
+		.memory_pressure_callback = memory_pressure
 	};
 	return &plugin;
 }
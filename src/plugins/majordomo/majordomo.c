@@ -35,7 +35,7 @@
 #include "../../core/packet.h"
 #include "../../core/uplink.h"
 #include "../../core/loop.h"
-#include "../../core/trie.h"
+#include "../../core/trie_lpm.h"
 
 #define DUMP_FILE_DST "/tmp/ucollect_majordomo"
 #define SOURCE_SIZE_LIMIT 6000
@@ -64,7 +64,7 @@ struct key {
 	uint16_t port;
 };
 
-struct trie_data {
+struct comm_data {
 	uint64_t u_count;
 	uint64_t u_size;
 	uint64_t u_data_size;
@@ -80,7 +80,7 @@ struct src_key {
 
 struct src_item {
 	struct src_key from;
-	struct trie_data other;
+	struct comm_data other;
 	size_t items_in_comm_list;
 	struct src_item *next;
 	struct src_item *prev;
@@ -100,48 +100,32 @@ struct src_items {
 #define LIST_WANT_LFOR
 #include "../../core/link_list.h"
 
-struct filter_rule {
-	struct in6_addr addr;
-	size_t prefix;
-	int family;
+// The key is hashed and compared as bytes, build_key zeroes its padding
+#define HASH_MAP_KEY struct key
+#define HASH_MAP_VALUE struct comm_data
+#define HASH_MAP_NAME(X) comm_##X
+#include "../../core/hash_map.h"
+
+struct trie_lpm_data {
+	int dummy; // Just to prevent warning about empty struct
 };
 
+static struct trie_lpm_data ignored_subnet; // To have a valid pointer to something, not used by itself
+
 struct user_data {
 	FILE *file;
-	struct trie *communication;
+	struct comm_map communication;
 	struct src_items sources;
 	struct mem_pool *data_pool;
 	struct mem_pool *config_pool;
-	struct filter_rule *filter;
-	size_t filter_size;
+	// The ignored subnets, for IPv4 and IPv6
+	struct trie_lpm *filter_v4, *filter_v6;
 	size_t timeout;
 	char *src_str;
 	char *dst_str;
 	FILE *dump_file;
 };
 
-static uint32_t masks[33];
-
-static void precompute_masks() {
-	uint32_t mask = 0xFFFFFFFF;
-
-	for (ssize_t i = 32; i >= 0; i--) {
-		masks[i] = htonl(mask);
-		mask <<= 1;
-	}
-}
-
-static bool bitcmp(uint32_t *a, uint32_t *b, size_t bits) {
-	while (bits > 32) {
-		if (a[0] != b[0]) return false;
-		a++;
-		b++;
-		bits -= 32;
-	}
-
-	return ((a[0] & masks[bits]) == (b[0] & masks[bits]));
-}
-
 static bool parse_address(const char *addrstr, struct in6_addr *addr, int *family) {
 	if (inet_pton(AF_INET, addrstr, addr) == 1) {
 		*family = 4;
@@ -155,7 +139,7 @@ static bool parse_address(const char *addrstr, struct in6_addr *addr, int *famil
 	return false;
 }
 
-static void get_string_from_raw_bytes(unsigned char *bytes, unsigned char addr_len, char output[ADDRSTRLEN]) {
+static void get_string_from_raw_bytes(const unsigned char *bytes, unsigned char addr_len, char output[ADDRSTRLEN]) {
 	if (addr_len == 4) {
 		struct in_addr addr;
 
@@ -182,7 +166,7 @@ static void get_string_from_raw_bytes(unsigned char *bytes, unsigned char addr_l
 	}
 }
 
-static void update_value(struct trie_data *value, enum direction direction, uint64_t size, uint64_t data_size) {
+static void update_value(struct comm_data *value, enum direction direction, uint64_t size, uint64_t data_size) {
 	if (direction == DIRECTION_UPLOAD) {
 		value->u_count++;
 		value->u_size += size;
@@ -197,26 +181,22 @@ static void update_value(struct trie_data *value, enum direction direction, uint
 	}
 }
 
-static struct key* build_key(struct mem_pool *pool,
+static void build_key(struct key *key,
 	const unsigned char *from, unsigned char from_addr_len,
 	const unsigned char *to, unsigned char to_addr_len,
 	char protocol, uint64_t port
 	) {
 
-	struct key *key = mem_pool_alloc(pool, sizeof *key);
 	memset(key, 0, sizeof *key);
 	memcpy(key->from, from, from_addr_len);
 	memcpy(key->to, to, to_addr_len);
 	key->from_addr_len = from_addr_len;
 	key->to_addr_len = to_addr_len;
 	key->protocol = protocol; key->port = port;
-
-	return key;
 }
 
-static void init_trie_data(struct mem_pool *pool, struct trie_data **data, const struct packet_info *info) {
-	*data = mem_pool_alloc(pool, sizeof **data);
-	**data = (struct trie_data) {
+static void init_comm_data(struct comm_data *data, const struct packet_info *info) {
+	*data = (struct comm_data) {
 		.u_count = 1,
 		.u_size = info->length,
 		.u_data_size = info->length - info->hdr_length
@@ -235,15 +215,10 @@ static struct src_item *find_src(struct src_items *sources, const unsigned char
 }
 
 static bool filter_address(struct user_data *d, const void *addr_bytes, int family) {
-	struct in6_addr addr;
-	memcpy(&addr, addr_bytes, (family == 4 ? 4 : 16));
-
-	for (size_t i = 0; i < d->filter_size; i++) {
-		if (family == d->filter[i].family && bitcmp((uint32_t *) &addr, (uint32_t *) &(d->filter[i].addr), d->filter[i].prefix))
-			return true;
-	}
-
-	return false;
+	if (family == 4)
+		return d->filter_v4 && trie_lpm_lookup(d->filter_v4, addr_bytes, 32);
+	else
+		return d->filter_v6 && trie_lpm_lookup(d->filter_v6, addr_bytes, 128);
 }
 
 void packet_handle(struct context *context, const struct packet_info *info) {
@@ -281,18 +256,19 @@ void packet_handle(struct context *context, const struct packet_info *info) {
 		return;
 
 	// Check situation about this packet
-	struct key *key = build_key(context->temp_pool,
+	struct key key;
+	build_key(&key,
 			l2->addresses[local_endpoint], l2->addr_len,
 			info->addresses[remote_endpoint], info->addr_len,
 			info->app_protocol, info->ports[remote_endpoint]
 	);
 
-	struct trie_data **data = trie_index(d->communication, (uint8_t *) key, sizeof *key);
+	struct comm_data *data = comm_find(&d->communication, &key);
 
 	// Item exists
-	if (*data != NULL) {
+	if (data != NULL) {
 		//Update info
-		update_value(*data, l2->direction, info->length, (info->length - info->hdr_length));
+		update_value(data, l2->direction, info->length, (info->length - info->hdr_length));
 		return;
 	}
 
@@ -300,12 +276,12 @@ void packet_handle(struct context *context, const struct packet_info *info) {
 	struct src_item *src = find_src(&(d->sources), l2->addresses[local_endpoint], l2->addr_len);
 	// This is first communication from this source
 	if (src == NULL) {
-		init_trie_data(d->data_pool, data, info);
+		init_comm_data(comm_insert(&d->communication, &key, NULL), info);
 
 		src = src_items_append_pool(&(d->sources), d->data_pool);
 		memcpy(src->from.addr, l2->addresses[local_endpoint], l2->addr_len);
 		src->from.addr_len = l2->addr_len;
-		src->other = (struct trie_data) {
+		src->other = (struct comm_data) {
 			.u_count = 0 // Init all with zero
 		};
 		src->items_in_comm_list = 1;
@@ -313,7 +289,7 @@ void packet_handle(struct context *context, const struct packet_info *info) {
 	} else {
 		// Source has some records; check its limit
 		if (src->items_in_comm_list < SOURCE_SIZE_LIMIT) {
-			init_trie_data(d->data_pool, data, info);
+			init_comm_data(comm_insert(&d->communication, &key, NULL), info);
 		} else {
 			// Source exceeded the limit - update its 'other' value
 			update_value(&(src->other), l2->direction, info->length, (info->length - info->hdr_length));
@@ -321,10 +297,7 @@ void packet_handle(struct context *context, const struct packet_info *info) {
 	}
 }
 
-static void dump_item(const uint8_t *key_bytes, size_t key_size, struct trie_data *data, void *userdata) {
-	struct user_data *d = (struct user_data *) userdata;
-	struct key *key = (struct key *) key_bytes;
-	(void) key_size;
+static void dump_item(struct user_data *d, const struct key *key, const struct comm_data *data) {
 
 	get_string_from_raw_bytes(key->from, key->from_addr_len, d->src_str);
 	get_string_from_raw_bytes(key->to, key->to_addr_len, d->dst_str);
@@ -363,7 +336,8 @@ static void dump(struct context *context) {
 		return;
 	}
 
-	trie_walk(d->communication, dump_item, d, context->temp_pool);
+	HFOR(comm, item, &d->communication)
+		dump_item(d, &item->key, &item->value);
 
 	LFOR(src_items, it, &(d->sources)) {
 		get_string_from_raw_bytes(it->from.addr, it->from.addr_len, d->src_str);
@@ -389,7 +363,7 @@ static void dump(struct context *context) {
 	d->sources.head = NULL;
 	d->sources.tail = NULL;
 	d->sources.count = 0;
-	d->communication = trie_alloc(d->data_pool);
+	comm_clear(&d->communication);
 	//Close dump file
 	fclose(d->dump_file);
 }
@@ -414,9 +388,7 @@ void init(struct context *context) {
 		.src_str = mem_pool_alloc(context->permanent_pool, ADDRSTRLEN),
 		.dst_str = mem_pool_alloc(context->permanent_pool, ADDRSTRLEN)
 	};
-	context->user_data->communication = trie_alloc(context->user_data->data_pool),
-
-	precompute_masks();
+	comm_init(&context->user_data->communication, loop_slab_create(context->loop, context, "Majordomo communication slab"));
 }
 
 static bool parse_option(struct mem_pool *temp_pool, const char *cfg_line, struct in6_addr *addr, size_t *prefix, int *family) {
@@ -466,18 +438,22 @@ void finish_config(struct context *context, bool commit) {
 	// Reset pool with old configuration
 	mem_pool_reset(d->config_pool);
 	// Empty filter is acceptable
-	d->filter = NULL;
-	d->filter_size = 0;
+	d->filter_v4 = NULL;
+	d->filter_v6 = NULL;
 
 	const struct config_node *conf = loop_plugin_option_get(context, "ignore_subnet");
 	if (!conf)
 		return;
-	d->filter_size = conf->value_count;
-	d->filter = mem_pool_alloc(d->config_pool, d->filter_size * sizeof(*d->filter));
+	d->filter_v4 = trie_lpm_alloc(d->config_pool);
+	d->filter_v6 = trie_lpm_alloc(d->config_pool);
 
 	// Parse (again) new configuration and store it
-	for (size_t i = 0; i < d->filter_size; i++) {
-		parse_option(context->temp_pool, conf->values[i], &(d->filter[i].addr), &(d->filter[i].prefix), &(d->filter[i].family));
+	for (size_t i = 0; i < conf->value_count; i++) {
+		struct in6_addr addr;
+		size_t prefix;
+		int family;
+		parse_option(context->temp_pool, conf->values[i], &addr, &prefix, &family);
+		*trie_lpm_insert(family == 4 ? d->filter_v4 : d->filter_v6, (const uint8_t *) &addr, prefix) = &ignored_subnet;
 		ulog(LLOG_DEBUG, "Majordomo: Add %s to subnet filter\n", conf->values[i]);
 	}
 }
@@ -486,18 +462,40 @@ void destroy(struct context *context) {
 	dump(context);
 }
 
+static void memory_pressure(struct context *context, bool hard) {
+	(void) hard;
+	// Dumping the data to the file releases them
+	dump(context);
+}
+
+#ifndef STATIC
+unsigned api_version() {
+	return UCOLLECT_PLUGIN_API_VERSION;
+}
+#endif
+
 #ifdef STATIC
 struct plugin *plugin_info_majordomo(void) {
 #else
 struct plugin *plugin_info(void) {
 #endif
+	static const struct packet_interest tcp = { .layer = 'I', .app_protocol = 'T' };
+	static const struct packet_interest udp = { .layer = 'I', .app_protocol = 'U' };
+	static const struct packet_interest *const interests[] = {
+		&tcp,
+		&udp,
+		NULL
+	};
 	static struct plugin plugin = {
 		.name = "Majordomo",
 		.packet_callback = packet_handle,
 		.init_callback = init,
 		.finish_callback = destroy,
 		.config_check_callback = check_config,
-		.config_finish_callback = finish_config
+		.config_finish_callback = finish_config,
+		.interests = interests,
+		.payload_limit = true,
+		.memory_pressure_callback = memory_pressure
 	};
 	return &plugin;
 }
@@ -41,7 +41,9 @@ struct ports {
 char nak_parse(const struct packet_info *packet, size_t *addr_len, const uint8_t **addr, uint16_t *loc_port, uint16_t *dest_port) {
 	assert(packet->layer == 'I');
 	assert(packet->app_protocol == 'I' || packet->app_protocol == 'i');
-	size_t data_len = packet->length - packet->hdr_length;
+	if (packet->captured < packet->hdr_length)
+		return '\0'; // Cut off by the snaplen
+	size_t data_len = packet->captured - packet->hdr_length;
 	const uint8_t *data = (const uint8_t *)packet->data + packet->hdr_length;
 	if (data_len < sizeof(struct header))
 		return '\0'; // Too short to contain ICMP
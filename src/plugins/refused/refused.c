@@ -446,18 +446,39 @@ static void init(struct context *context) {
 	connected(context);
 }
 
+#ifndef STATIC
+unsigned api_version() {
+	return UCOLLECT_PLUGIN_API_VERSION;
+}
+#endif
+
 #ifdef STATIC
 struct plugin *plugin_info_refused(void) {
 #else
 struct plugin *plugin_info(void) {
 #endif
+	// We look only at the connection attempts and the refusals
+	static const struct packet_interest tcp = { .layer = 'I', .app_protocol = 'T', .tcp_flags = TCP_SYN | TCP_RESET };
+	static const struct packet_interest icmp = { .layer = 'I', .app_protocol = 'i' };
+	static const struct packet_interest icmp6 = { .layer = 'I', .app_protocol = 'I' };
+	static const struct packet_interest *const interests[] = {
+		&tcp,
+		&icmp,
+		&icmp6,
+		NULL
+	};
 	static struct plugin plugin = {
 		.name = "Refused",
 		.init_callback = init,
 		.packet_callback = packet,
 		.uplink_connected_callback = connected,
 		.uplink_data_callback = uplink_data,
-		.version = 1
+		.version = 1,
+		.interests = interests,
+		// ICMP errors carry the offending IP header and the ports after it
+		.payload_limit = true,
+		.payload_len = 128,
+		.packet_innermost = true
 	};
 	return &plugin;
 }
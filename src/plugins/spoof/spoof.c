@@ -153,6 +153,8 @@ static void received(struct context *context, const struct packet_info *info) {
 		return; // Different address
 	if (ip->length - ip->hdr_length != sizeof u->expected_packet)
 		return; // Packet of a wrong length
+	if (ip->captured < ip->hdr_length + sizeof u->expected_packet)
+		return; // We don't have the whole content
 	if (memcmp((const uint8_t *)ip->data + ip->hdr_length, &u->expected_packet, sizeof u->expected_packet) != 0)
 		return; // The content of packet is different
 	const struct packet_info *ether = info;
@@ -248,6 +250,12 @@ static void communicate(struct context *context, const uint8_t *data, size_t len
 	}
 }
 
+#ifndef STATIC
+unsigned api_version() {
+	return UCOLLECT_PLUGIN_API_VERSION;
+}
+#endif
+
 #ifdef STATIC
 struct plugin *plugin_info_spoof(void) {
 #else
@@ -258,7 +266,9 @@ struct plugin *plugin_info(void) {
 		.init_callback = init,
 		.uplink_data_callback = communicate,
 		.packet_callback = received,
-		.version = 1
+		.version = 1,
+		.payload_limit = true,
+		.payload_len = sizeof(struct packet_data)
 	};
 	return &plugin;
 }
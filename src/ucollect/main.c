@@ -41,6 +41,9 @@ static void dump_stats(struct context *context, void *data, size_t id) {
 		ulog(LLOG_INFO, "Mempool stats: %s\n", tok);
 	}
 	ulog(LLOG_INFO, "Mempool stats done\n");
+	// Refresh the CPU stats in the status file and send them to the server (which starts new period)
+	uplink_status_refresh(uplink);
+	loop_cpu_stats_send(loop);
 	loop_timeout_add(loop, STAT_DUMP_TIMEOUT, NULL, NULL, dump_stats);
 }
 
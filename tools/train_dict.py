@@ -0,0 +1,75 @@
+#!/usr/bin/python
+#
+#    Ucollect - small utility for real-time analysis of network data
+#    Copyright (C) 2015 CZ.NIC, z.s.p.o. (http://www.nic.cz/)
+#
+#    This program is free software; you can redistribute it and/or modify
+#    it under the terms of the GNU General Public License as published by
+#    the Free Software Foundation; either version 2 of the License, or
+#    (at your option) any later version.
+#
+#    This program is distributed in the hope that it will be useful,
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#    GNU General Public License for more details.
+#
+#    You should have received a copy of the GNU General Public License along
+#    with this program; if not, write to the Free Software Foundation, Inc.,
+#    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+#
+
+# Train a dictionary for the uplink compression from a capture of the
+# messages from the clients (the capture option of the collection master).
+#
+# The ID of the dictionary is the protocol version in the upper 16 bits and
+# the revision in the lower ones. The client looks for the dictionary of its
+# protocol version in /usr/share/ucollect/uplink-<version>.dict, the soxy
+# loads all the *.dict files in the compression_dicts directory. Bump the
+# revision with each new dictionary, so the old clients still find theirs.
+#
+# Needs the zstandard module (https://pypi.python.org/pypi/zstandard).
+
+import argparse
+import struct
+import sys
+import zstandard
+
+parser = argparse.ArgumentParser(description='Train a compression dictionary for the uplink.')
+parser.add_argument('-p', '--protocol', type=int, default=1, help='The protocol version of the clients (default 1)')
+parser.add_argument('-r', '--revision', type=int, required=True, help='Revision of the dictionary, 1 to 65535')
+parser.add_argument('-s', '--size', type=int, default=16384, help='Size of the dictionary in bytes (default 16384)')
+parser.add_argument('-o', '--output', required=True, help='Where to store the dictionary')
+parser.add_argument('captures', nargs='+', help='The capture files')
+args = parser.parse_args()
+
+if not 0 < args.revision < 2 ** 16 or not 0 < args.protocol < 2 ** 16:
+	sys.exit('The protocol version and revision must be between 1 and 65535')
+
+# Each message is a sample, including its length (it is compressed too)
+samples = []
+for name in args.captures:
+	with open(name, 'rb') as f:
+		data = f.read()
+	pos = 0
+	while pos + 4 <= len(data):
+		(length,) = struct.unpack('!I', data[pos:pos + 4])
+		if pos + 4 + length > len(data):
+			break # Truncated at the end, the master was probably writing it
+		samples.append(data[pos:pos + 4 + length])
+		pos += 4 + length
+
+if len(samples) < 1000:
+	sys.exit('Only %d messages in the capture, need more to train' % len(samples))
+
+dict_id = (args.protocol << 16) | args.revision
+dictionary = zstandard.train_dictionary(args.size, samples, dict_id=dict_id)
+with open(args.output, 'wb') as f:
+	f.write(dictionary.as_bytes())
+
+# How much it helps on the short messages at the start of a connection
+def compressed(dict_data):
+	compressor = zstandard.ZstdCompressor(level=3, dict_data=dict_data)
+	return sum(len(compressor.compress(sample)) for sample in samples[:1000])
+plain = sum(len(sample) for sample in samples[:1000])
+print('Dictionary %d (%d bytes) from %d messages' % (dict_id, len(dictionary.as_bytes()), len(samples)))
+print('First 1000 messages compressed one by one: %d bytes plain, %d without and %d with the dictionary' % (plain, compressed(None), compressed(dictionary)))